@@ -0,0 +1,32 @@
+#!/bin/sh
+# Run the guest benchmarks under rv32emu and print one JSON object per line:
+#   bench, flags, insns (guest instructions retired), wall_us, mips,
+#   ns_per_insn (host time per guest instruction) and result (the last line
+#   the guest printed: its checksum, if it ran to completion).
+# Arguments are passed to rv32emu (e.g. -j). BENCHES names the programs in
+# bench/, BENCH_INSNS caps each run at that many guest instructions.
+#
+# The .bin files are prebuilt from the .S next to them:
+#   llvm-mc -triple=riscv32 -mattr=+m -filetype=obj x.S -o x.o
+#   llvm-objcopy -O binary -j .text x.o x.bin
+# with -mattr=+m,+f,+d for fp.S and -mattr=+m,+zba,+zbb,+zbs for strings.S.
+
+cd "$(dirname "$0")/.." || exit 1
+: "${BENCHES:=intloop memcpy branchy coremark coremark-rvc uart virtio-console timer muldiv muldiv-soft sv32 fusion smc fp strings strings-base}"
+: "${BENCH_INSNS:=1000000000}"
+
+for b in $BENCHES; do
+	case $b in
+	virtio-*) dev=-V ;;
+	*) dev= ;;
+	esac
+	./rv32emu -k "bench/$b.bin" -n "$BENCH_INSNS" $dev "$@" < /dev/null | awk -v b="$b" -v f="$*" '
+		/^PC: / { result = prev }
+		/^Insns: / { insns = $2 + 0; wall = $4 + 0; mips = $6; ns = $8 }
+		{ prev = $0 }
+		END {
+			printf "{\"bench\": \"%s\", \"flags\": \"%s\", \"insns\": %.0f, \"wall_us\": %.0f, ",
+			       b, f, insns, wall
+			printf "\"mips\": %s, \"ns_per_insn\": %s, \"result\": \"%s\"}\n", mips, ns, result
+		}'
+done
@@ -0,0 +1,137 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __LIBRV32EMU_H__
+#define __LIBRV32EMU_H__
+
+/* librv32emu: whole RV32 machines behind an opaque handle, see riscv-vm.c.
+ *
+ * A machine is RAM, its harts, the CLINT, an 8250 UART and a SYSCON, plus
+ * whatever devices the host attaches. Machines share nothing, so any number
+ * of them can run at once, each on whichever thread calls RV32_vm_run; a
+ * single machine must only be driven from one thread at a time. */
+
+typedef struct RV32_vm RV32_vm;
+
+enum {
+	RV32_ENGINE_STEP,         // Interpreter, RV32_step.
+	RV32_ENGINE_BLOCKS,       // Threaded blocks, RV32_step_blocks.
+	RV32_ENGINE_JIT,          // x86-64 JIT, RV32_step_jit.
+	RV32_ENGINE_JIT_LOCKSTEP, // JIT checked against the interpreter, one hart only.
+};
+
+/* What RV32_vm_run and RV32_vm_step return; a store to an attached device
+ * that returns non-zero is handed back as is. */
+enum {
+	RV32_VM_RUNNING = 0,       // The instruction budget ran out.
+	RV32_VM_IDLE = 1,          // Every hart waits for an interrupt.
+	RV32_VM_POWEROFF = 3,      // SYSCON 0x5555.
+	RV32_VM_FAIL = 0x3333,     // SYSCON 0x3333 | code << 16, handed back whole.
+	RV32_VM_SNAPSHOT = 0x6666, // SYSCON 0x6666, the guest asks to be saved.
+	RV32_VM_RESTART = 0x7777,  // SYSCON 0x7777.
+	RV32_VM_FORK = 0x8888,     // SYSCON 0x8888, the guest asks to be cloned.
+};
+
+typedef struct RV32_vm_config {
+	uint32_t ram_size; // Bytes, 64MiB if 0.
+	uint32_t nharts;   // 1 if 0.
+	int engine;        // RV32_ENGINE_*.
+	int hugepages;
+	// Every byte the guest writes to the consoles. NULL drops them.
+	void (*console_out)(void* opaque, const uint8_t* buf, size_t len);
+	// Asked for more input when a console has none queued by RV32_vm_input.
+	// Must not block; returns how many bytes it stored. May be NULL.
+	size_t (*console_in)(void* opaque, uint8_t* buf, size_t len);
+	void* opaque; // Passed to the console callbacks.
+} RV32_vm_config;
+
+RV32_vm* RV32_vm_create(const RV32_vm_config* cfg);
+void RV32_vm_destroy(RV32_vm* vm);
+
+/* Kernel image at the start of RAM and a DTB at its end, then reset. With
+ * no DTB the built-in one is used, patched to the RAM size. */
+int RV32_vm_load(RV32_vm* vm, const void* image, size_t image_len, const void* dtb,
+                 size_t dtb_len);
+/* Same, straight from files. Returns 0, -2 if dtb_path cannot be opened,
+ * -3 for image_path, -4 if they do not fit in RAM, -5 or -6 if reading
+ * the image or the DTB failed. */
+int RV32_vm_load_files(RV32_vm* vm, const char* image_path, const char* dtb_path);
+/* Every hart back to the entry point, RAM as it is. Hart 0 boots, the
+ * others wait in WFI for an IPI. */
+void RV32_vm_reset(RV32_vm* vm);
+
+/* What the guest reads from SYSCON + 4: which clone of a forked machine
+ * this is, 1 onwards, 0 (the default) for the original. */
+void RV32_vm_set_fork_index(RV32_vm* vm, uint32_t index);
+/* Also for a clone: writable disks become copy-on-write, so what it
+ * writes stays in its memory rather than the image every clone shares. */
+int RV32_vm_private_disks(RV32_vm* vm);
+
+/* Device state that snapshots of the harts and RAM leave out: the PLIC and
+ * what the guest's drivers set up in each virtio device. Saved as a
+ * malloc'd buffer of *len bytes; restoring wants the same devices attached
+ * in the same order, and returns -1 otherwise. */
+void* RV32_vm_save_devices(RV32_vm* vm, uint32_t* len);
+int RV32_vm_restore_devices(RV32_vm* vm, const void* buf, uint32_t len);
+
+/* Runs up to insns instructions on every hart, taking turns a quantum at a
+ * time, with the guest clock sampled between quanta. */
+int32_t RV32_vm_run(RV32_vm* vm, uint64_t insns);
+/* Queues console input for the guest; returns how much fit. Safe to call
+ * from one other thread while the machine runs. */
+size_t RV32_vm_input(RV32_vm* vm, const void* buf, size_t len);
+/* A device on every hart's bus; store's non-zero returns end the run. */
+int RV32_vm_attach(RV32_vm* vm, uint32_t base, uint32_t size,
+                   uint32_t (*load)(void* opaque, uint32_t addr, int size),
+                   uint32_t (*store)(void* opaque, uint32_t addr, uint32_t val, int size),
+                   void* opaque);
+/* A virtio-mmio block device backed by a disk image, mapped rather than
+ * read, so the guest pages it in on demand. Opened read-only if readonly is
+ * set or the file cannot be written. Attach disks before RV32_vm_load for
+ * the built-in DTB to list them (with the PLIC they interrupt through) as
+ * /dev/vda, /dev/vdb... Returns -2 if the image cannot be opened. */
+int RV32_vm_attach_disk(RV32_vm* vm, const char* path, int readonly);
+/* A virtio console (/dev/hvc0) on the same console callbacks and input
+ * queue as the UART, moving whole buffers per guest request instead of a
+ * trap per byte. Boot with console=hvc0 to put the kernel on it. */
+int RV32_vm_attach_console(RV32_vm* vm);
+
+/* Guest clock in microseconds, and the earliest timer match of any hart,
+ * 0 for none: a host can sleep until then after RV32_VM_IDLE. */
+uint64_t RV32_vm_time(RV32_vm* vm);
+uint64_t RV32_vm_next_timer(RV32_vm* vm);
+/* Instructions retired so far, summed over harts. */
+uint64_t RV32_vm_insns(RV32_vm* vm);
+
+/* For hosts that run each hart on a thread of their own (rv32emu.c): one
+ * step of one hart at guest time now, with the machine's engine. count is
+ * an upper bound: the step ends early when the hart's timer is due, going
+ * by how fast it has been running, or when the guest moves its timer. */
+struct RV32_CPU;
+uint32_t RV32_vm_nharts(RV32_vm* vm);
+struct RV32_CPU* const* RV32_vm_harts(RV32_vm* vm);
+int32_t RV32_vm_step(RV32_vm* vm, uint32_t hart, uint64_t now, int count);
+
+/* Fleets: many independent jobs, each a machine of its own, time sliced
+ * onto a pool of host threads that steal work from each other. Machines
+ * waiting for an interrupt are parked and cost no CPU. See riscv-fleet.c. */
+typedef struct RV32_job {
+	const char* image;
+	const char* dtb;    // NULL for the built-in one.
+	uint32_t ram_size;  // 0 for 64MiB.
+	const char* input;  // File fed to the console, NULL for none.
+	const char* output; // File for console output, NULL to drop it.
+	const char* disk;   // Read-only virtio disk image, NULL for none.
+	uint64_t max_insns; // Stop the job after this many, 0 for no limit.
+	// Filled in by RV32_fleet_run.
+	int32_t status;      // How RV32_vm_run ended the job, negative if it never started.
+	uint64_t insns;
+	uint64_t run_us;     // Time spent running on a host thread.
+	uint64_t latency_us; // From the start of the fleet to the end of the job.
+} RV32_job;
+
+/* Runs every job to completion on nthreads threads, 0 for one per CPU.
+ * Returns -1 if the pool could not be set up. */
+int RV32_fleet_run(RV32_job* jobs, uint32_t njobs, uint32_t nthreads, int engine);
+
+#endif
@@ -1,5 +1,12 @@
+#define _GNU_SOURCE
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "riscv-emu.h"
 
+#define RV32_CAST8B(ofs)       *(uint64_t*)(state->mem + ofs)
 #define RV32_CAST4B(ofs)       *(uint32_t*)(state->mem + ofs)
 #define RV32_CAST2B(ofs)       *(uint16_t*)(state->mem + ofs)
 #define RV32_CAST1B(ofs)       *(uint8_t*)(state->mem + ofs)
@@ -7,35 +14,192 @@
 #define CONCAT(A, B) A##B
 #define CSR(x) state->csr[CONCAT(csr_, x)]
 #define REG(x) state->regs[x]
+#define FUNCT3(in) (((in)->ir >> 12) & 0x7)
+#define CODE_MAPPED(ofs) (state->code_map[(ofs) >> 17] & (1u << (((ofs) >> 12) & 31)))
+
+#define MSTATUS_SIE (1 << 1)
+#define MSTATUS_MIE (1 << 3)
+#define MSTATUS_SPIE (1 << 5)
+#define MSTATUS_MPIE (1 << 7)
+#define MSTATUS_SPP (1 << 8)
+#define MSTATUS_MPP (3 << 11)
+#define MSTATUS_MPRV (1 << 17)
+#define MSTATUS_SUM (1 << 18)
+#define MSTATUS_MXR (1 << 19)
+#define MSTATUS_TVM (1 << 20)
+#define MSTATUS_TW (1 << 21)
+#define MSTATUS_TSR (1 << 22)
+// What sstatus shows of mstatus.
+#define SSTATUS_MASK (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | RV32_MSTATUS_FS | MSTATUS_SUM | \
+                      MSTATUS_MXR | RV32_MSTATUS_SD)
+
+#define PTE_V (1 << 0)
+#define PTE_R (1 << 1)
+#define PTE_W (1 << 2)
+#define PTE_X (1 << 3)
+#define PTE_U (1 << 4)
+#define PTE_A (1 << 6)
+#define PTE_D (1 << 7)
 
 static uint32_t get_pc(RV32_CPU* state) { return CSR(pc) - state->base_ofs; }
-static uint32_t op_branch(RV32_CPU* state);
-static uint32_t op_load(RV32_CPU* state, uint32_t* rrval);
-static uint32_t op_store(RV32_CPU* state, uint32_t* rval);
-static uint32_t op_arithmetic(RV32_CPU* state, uint32_t* rrval);
-static uint32_t op_csr(RV32_CPU* state, uint32_t* rval);
-static uint32_t op_amo(RV32_CPU* state, uint32_t* rval);
-static uint32_t handle_op(RV32_CPU* state);
+static uint32_t op_lui(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t op_auipc(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t op_jal(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t op_jalr(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t op_branch(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t op_load(RV32_CPU* state, const RV32_insn* in, uint32_t ofs, uint32_t* rrval);
+static uint32_t op_store(RV32_CPU* state, const RV32_insn* in, uint32_t ofs, uint32_t* rval);
+static uint32_t op_fp_load(RV32_CPU* state, const RV32_insn* in, uint32_t ofs, uint32_t* rval);
+static uint32_t op_fp_store(RV32_CPU* state, const RV32_insn* in, uint32_t ofs, uint32_t* rval);
+static uint32_t op_arithmetic(RV32_CPU* state, const RV32_insn* in, uint32_t* rrval);
+static uint32_t muldiv(uint32_t funct3, uint32_t rs1, uint32_t rs2);
+static int base_alu(uint32_t ir);
+static int bitmanip(uint32_t ir, uint32_t rs1, uint32_t rs2, uint32_t* rval);
+static uint32_t op_csr(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t op_amo(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t op_fence(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static void decode_op(RV32_CPU* state, RV32_insn* in, uint32_t ofs_pc);
+static void decode_ir(RV32_insn* in, uint32_t ir, uint32_t quadrant);
+static uint32_t expand_rvc(uint32_t c);
+static void invalidate_op(RV32_CPU* state, uint32_t ofs);
+static void invalidate_code(RV32_CPU* state, uint32_t ofs, uint32_t len);
+static void drop_blocks(RV32_CPU* state, uint32_t ofs, uint32_t len);
+static uint32_t handle_op(RV32_CPU* state, uint32_t ofs_pc, uint32_t* tval);
+static uint32_t handle_paged_op(RV32_CPU* state, uint32_t* tval);
+static uint32_t execute_op(RV32_CPU* state, const RV32_insn* in, uint32_t* tval);
+static uint32_t execute_mmio(RV32_CPU* state, const RV32_insn* in, uint32_t* tval);
+static uint32_t execute_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* tval);
+static uint32_t retire_op(RV32_CPU* state, const RV32_insn* in, uint32_t trap, uint32_t rval,
+                          uint32_t* tval);
+static uint32_t load_mmio(RV32_CPU* state, const RV32_insn* in, uint32_t addy, uint32_t* rrval);
+static uint32_t store_mmio(RV32_CPU* state, const RV32_insn* in, uint32_t addy, uint32_t* rval);
+static uint32_t load_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* rrval);
+static uint32_t store_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static uint32_t fp_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+static inline uint32_t translate(RV32_CPU* state, uint32_t va, int access, uint32_t* ofs);
+static uint32_t translate_data(RV32_CPU* state, uint32_t va, uint32_t size, int access,
+                               uint32_t* ofs);
+static uint32_t walk(RV32_CPU* state, uint32_t va, int access, int s, RV32_tlb* e,
+                     uint32_t* ofs);
+static void update_mmu(RV32_CPU* state);
+static int fold_posted(RV32_CPU* state);
+static uint32_t irq_enabled(RV32_CPU* state, uint32_t irq);
+static void handle_trap(RV32_CPU* state, uint32_t trap, uint32_t rval);
+static int32_t run_guarded(RV32_CPU* state, int count, int32_t (*run)(RV32_CPU*, int));
+static int32_t retry_mmio(RV32_CPU* state);
+static RV32_device* find_device(RV32_CPU* state, uint32_t addr);
+static int32_t host_request(RV32_CPU* state);
+static int32_t step_insns(RV32_CPU* state, int count);
+static int32_t step_blocks(RV32_CPU* state, int count);
+
+// Guest RAM accesses go straight to the host window; one that lands outside
+// RAM raises SIGSEGV, and the handler jumps back here to finish the
+// instruction through the MMIO path.
+static _Thread_local sigjmp_buf* fault_jmp;
+static _Thread_local RV32_CPU* fault_cpu;
+
+// Whatever retry_mmio reads must be in memory before an access that can fault.
+#define FAULT_BARRIER() __asm__ volatile("" ::: "memory")
+// RAM offset of a load or store, if untranslated.
+#define DATA_OFS(in) (REG((in)->rs1) + (in)->imm - state->base_ofs)
+#define IN_RAM(in) (DATA_OFS(in) < state->total_mem - 3)
+
+// Not a guest trap: a device store asked to hand bus.request to the host.
+#define TRAP_HOST 0x40000000
 
 int32_t RV32_step(RV32_CPU* state, int count) {
+	int32_t ret;
 
-	// Handle Timer interrupt.
-	if ((CSR(timerh) > CSR(timermatchh) ||
-	     (CSR(timerh) == CSR(timermatchh) && CSR(timerl) > CSR(timermatchl))) &&
-	    (CSR(timermatchh) || CSR(timermatchl))) {
-		CSR(extraflags) &= ~4; // Clear WFI
-		CSR(mip) |= 1 << 7; // MTIP of MIP // https://stackoverflow.com/a/61916199/2926815
-		                    // Fire interrupt.
-	} else
-		CSR(mip) &= ~(1 << 7);
+	RV32_update_timer(state);
+
+	// If WFI, don't run processor.
+	if (CSR(extraflags) & 4)
+		return 1;
+	ret = run_guarded(state, count, step_insns);
+	RV32_fp_fold_flags(state);
+	return ret;
+}
+
+// RV32_step for callers that have already sampled the timer this step, and
+// that fold in the FP flags once they are done (RV32_fp_fold_flags).
+int32_t RV32_run(RV32_CPU* state, int count) {
+	return run_guarded(state, count, step_insns);
+}
+
+int32_t RV32_step_blocks(RV32_CPU* state, int count) {
+	int32_t ret;
+
+	RV32_update_timer(state);
 
 	// If WFI, don't run processor.
 	if (CSR(extraflags) & 4)
 		return 1;
+	// Blocks are keyed by RAM offset and access RAM untranslated.
+	ret = run_guarded(state, count, state->mmu ? step_insns : step_blocks);
+	RV32_fp_fold_flags(state);
+	return ret;
+}
+
+static int32_t run_guarded(RV32_CPU* state, int count, int32_t (*run)(RV32_CPU*, int)) {
+	sigjmp_buf fault, *outer_jmp = fault_jmp;
+	RV32_CPU* outer_cpu = fault_cpu;
+	uint64_t end = (CSR(cyclel) | ((uint64_t)CSR(cycleh) << 32)) + count;
+	uint64_t cycle;
+	int32_t ret = 0;
+
+	fault_jmp = &fault;
+	fault_cpu = state;
+	if (sigsetjmp(fault, 0))
+		ret = retry_mmio(state);
+	// Carry on with whatever is left of count after a fault, without
+	// sampling the timer again mid-step.
+	cycle = CSR(cyclel) | ((uint64_t)CSR(cycleh) << 32);
+	if (!ret && cycle < end)
+		ret = run(state, end - cycle);
+	fault_jmp = outer_jmp;
+	fault_cpu = outer_cpu;
+	return ret;
+}
+
+// The instruction at pc touched memory outside RAM. Nothing was written, so
+// run it again through the MMIO path, and patch its cache entry so it checks
+// the address from now on instead of faulting every time.
+static int32_t retry_mmio(RV32_CPU* state) {
+	uint32_t ofs_pc = get_pc(state);
+	RV32_insn* in = &state->icache[RV32_ICACHE_SLOT(ofs_pc)];
+	uint32_t trap, tval = 0;
+
+	if (in->tag != ofs_pc || in->op == rv32_op_decode)
+		decode_op(state, in, ofs_pc);
+	if (in->op == rv32_op_load)
+		in->op = rv32_op_load_mmio;
+	else if (in->op == rv32_op_store)
+		in->op = rv32_op_store_mmio;
+	trap = execute_mmio(state, in, &tval);
+	if (trap == TRAP_HOST) {
+		CSR(pc) += 4;
+		return host_request(state);
+	}
+	if (trap)
+		handle_trap(state, trap, tval);
+	CSR(pc) += 4;
+	return 0;
+}
+
+static void fault_handler(int sig, siginfo_t* info, void* ctx) {
+	uint8_t* addr = info->si_addr;
+
+	if (fault_jmp && addr >= fault_cpu->mem && addr < fault_cpu->mem + RV32_RAM_WINDOW)
+		siglongjmp(*fault_jmp, 1);
+	signal(SIGSEGV, SIG_DFL); // A real crash, let it happen.
+}
 
+static int32_t step_insns(RV32_CPU* state, int count) {
 	for (int icount = 0; icount < count; icount++) {
 		uint32_t trap = 0;
 		uint32_t rval = 0;
+		if (__atomic_load_n(&state->posted, __ATOMIC_RELAXED) && fold_posted(state))
+			break;
 		// Increment both wall-clock and instruction count time.  (NOTE: Not
 		// strictly needed to run Linux)
 		CSR(cyclel)++;
@@ -44,34 +208,21 @@ int32_t RV32_step(RV32_CPU* state, int count) {
 
 		uint32_t ofs_pc = get_pc(state);
 
-		if (ofs_pc >= state->total_mem)
+		if (state->mmu)
+			trap = handle_paged_op(state, &rval);
+		else if (ofs_pc >= state->total_mem)
 			trap = 1 + 1; // Handle access violation on instruction read.
-		else if (ofs_pc & 3)
+		else if (ofs_pc & 1)
 			trap = 1 + 0; // Handle PC-misaligned access
 		else
-			trap = handle_op(state);
+			trap = handle_op(state, ofs_pc, &rval);
 		// Handle traps and interrupts.
 		if (trap) {
-			if (trap & 0x80000000) // If prefixed with 1 in MSB, it's an interrupt,
-			                       // not a trap.
-			{
-				CSR(extraflags) &= ~8;
-				CSR(mcause) = trap;
-				CSR(mtval) = 0;
-				CSR(pc) += 4; // PC needs to point to where the PC will return to.
-			} else {
-				CSR(mcause) = trap - 1;
-				CSR(mtval) = (trap > 5 && trap <= 8) ? rval : CSR(pc);
+			if (trap == TRAP_HOST) {
+				CSR(pc) += 4;
+				return host_request(state);
 			}
-			CSR(mepc) = CSR(pc); // TRICKY: The kernel advances mepc automatically.
-			// CSR( mstatus ) & 8 = MIE, & 0x80 = MPIE
-			//  On an interrupt, the system moves current MIE into MPIE
-			CSR(mstatus) = ((CSR(mstatus) & 0x08) << 4) | ((CSR(extraflags) & 3) << 11);
-			CSR(pc) = (CSR(mtvec) - 4);
-
-			// XXX TODO: Do we actually want to check here? Is this correct?
-			if (!(trap & 0x80000000))
-				CSR(extraflags) |= 3;
+			handle_trap(state, trap, rval);
 		}
 
 		CSR(pc) += 4;
@@ -79,87 +230,1236 @@ int32_t RV32_step(RV32_CPU* state, int count) {
 	return 0;
 }
 
-static uint32_t handle_op(RV32_CPU* state) {
-	uint32_t rval = 0, trap = 0, ir;
-	ir = RV32_CAST4B(get_pc(state));
-	uint32_t rdid = (ir >> 7) & 0x1f;
+static int32_t host_request(RV32_CPU* state) {
+	int32_t request = state->bus.request;
+
+	state->bus.request = 0;
+	return request;
+}
+
+void RV32_update_timer(RV32_CPU* state) {
+	// Handle Timer interrupt.
+	if ((CSR(timerh) > CSR(timermatchh) ||
+	     (CSR(timerh) == CSR(timermatchh) && CSR(timerl) > CSR(timermatchl))) &&
+	    (CSR(timermatchh) || CSR(timermatchl))) {
+		CSR(extraflags) &= ~4; // Clear WFI
+		CSR(mip) |= 1 << 7; // MTIP of MIP // https://stackoverflow.com/a/61916199/2926815
+		                    // Fire interrupt.
+	} else
+		CSR(mip) &= ~(1 << 7);
+	// MSIP of MIP, posted by any hart through the CLINT.
+	if (__atomic_load_n(&state->msip, __ATOMIC_ACQUIRE)) {
+		CSR(extraflags) &= ~4;
+		CSR(mip) |= 1 << 3;
+	} else
+		CSR(mip) &= ~(1 << 3);
+	// MEIP, raised and lowered by the PLIC.
+	if (__atomic_load_n(&state->meip, __ATOMIC_ACQUIRE)) {
+		CSR(extraflags) &= ~4;
+		CSR(mip) |= 1 << 11;
+	} else
+		CSR(mip) &= ~(1 << 11);
+}
+
+// Another thread changed something of hart's: it takes effect at the hart's
+// next block boundary, and ends its WFI.
+void RV32_post(RV32_CPU* hart, uint32_t what) {
+	__atomic_fetch_or(&hart->posted, what, __ATOMIC_RELEASE);
+	if (hart->kick)
+		hart->kick(hart);
+}
+
+// Returns whether the step should end. Cleared first, so a post that races
+// with the update is seen next time.
+static int fold_posted(RV32_CPU* state) {
+	uint32_t what = __atomic_exchange_n(&state->posted, 0, __ATOMIC_ACQUIRE);
+
+	RV32_update_timer(state);
+	return what & RV32_POST_TIMER;
+}
+
+// Traps go to M-mode unless they come from below it and medeleg/mideleg
+// hand them to S-mode.
+static void handle_trap(RV32_CPU* state, uint32_t trap, uint32_t rval) {
+	uint32_t priv = CSR(extraflags) & 3;
+	uint32_t cause, tval, deleg;
+
+	if (trap & 0x80000000) // If prefixed with 1 in MSB, it's an interrupt,
+	                       // not a trap.
+	{
+		RV32_STAT(state, irqs[trap & 15]);
+		// Taking an interrupt ends any WFI: the hart may have work now, so
+		// the host must not go to sleep at the end of this step.
+		CSR(extraflags) &= ~(8 | 4);
+		cause = trap;
+		tval = 0;
+		deleg = CSR(mideleg);
+		CSR(pc) += 4; // PC needs to point to where the PC will return to.
+	} else {
+		RV32_STAT(state, traps[(trap - 1) & 15]);
+		cause = trap - 1;
+		// Misaligned, access and page faults on data, and page faults on
+		// fetch, report the address; the rest the pc.
+		tval = ((1u << (cause & 31)) & 0xb0f0) ? rval : CSR(pc);
+		deleg = CSR(medeleg);
+	}
+	if (priv < 3 && ((deleg >> (cause & 31)) & 1)) {
+		CSR(scause) = cause;
+		CSR(stval) = tval;
+		CSR(sepc) = CSR(pc);
+		CSR(mstatus) = (CSR(mstatus) & ~(MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) |
+		               ((CSR(mstatus) & MSTATUS_SIE) << 4) | (priv << 8);
+		CSR(pc) = CSR(stvec) - 4;
+		CSR(extraflags) = (CSR(extraflags) & ~3) | 1;
+	} else {
+		CSR(mcause) = cause;
+		CSR(mtval) = tval;
+		CSR(mepc) = CSR(pc); // TRICKY: The kernel advances mepc automatically.
+		// On a trap, the system moves current MIE into MPIE
+		CSR(mstatus) = (CSR(mstatus) & ~(MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP)) |
+		               ((CSR(mstatus) & MSTATUS_MIE) << 4) | (priv << 11);
+		CSR(pc) = (CSR(mtvec) - 4);
+		// Interrupts enter machine mode too. Leaving the hart in user mode
+		// made the kernel treat nested traps as coming from user space and
+		// reuse the live kernel stack.
+		CSR(extraflags) |= 3;
+	}
+	update_mmu(state);
+}
+
+// Operations the threaded engine has a dedicated label for. Anything else
+// runs through execute_op and ends its block.
+enum {
+	t_generic,
+	t_end,
+	t_nop,
+	t_lui,
+	t_auipc,
+	t_jal,
+	t_j,
+	t_jalr,
+	t_jr,
+	t_beq,
+	t_bne,
+	t_blt,
+	t_bge,
+	t_bltu,
+	t_bgeu,
+	t_lb,
+	t_lh,
+	t_lw,
+	t_lbu,
+	t_lhu,
+	t_sb,
+	t_sh,
+	t_sw,
+	t_addi,
+	t_slti,
+	t_sltiu,
+	t_xori,
+	t_ori,
+	t_andi,
+	t_slli,
+	t_srli,
+	t_srai,
+	t_add,
+	t_sub,
+	t_sll,
+	t_slt,
+	t_sltu,
+	t_xor,
+	t_srl,
+	t_sra,
+	t_or,
+	t_and,
+	t_muldiv,
+	t_bitmanip,
+	// Pairs, see fuse_op: the first instruction's label runs both.
+	t_lui_addi,
+	t_auipc_jalr,
+	t_auipc_lb,
+	t_auipc_lh,
+	t_auipc_lw,
+	t_auipc_lbu,
+	t_auipc_lhu,
+	t_slti_br,
+	t_sltiu_br,
+	t_slt_br,
+	t_sltu_br,
+	t_addi_bne,
+	t_count,
+};
+
+static int thread_op(const RV32_insn* in) {
+	static const uint8_t branches[8] = {t_beq, t_bne, t_generic, t_generic,
+	                                    t_blt, t_bge, t_bltu, t_bgeu};
+	static const uint8_t loads[8] = {t_lb, t_lh, t_lw, t_generic,
+	                                 t_lbu, t_lhu, t_generic, t_generic};
+	static const uint8_t stores[8] = {t_sb, t_sh, t_sw, t_generic,
+	                                  t_generic, t_generic, t_generic, t_generic};
+	static const uint8_t opimm[8] = {t_addi, t_slli, t_slti, t_sltiu,
+	                                 t_xori, t_srli, t_ori, t_andi};
+	static const uint8_t opreg[8] = {t_add, t_sll, t_slt, t_sltu,
+	                                 t_xor, t_srl, t_or, t_and};
+
+	switch (in->op) {
+	case rv32_op_lui:
+		return in->rd ? t_lui : t_nop;
+	case rv32_op_auipc:
+		return in->rd ? t_auipc : t_nop;
+	case rv32_op_jal:
+		return in->rd ? t_jal : t_j;
+	case rv32_op_jalr:
+		return in->rd ? t_jalr : t_jr;
+	case rv32_op_branch:
+		return branches[FUNCT3(in)];
+	case rv32_op_load:
+		return in->rd ? loads[FUNCT3(in)] : t_generic;
+	case rv32_op_store:
+		return stores[FUNCT3(in)];
+	case rv32_op_arithmetic:
+		if (in->ir & 0b100000) {
+			if (!in->rd)
+				return t_nop;
+			if (in->ir & 0x02000000)
+				return t_muldiv;
+			if (in->ir & 0x40000000) {
+				if (FUNCT3(in) == 0b000)
+					return t_sub;
+				if (FUNCT3(in) == 0b101)
+					return t_sra;
+			}
+			return opreg[FUNCT3(in)];
+		}
+		if (!in->rd)
+			return t_nop;
+		if (FUNCT3(in) == 0b101 && (in->ir & 0x40000000))
+			return t_srai;
+		return opimm[FUNCT3(in)];
+	case rv32_op_bitmanip:
+		return in->rd ? t_bitmanip : t_nop;
+	default:
+		return t_generic;
+	}
+}
+
+// Control transfers and anything that needs the full CPU state end a block.
+static int ends_block(int op) {
+	return op == t_generic || op == t_jal || op == t_j || op == t_jalr || op == t_jr ||
+	       (op >= t_beq && op <= t_bgeu);
+}
+
+// The label running a and the instruction b after it as one, or op_a when
+// they are no pair. The second keeps its own entry, so the pair's label can
+// step onto it and leave through the second's usual path: a fault there
+// finds pc, the cycle count and the first's result as if run one by one.
+static int fuse_op(const RV32_insn* a, int op_a, const RV32_insn* b, int op_b) {
+#ifndef RV32_NO_FUSION
+	switch (op_a) {
+	case t_lui:
+		if (op_b == t_addi && b->rs1 == a->rd)
+			return t_lui_addi;
+		break;
+	case t_auipc:
+		if (b->rs1 != a->rd)
+			break;
+		if (op_b == t_jalr || op_b == t_jr)
+			return t_auipc_jalr;
+		if (op_b >= t_lb && op_b <= t_lhu)
+			return t_auipc_lb + op_b - t_lb;
+		break;
+	case t_slti:
+	case t_sltiu:
+	case t_slt:
+	case t_sltu:
+		// Only against x0 does the 0 or 1 in rd decide the branch alone.
+		if ((op_b == t_beq || op_b == t_bne) &&
+		    ((b->rs1 == a->rd && !b->rs2) || (b->rs2 == a->rd && !b->rs1)))
+			return op_a == t_slti ? t_slti_br : op_a == t_sltiu ? t_sltiu_br
+			     : op_a == t_slt ? t_slt_br : t_sltu_br;
+		break;
+	case t_addi:
+		if (op_b == t_bne && (b->rs1 == a->rd || b->rs2 == a->rd))
+			return t_addi_bne;
+		break;
+	}
+#endif
+	return op_a;
+}
+
+static RV32_block* build_block(RV32_CPU* state, uint32_t ofs, const void* const* handlers) {
+	RV32_blocks* bc = &state->blocks;
+	RV32_block* b;
+	RV32_tinsn* t;
+	uint8_t ops[RV32_BLOCK_MAX];
+	int op = t_end;
+
+	if (bc->nblocks == sizeof(bc->pool) / sizeof(bc->pool[0]) ||
+	    bc->ncode + RV32_BLOCK_MAX + 1 > RV32_BLOCK_POOL)
+		RV32_flush_code(state);
+
+	b = &bc->pool[bc->nblocks++];
+	b->start = ofs;
+	b->code = t = &bc->code[bc->ncode];
+	b->next[0] = b->next[1] = NULL;
+	for (b->len = 0; b->len < RV32_BLOCK_MAX; b->len++, ofs += RV32_INSN_LEN(&t->in), t++) {
+		if (ofs > state->total_mem - 4)
+			break;
+		decode_op(state, &t->in, ofs);
+		op = ops[b->len] = thread_op(&t->in);
+		t->handler = handlers[op];
+		if (ends_block(op)) {
+			b->len++;
+			break;
+		}
+	}
+	b->end = b->code[b->len - 1].in.tag + RV32_INSN_LEN(&b->code[b->len - 1].in);
+	for (uint32_t i = 0; i + 1 < b->len; i++)
+		b->code[i].handler = handlers[fuse_op(&b->code[i].in, ops[i], &b->code[i + 1].in,
+		                                      ops[i + 1])];
+	// Blocks cut short by length or the end of RAM fall through.
+	if (!ends_block(op)) {
+		t->in.tag = ofs;
+		t->handler = handlers[t_end];
+		bc->ncode++;
+	}
+	bc->ncode += b->len;
+	bc->map[(b->start >> 1) & ((1 << RV32_BLOCK_BITS) - 1)] = b;
+	b->page_next = bc->pages[(b->start >> 12) & ((1 << RV32_BLOCK_PAGE_BITS) - 1)];
+	bc->pages[(b->start >> 12) & ((1 << RV32_BLOCK_PAGE_BITS) - 1)] = b;
+	return b;
+}
+
+#ifdef RV32_STATS
+// Instructions [from, to) of a block ran on its fast path.
+static void stat_block(RV32_CPU* state, const RV32_tinsn* from, const RV32_tinsn* to) {
+	for (; from < to; from++)
+		RV32_STAT(state, opcodes[(from->in.ir >> 2) & 31]);
+}
+#define STAT_BLOCK(from, to) stat_block(state, from, to)
+#else
+#define STAT_BLOCK(from, to) ((void)0)
+#endif
+
+// The interrupt to take now, as a trap code, or 0. Delegated ones go to
+// S-mode, taken below it or in it with sstatus.SIE; the rest to M-mode,
+// always taken below it. Then external beats software (IPI) beats timer.
+static uint32_t irq_pending(RV32_CPU* state) {
+	uint32_t irq = CSR(mip) & CSR(mie) & RV32_IRQ_MASK;
+
+	return irq ? irq_enabled(state, irq) : 0;
+}
+
+static uint32_t irq_enabled(RV32_CPU* state, uint32_t irq) {
+	static const uint8_t order[] = {11, 3, 7, 9, 1, 5};
+	uint32_t priv = CSR(extraflags) & 3, m, s;
+
+	m = irq & ~CSR(mideleg);
+	s = irq & CSR(mideleg);
+	if (priv == 3 && !(CSR(mstatus) & MSTATUS_MIE))
+		m = 0;
+	if (priv == 3 || (priv == 1 && !(CSR(mstatus) & MSTATUS_SIE)))
+		s = 0;
+	irq = m ? m : s;
+	for (uint32_t i = 0; irq && i < sizeof(order); i++)
+		if (irq & (1 << order[i]))
+			return 0x80000000 | order[i];
+	return 0;
+}
+
+uint32_t RV32_irq_pending(RV32_CPU* state) {
+	return irq_pending(state);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // Computed goto.
+
+// Same machine as RV32_step, but run a basic block at a time with direct
+// threaded dispatch. pc and the cycle counter stay in locals and are only
+// written back to the CSRs when something outside the block needs them.
+static int32_t step_blocks(RV32_CPU* state, int count) {
+	static const void* const handlers[t_count] = {
+		[t_generic] = &&do_generic, [t_end] = &&do_end, [t_nop] = &&do_nop,
+		[t_lui] = &&do_lui, [t_auipc] = &&do_auipc,
+		[t_jal] = &&do_jal, [t_j] = &&do_j, [t_jalr] = &&do_jalr, [t_jr] = &&do_jr,
+		[t_beq] = &&do_beq, [t_bne] = &&do_bne, [t_blt] = &&do_blt,
+		[t_bge] = &&do_bge, [t_bltu] = &&do_bltu, [t_bgeu] = &&do_bgeu,
+		[t_lb] = &&do_lb, [t_lh] = &&do_lh, [t_lw] = &&do_lw,
+		[t_lbu] = &&do_lbu, [t_lhu] = &&do_lhu,
+		[t_sb] = &&do_sb, [t_sh] = &&do_sh, [t_sw] = &&do_sw,
+		[t_addi] = &&do_addi, [t_slti] = &&do_slti, [t_sltiu] = &&do_sltiu,
+		[t_xori] = &&do_xori, [t_ori] = &&do_ori, [t_andi] = &&do_andi,
+		[t_slli] = &&do_slli, [t_srli] = &&do_srli, [t_srai] = &&do_srai,
+		[t_add] = &&do_add, [t_sub] = &&do_sub, [t_sll] = &&do_sll,
+		[t_slt] = &&do_slt, [t_sltu] = &&do_sltu, [t_xor] = &&do_xor,
+		[t_srl] = &&do_srl, [t_sra] = &&do_sra, [t_or] = &&do_or, [t_and] = &&do_and,
+		[t_muldiv] = &&do_muldiv, [t_bitmanip] = &&do_bitmanip,
+		[t_lui_addi] = &&do_lui_addi, [t_auipc_jalr] = &&do_auipc_jalr,
+		[t_auipc_lb] = &&do_auipc_lb, [t_auipc_lh] = &&do_auipc_lh,
+		[t_auipc_lw] = &&do_auipc_lw, [t_auipc_lbu] = &&do_auipc_lbu,
+		[t_auipc_lhu] = &&do_auipc_lhu,
+		[t_slti_br] = &&do_slti_br, [t_sltiu_br] = &&do_sltiu_br,
+		[t_slt_br] = &&do_slt_br, [t_sltu_br] = &&do_sltu_br,
+		[t_addi_bne] = &&do_addi_bne,
+	};
+	RV32_blocks* bc = &state->blocks;
+	RV32_block *b, **chain = NULL;
+	const RV32_tinsn* t;
+	uint32_t pc, ofs, trap, tval, taken, irq, gen, val;
+	uint64_t cycle, end;
+
+	pc = CSR(pc);
+	cycle = CSR(cyclel) | ((uint64_t)CSR(cycleh) << 32);
+	end = cycle + count;
+	irq = irq_pending(state);
+
+#define T (t->in)
+#define PC_OF(t) (state->base_ofs + (t)->in.tag)
+#define LEN RV32_INSN_LEN(&T)
+#define NEXT   \
+	do {                      \
+		t++;                  \
+		goto *t->handler;     \
+	} while (0)
+#define SYNC()                                         \
+	do {                                           \
+		CSR(cyclel) = cycle & UINT32_MAX;      \
+		CSR(cycleh) = cycle >> 32;             \
+	} while (0)
+
+next_block:
+	if (cycle >= end)
+		goto out;
+	if (__atomic_load_n(&state->posted, __ATOMIC_RELAXED)) {
+		if (fold_posted(state))
+			goto out;
+		irq = irq_pending(state);
+	}
+	if (irq) {
+		CSR(pc) = pc - 4; // As if the previous instruction just retired.
+		SYNC();
+		handle_trap(state, irq, 0);
+		pc = CSR(pc) + 4;
+		irq = irq_pending(state);
+		chain = NULL;
+		if (state->mmu)
+			goto out; // Translation is on: the interpreter takes over.
+	}
+	ofs = pc - state->base_ofs;
+	if (chain && *chain && (*chain)->start == ofs) {
+		b = *chain;
+	} else {
+		if (ofs > state->total_mem - 4 || (ofs & 1)) {
+			// Handle access violation on instruction read / misaligned PC.
+			cycle++;
+			SYNC();
+			CSR(pc) = pc;
+			handle_trap(state, (ofs > state->total_mem - 4) ? (1 + 1) : (1 + 0), 0);
+			pc = CSR(pc) + 4;
+			irq = irq_pending(state);
+			chain = NULL;
+			if (state->mmu)
+				goto out;
+			goto next_block;
+		}
+		b = bc->map[(ofs >> 1) & ((1 << RV32_BLOCK_BITS) - 1)];
+		if (!b || b->start != ofs) {
+			gen = bc->gen;
+			b = build_block(state, ofs, handlers);
+			if (gen != bc->gen)
+				chain = NULL;
+		}
+		if (chain)
+			*chain = b;
+	}
+	if (end - cycle < b->len) {
+		// Not enough count left for the whole block: the interpreter
+		// finishes the step, so it ends exactly on its count.
+		CSR(pc) = pc;
+		SYNC();
+		return step_insns(state, end - cycle);
+	}
+	t = b->code;
+	goto *t->handler;
+
+block_exit: // pc and chain are set, t is the last instruction run.
+	STAT_BLOCK(b->code, t + 1);
+	cycle += t - b->code + 1;
+	goto next_block;
+
+do_mmio: // A load or store that missed RAM.
+	STAT_BLOCK(b->code, t); // retire_op counts t itself.
+	cycle += t - b->code + 1;
+	SYNC();
+	CSR(pc) = PC_OF(t);
+	trap = execute_mmio(state, &T, &tval);
+	goto do_trap;
+
+do_generic:
+	STAT_BLOCK(b->code, t);
+	cycle += t - b->code + 1;
+	SYNC();
+	CSR(pc) = PC_OF(t);
+	trap = execute_op(state, &T, &tval);
+do_trap:
+	if (trap == TRAP_HOST) {
+		CSR(pc) += 4;
+		return host_request(state);
+	}
+	if (trap)
+		handle_trap(state, trap, tval);
+	pc = CSR(pc) + 4;
+	cycle = CSR(cyclel) | ((uint64_t)CSR(cycleh) << 32);
+	irq = irq_pending(state);
+	chain = NULL;
+	if (CSR(extraflags) & 4)
+		goto out; // WFI
+	if (state->mmu)
+		goto out;
+	goto next_block;
+
+do_end:
+	STAT_BLOCK(b->code, t);
+	cycle += t - b->code;
+	pc = PC_OF(t);
+	chain = &b->next[0];
+	goto next_block;
+
+do_nop:
+	NEXT;
+do_lui:
+	REG(T.rd) = T.imm;
+	NEXT;
+do_auipc:
+	REG(T.rd) = PC_OF(t) + T.imm;
+	NEXT;
+
+do_jal:
+	REG(T.rd) = PC_OF(t) + LEN;
+do_j:
+	pc = PC_OF(t) + T.imm;
+	chain = &b->next[1];
+	goto block_exit;
+do_jalr:
+	pc = (REG(T.rs1) + T.imm) & ~1;
+	REG(T.rd) = PC_OF(t) + LEN;
+	chain = &b->next[1];
+	goto block_exit;
+do_jr:
+	pc = (REG(T.rs1) + T.imm) & ~1;
+	chain = &b->next[1];
+	goto block_exit;
+
+do_beq:
+	taken = REG(T.rs1) == REG(T.rs2);
+	goto do_branch;
+do_bne:
+	taken = REG(T.rs1) != REG(T.rs2);
+	goto do_branch;
+do_blt:
+	taken = (int32_t)REG(T.rs1) < (int32_t)REG(T.rs2);
+	goto do_branch;
+do_bge:
+	taken = (int32_t)REG(T.rs1) >= (int32_t)REG(T.rs2);
+	goto do_branch;
+do_bltu:
+	taken = REG(T.rs1) < REG(T.rs2);
+	goto do_branch;
+do_bgeu:
+	taken = REG(T.rs1) >= REG(T.rs2);
+do_branch:
+	pc = PC_OF(t) + (taken ? T.imm : LEN);
+	chain = &b->next[taken];
+	goto block_exit;
+
+	// RAM fast paths; MMIO and faults go through execute_mmio.
+#define LOAD(cast, expr)                                           \
+	ofs = REG(T.rs1) + T.imm - state->base_ofs;                \
+	if (ofs >= state->total_mem - 3)                           \
+		goto do_mmio;                                      \
+	REG(T.rd) = (cast)expr(ofs);                               \
+	NEXT;
+do_lb:
+	LOAD(int8_t, RV32_CAST1B)
+do_lh:
+	LOAD(int16_t, RV32_CAST2B)
+do_lw:
+	LOAD(uint32_t, RV32_CAST4B)
+do_lbu:
+	LOAD(uint8_t, RV32_CAST1B)
+do_lhu:
+	LOAD(uint16_t, RV32_CAST2B)
+
+#define STORE(expr, size)                                          \
+	ofs = REG(T.rs1) + T.imm - state->base_ofs;                \
+	if (ofs >= state->total_mem - 3)                           \
+		goto do_mmio;                                      \
+	expr(ofs) = REG(T.rs2);                                    \
+	if (CODE_MAPPED(ofs) || CODE_MAPPED(ofs + size - 1))       \
+		goto do_smc;                                       \
+	NEXT;
+do_sb:
+	STORE(RV32_CAST1B, 1)
+do_sh:
+	STORE(RV32_CAST2B, 2)
+do_sw:
+	STORE(RV32_CAST4B, 4)
+do_smc: // Carry on unless the store hit this very block.
+	invalidate_code(state, ofs, 1 << FUNCT3(&T));
+	if (b->start != ~0u)
+		NEXT;
+	pc = PC_OF(t) + LEN;
+	chain = NULL;
+	goto block_exit;
+
+#define ALU(expr)                   \
+	REG(T.rd) = (expr);         \
+	NEXT;
+do_addi:
+	ALU(REG(T.rs1) + T.imm)
+do_slti:
+	ALU((int32_t)REG(T.rs1) < T.imm)
+do_sltiu:
+	ALU(REG(T.rs1) < (uint32_t)T.imm)
+do_xori:
+	ALU(REG(T.rs1) ^ T.imm)
+do_ori:
+	ALU(REG(T.rs1) | T.imm)
+do_andi:
+	ALU(REG(T.rs1) & T.imm)
+do_slli:
+	ALU(REG(T.rs1) << (T.imm & 0x1f))
+do_srli:
+	ALU(REG(T.rs1) >> (T.imm & 0x1f))
+do_srai:
+	ALU((int32_t)REG(T.rs1) >> (T.imm & 0x1f))
+do_add:
+	ALU(REG(T.rs1) + REG(T.rs2))
+do_sub:
+	ALU(REG(T.rs1) - REG(T.rs2))
+do_sll:
+	ALU(REG(T.rs1) << (REG(T.rs2) & 0x1f))
+do_slt:
+	ALU((int32_t)REG(T.rs1) < (int32_t)REG(T.rs2))
+do_sltu:
+	ALU(REG(T.rs1) < REG(T.rs2))
+do_xor:
+	ALU(REG(T.rs1) ^ REG(T.rs2))
+do_srl:
+	ALU(REG(T.rs1) >> (REG(T.rs2) & 0x1f))
+do_sra:
+	ALU((int32_t)REG(T.rs1) >> (REG(T.rs2) & 0x1f))
+do_or:
+	ALU(REG(T.rs1) | REG(T.rs2))
+do_and:
+	ALU(REG(T.rs1) & REG(T.rs2))
+do_muldiv:
+	ALU(muldiv(FUNCT3(&T), REG(T.rs1), REG(T.rs2)))
+do_bitmanip:
+	bitmanip(T.ir, REG(T.rs1), (T.ir & 0b100000) ? REG(T.rs2) : (uint32_t)T.imm, &val);
+	ALU(val)
+
+	// Fused pairs: the first instruction, then on to the second's entry
+	// with a direct jump, or both at once where nothing can fault.
+do_lui_addi:
+	RV32_STAT(state, fused[RV32_FUSE_LUI_ADDI]);
+	REG(T.rd) = T.imm;
+	REG(t[1].in.rd) = T.imm + t[1].in.imm;
+	t += 2;
+	goto *t->handler;
+do_auipc_jalr:
+	RV32_STAT(state, fused[RV32_FUSE_AUIPC_JALR]);
+	REG(T.rd) = val = PC_OF(t) + T.imm;
+	t++;
+	pc = (val + T.imm) & ~1;
+	if (T.rd)
+		REG(T.rd) = PC_OF(t) + LEN;
+	chain = &b->next[1];
+	goto block_exit;
+#define AUIPC_LOAD(load)                                 \
+	RV32_STAT(state, fused[RV32_FUSE_AUIPC_LOAD]);   \
+	REG(T.rd) = PC_OF(t) + T.imm;                    \
+	t++;                                             \
+	goto load;
+do_auipc_lb:
+	AUIPC_LOAD(do_lb)
+do_auipc_lh:
+	AUIPC_LOAD(do_lh)
+do_auipc_lw:
+	AUIPC_LOAD(do_lw)
+do_auipc_lbu:
+	AUIPC_LOAD(do_lbu)
+do_auipc_lhu:
+	AUIPC_LOAD(do_lhu)
+	// rd is 0 or 1 against x0: BNEZ takes it on 1, BEQZ on 0.
+#define SLT_BRANCH(expr)                                 \
+	RV32_STAT(state, fused[RV32_FUSE_SLT_BRANCH]);   \
+	REG(T.rd) = taken = (expr);                      \
+	t++;                                             \
+	taken ^= FUNCT3(&T) ^ 1;                         \
+	goto do_branch;
+do_slti_br:
+	SLT_BRANCH((int32_t)REG(T.rs1) < T.imm)
+do_sltiu_br:
+	SLT_BRANCH(REG(T.rs1) < (uint32_t)T.imm)
+do_slt_br:
+	SLT_BRANCH((int32_t)REG(T.rs1) < (int32_t)REG(T.rs2))
+do_sltu_br:
+	SLT_BRANCH(REG(T.rs1) < REG(T.rs2))
+do_addi_bne:
+	RV32_STAT(state, fused[RV32_FUSE_ADDI_BNE]);
+	REG(T.rd) = REG(T.rs1) + T.imm;
+	t++;
+	taken = REG(T.rs1) != REG(T.rs2);
+	goto do_branch;
+
+out:
+	CSR(pc) = pc;
+	SYNC();
+	return 0;
+
+#undef T
+#undef PC_OF
+#undef LEN
+#undef NEXT
+#undef SYNC
+#undef LOAD
+#undef STORE
+#undef ALU
+#undef AUIPC_LOAD
+#undef SLT_BRANCH
+}
+
+#pragma GCC diagnostic pop
+
+static uint32_t handle_op(RV32_CPU* state, uint32_t ofs_pc, uint32_t* tval) {
+	RV32_insn* in = &state->icache[RV32_ICACHE_SLOT(ofs_pc)];
+
+	if (in->tag != ofs_pc || in->op == rv32_op_decode)
+		decode_op(state, in, ofs_pc);
+	return execute_op(state, in, tval);
+}
+
+// handle_op for a hart with translation on. The icache stays keyed by RAM
+// offset, which is right for any mapping; only a 32-bit instruction
+// straddling two pages is decoded on the side each time, its halves may be
+// anywhere.
+static uint32_t handle_paged_op(RV32_CPU* state, uint32_t* tval) {
+	uint32_t va = CSR(pc), ofs = get_pc(state), hi, trap;
+	int fetch = state->mmu & RV32_MMU_FETCH;
+	RV32_insn side, *in;
+
+	*tval = va;
+	if (va & 1)
+		return 1 + 0; // Handle PC-misaligned access
+	if (fetch && (trap = translate(state, va, RV32_ACCESS_FETCH, &ofs)))
+		return trap;
+	if (ofs >= state->total_mem)
+		return 1 + 1; // Handle access violation on instruction read.
+	if (!fetch || (va & 0xfff) != 0xffe || (RV32_CAST2B(ofs) & 3) != 3) {
+		in = &state->icache[RV32_ICACHE_SLOT(ofs)];
+		if (in->tag != ofs || in->op == rv32_op_decode)
+			decode_op(state, in, ofs);
+	} else {
+		*tval = va + 2;
+		if ((trap = translate(state, va + 2, RV32_ACCESS_FETCH, &hi)))
+			return trap;
+		if (hi >= state->total_mem)
+			return 1 + 1;
+		decode_ir(&side, RV32_CAST2B(ofs) | (uint32_t)RV32_CAST2B(hi) << 16, 3);
+		in = &side;
+	}
+	if (state->mmu & RV32_MMU_DATA)
+		return execute_paged(state, in, tval);
+	return execute_op(state, in, tval);
+}
+
+static uint32_t execute_op(RV32_CPU* state, const RV32_insn* in, uint32_t* tval) {
+	uint32_t rval = 0, trap = 0;
+
+	switch (in->op) {
+	case rv32_op_lui:
+		trap = op_lui(state, in, &rval);
+		break;
+	case rv32_op_auipc:
+		trap = op_auipc(state, in, &rval);
+		break;
+	case rv32_op_jal:
+		trap = op_jal(state, in, &rval);
+		break;
+	case rv32_op_jalr:
+		trap = op_jalr(state, in, &rval);
+		break;
+	case rv32_op_branch:
+		trap = op_branch(state, in, &rval);
+		break;
+	case rv32_op_load:
+		trap = op_load(state, in, DATA_OFS(in), &rval);
+		break;
+	case rv32_op_store:
+		trap = op_store(state, in, DATA_OFS(in), &rval);
+		break;
+	case rv32_op_arithmetic:
+	case rv32_op_bitmanip:
+		trap = op_arithmetic(state, in, &rval);
+		break;
+	case rv32_op_csr:
+		trap = op_csr(state, in, &rval);
+		break;
+	case rv32_op_amo:
+		trap = op_amo(state, in, &rval);
+		break;
+	case rv32_op_fence:
+		trap = op_fence(state, in, &rval);
+		break;
+	case rv32_op_load_mmio:
+		rval = REG(in->rs1) + in->imm;
+		trap = IN_RAM(in) ? op_load(state, in, DATA_OFS(in), &rval)
+		                  : load_mmio(state, in, rval, &rval);
+		break;
+	case rv32_op_store_mmio:
+		rval = REG(in->rs1) + in->imm;
+		trap = IN_RAM(in) ? op_store(state, in, DATA_OFS(in), &rval)
+		                  : store_mmio(state, in, rval, &rval);
+		break;
+	case rv32_op_fp:
+		trap = RV32_fp_op(state, in, &rval);
+		break;
+	case rv32_op_fp_load:
+		trap = op_fp_load(state, in, DATA_OFS(in), &rval);
+		break;
+	case rv32_op_fp_store:
+		trap = op_fp_store(state, in, DATA_OFS(in), &rval);
+		break;
+	default:
+		*tval = 0;
+		return (2 + 1); // Fault: Invalid opcode.
+	}
+	return retire_op(state, in, trap, rval, tval);
+}
+
+// Loads, stores and AMOs that faulted out of the RAM window.
+static uint32_t execute_mmio(RV32_CPU* state, const RV32_insn* in, uint32_t* tval) {
+	uint32_t rval = 0, trap;
+
+	switch (in->op) {
+	case rv32_op_load:
+	case rv32_op_load_mmio:
+		rval = REG(in->rs1) + in->imm;
+		trap = load_mmio(state, in, rval, &rval);
+		break;
+	case rv32_op_store:
+	case rv32_op_store_mmio:
+		rval = REG(in->rs1) + in->imm;
+		trap = store_mmio(state, in, rval, &rval);
+		break;
+	// Devices only take integer loads and stores.
+	case rv32_op_fp_load:
+		rval = REG(in->rs1) + in->imm;
+		trap = (5 + 1); // Load access fault
+		break;
+	case rv32_op_fp_store:
+		rval = REG(in->rs1) + in->imm;
+		trap = (7 + 1); // Store/AMO access fault
+		break;
+	default:
+		rval = REG(in->rs1);
+		trap = (7 + 1); // Store/AMO access fault
+		break;
+	}
+	return retire_op(state, in, trap, rval, tval);
+}
+
+// execute_op with translated loads and stores.
+static uint32_t execute_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* tval) {
+	uint32_t rval = 0, trap;
+
+	switch (in->op) {
+	case rv32_op_load:
+	case rv32_op_load_mmio:
+		trap = load_paged(state, in, &rval);
+		break;
+	case rv32_op_store:
+	case rv32_op_store_mmio:
+		trap = store_paged(state, in, &rval);
+		break;
+	case rv32_op_fp_load:
+	case rv32_op_fp_store:
+		trap = fp_paged(state, in, &rval);
+		break;
+	default:
+		return execute_op(state, in, tval);
+	}
+	return retire_op(state, in, trap, rval, tval);
+}
+
+// Handlers leave pc 4 short of the next instruction, as the step loops
+// add 4 for everything; a compressed one that retired needs 2 of those back.
+// One that trapped leaves rd alone, so it can be restarted, and rval is
+// the trap value.
+static uint32_t retire_op(RV32_CPU* state, const RV32_insn* in, uint32_t trap, uint32_t rval,
+                          uint32_t* tval) {
+	if (trap && trap != TRAP_HOST) {
+		*tval = rval;
+		return trap;
+	}
+	RV32_STAT(state, opcodes[(in->ir >> 2) & 31]);
+	CSR(pc) += RV32_INSN_LEN(in) - 4;
+	if (in->rd)
+		REG(in->rd) = rval;
+	else if (!trap)
+		trap = irq_pending(state);
+	return trap;
+}
+
+// Fill a cache entry with everything the handlers need so they never touch
+// the instruction word in memory again.
+static void decode_op(RV32_CPU* state, RV32_insn* in, uint32_t ofs_pc) {
+	uint32_t ir = RV32_CAST2B(ofs_pc);
+	uint32_t quadrant = ir & 3;
+
+	if (quadrant != 3) {
+		ir = expand_rvc(ir);
+	} else if (ofs_pc + 2 < state->total_mem) {
+		ir |= RV32_CAST2B(ofs_pc + 2) << 16;
+	} else {
+		ir = 0; // Would run off the end of RAM.
+	}
+
+	// A 32-bit instruction on a halfword may cross into the next page.
+	state->code_map[ofs_pc >> 17] |= 1u << ((ofs_pc >> 12) & 31);
+	state->code_map[(ofs_pc + 2) >> 17] |= 1u << (((ofs_pc + 2) >> 12) & 31);
+	in->tag = ofs_pc;
+	decode_ir(in, ir, quadrant);
+}
+
+// The instruction in its 32-bit form, and the quadrant it came from.
+static void decode_ir(RV32_insn* in, uint32_t ir, uint32_t quadrant) {
+	int32_t imm = (int32_t)ir >> 20; // I-type, sign-extended.
+
+	in->ir = (ir & ~3) | quadrant;
+	in->rd = (ir >> 7) & 0x1f;
+	in->rs1 = (ir >> 15) & 0x1f;
+	in->rs2 = (ir >> 20) & 0x1f;
 
 	switch (ir & 0x7f) {
 	case 0b0110111: // LUI
-		rval = (ir & 0xfffff000);
+		in->op = rv32_op_lui;
+		imm = ir & 0xfffff000;
 		break;
 	case 0b0010111: // AUIPC
-		rval = CSR(pc) + (ir & 0xfffff000);
+		in->op = rv32_op_auipc;
+		imm = ir & 0xfffff000;
 		break;
 	case 0b1101111: // JAL
-	{
-		int32_t reladdy = ((ir & 0x80000000) >> 11) | ((ir & 0x7fe00000) >> 20) |
-		                  ((ir & 0x00100000) >> 9) | ((ir & 0x000ff000));
-		if (reladdy & 0x00100000)
-			reladdy |= 0xffe00000; // Sign extension.
-		rval = CSR(pc) + 4;
-		CSR(pc) = CSR(pc) + reladdy - 4;
+		in->op = rv32_op_jal;
+		imm = ((ir & 0x80000000) >> 11) | ((ir & 0x7fe00000) >> 20) |
+		      ((ir & 0x00100000) >> 9) | ((ir & 0x000ff000));
+		if (imm & 0x00100000)
+			imm |= 0xffe00000; // Sign extension.
 		break;
-	}
 	case 0b1100111: // JALR
-	{
-		uint32_t imm = ir >> 20;
-		int32_t imm_se = imm | ((imm & 0x800) ? 0xfffff000 : 0);
-		rval = CSR(pc) + 4;
-		CSR(pc) = ((REG((ir >> 15) & 0x1f) + imm_se) & ~1) - 4;
+		in->op = rv32_op_jalr;
 		break;
-	}
 	case 0b1100011: // Branch
-		rdid = 0;
-		trap = op_branch(state);
+		in->op = rv32_op_branch;
+		in->rd = 0;
+		imm = ((ir & 0xf00) >> 7) | ((ir & 0x7e000000) >> 20) | ((ir & 0x80) << 4) |
+		      ((ir >> 31) << 12);
+		if (imm & 0x1000)
+			imm |= 0xffffe000;
 		break;
 	case 0b0000011: // Load
-		trap = op_load(state, &rval);
+		// x0-relative addresses are never RAM (the CSR window lives there).
+		in->op = in->rs1 ? rv32_op_load : rv32_op_load_mmio;
+		break;
+	case 0b0000111: // Load-FP, into an FP register.
+		in->op = ((ir >> 12) & 0x6) == 0b010 ? rv32_op_fp_load : rv32_op_illegal;
+		in->rd = 0;
 		break;
 	case 0b0100011: // Store
-		rdid = 0;
-		trap = op_store(state, &rval);
+	case 0b0100111: // Store-FP
+		if (ir & 0b100)
+			in->op = ((ir >> 12) & 0x6) == 0b010 ? rv32_op_fp_store : rv32_op_illegal;
+		else
+			in->op = in->rs1 ? rv32_op_store : rv32_op_store_mmio;
+		in->rd = 0;
+		imm = ((ir >> 7) & 0x1f) | ((ir & 0xfe000000) >> 20);
+		if (imm & 0x800)
+			imm |= 0xfffff000;
 		break;
 	case 0b0010011: // Op-immediate
 	case 0b0110011: // Op
-		trap = op_arithmetic(state, &rval);
+		in->op = rv32_op_arithmetic;
+		if (!base_alu(ir)) {
+			uint32_t rval;
+			in->op = bitmanip(ir, 0, 0, &rval) ? rv32_op_bitmanip : rv32_op_illegal;
+		}
 		break;
 	case 0b1110011: // Zifencei+Zicsr
-	{
-		if (!((ir >> 12) & 0b111))
-			rdid = 0;
-		trap = op_csr(state, &rval);
+		in->op = rv32_op_csr;
+		if (!((ir >> 12) & 0x7))
+			in->rd = 0;
+		break;
+	case 0b0001111: // Fence, Zifencei
+		in->op = rv32_op_fence;
+		in->rd = 0;
+		break;
+	case 0b1000011: // FMADD
+	case 0b1000111: // FMSUB
+	case 0b1001011: // FNMSUB
+	case 0b1001111: // FNMADD
+	case 0b1010011: // OP-FP
+		in->op = rv32_op_fp;
+		// Compares, FCVT.W, FMV.X.W and FCLASS write an X register, the
+		// rest an FP one, which RV32_fp_op takes from the instruction.
+		if ((ir & 0x7f) != 0b1010011 ||
+		    ((ir >> 27) != 0b10100 && (ir >> 27) != 0b11000 && (ir >> 27) != 0b11100))
+			in->rd = 0;
+		break;
+	case 0b0101111: // AMO
+		in->op = ((ir >> 12) & 0x7) == 0b010 ? rv32_op_amo : rv32_op_illegal;
+		break;
+	default:
+		in->op = rv32_op_illegal;
 		break;
 	}
-	case 0b0001111: // Fence
-	//	rdid = 0;
-	//break;
-	case 0b0101111:
-	//	trap = op_amo(state, &rval);
-	//	break;
+	in->imm = imm;
+}
+
+// Builders for the 32-bit formats, with immediates as the ISA defines them.
+#define SEXT(x, bits) ((int32_t)((uint32_t)(x) << (32 - (bits))) >> (32 - (bits)))
+#define RVC(quadrant, funct3) ((quadrant) << 3 | (funct3))
+#define ENC_R(opcode, funct7, funct3, rd, rs1, rs2) \
+	((funct7) << 25 | (rs2) << 20 | (rs1) << 15 | (funct3) << 12 | (rd) << 7 | (opcode))
+#define ENC_I(opcode, funct3, rd, rs1, imm) \
+	(((uint32_t)(imm) & 0xfff) << 20 | (rs1) << 15 | (funct3) << 12 | (rd) << 7 | (opcode))
+#define ENC_S(opcode, funct3, rs1, rs2, imm)                                   \
+	((((uint32_t)(imm) >> 5) & 0x7f) << 25 | (rs2) << 20 | (rs1) << 15 | \
+	 (funct3) << 12 | ((imm) & 0x1f) << 7 | (opcode))
+#define ENC_B(funct3, rs1, imm)                                                 \
+	((((uint32_t)(imm) >> 12) & 1) << 31 | (((imm) >> 5) & 0x3f) << 25 |  \
+	 (rs1) << 15 | (funct3) << 12 | (((imm) >> 1) & 0xf) << 8 |           \
+	 (((imm) >> 11) & 1) << 7 | 0b1100011)
+#define ENC_J(rd, imm)                                                          \
+	((((uint32_t)(imm) >> 20) & 1) << 31 | (((imm) >> 1) & 0x3ff) << 21 | \
+	 (((imm) >> 11) & 1) << 20 | (((imm) >> 12) & 0xff) << 12 | (rd) << 7 | 0b1101111)
+
+// RVC: the 32-bit instruction a compressed one stands for, or 0 (illegal)
+// for reserved encodings. Floating point loads and stores expand too, and
+// are as illegal as their 32-bit forms.
+static uint32_t expand_rvc(uint32_t c) {
+	uint32_t rd = (c >> 7) & 0x1f, rs2 = (c >> 2) & 0x1f;
+	uint32_t rdp = 8 + ((c >> 2) & 7), rs1p = 8 + ((c >> 7) & 7); // x8-x15 only.
+	int32_t imm = SEXT(((c >> 7) & 0x20) | ((c >> 2) & 0x1f), 6); // CI-type.
+	// Scaled offsets of the word and doubleword loads and stores.
+	uint32_t lw = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+	uint32_t ld = ((c >> 7) & 0x38) | ((c << 1) & 0xc0);
+	uint32_t lwsp = ((c >> 7) & 0x20) | ((c >> 2) & 0x1c) | ((c << 4) & 0xc0);
+	uint32_t ldsp = ((c >> 7) & 0x20) | ((c >> 2) & 0x18) | ((c << 4) & 0x1c0);
+	uint32_t swsp = ((c >> 7) & 0x3c) | ((c >> 1) & 0xc0);
+	uint32_t sdsp = ((c >> 7) & 0x38) | ((c >> 1) & 0x1c0);
+	int32_t off;
+
+	switch (RVC(c & 3, c >> 13)) {
+	case RVC(0, 0b000): // C.ADDI4SPN
+		off = ((c >> 7) & 0x30) | ((c >> 1) & 0x3c0) | ((c >> 4) & 4) | ((c >> 2) & 8);
+		return off ? ENC_I(0b0010011, 0, rdp, 2, off) : 0;
+	case RVC(0, 0b001): // C.FLD
+		return ENC_I(0b0000111, 0b011, rdp, rs1p, ld);
+	case RVC(0, 0b010): // C.LW
+		return ENC_I(0b0000011, 0b010, rdp, rs1p, lw);
+	case RVC(0, 0b011): // C.FLW
+		return ENC_I(0b0000111, 0b010, rdp, rs1p, lw);
+	case RVC(0, 0b101): // C.FSD
+		return ENC_S(0b0100111, 0b011, rs1p, rdp, ld);
+	case RVC(0, 0b110): // C.SW
+		return ENC_S(0b0100011, 0b010, rs1p, rdp, lw);
+	case RVC(0, 0b111): // C.FSW
+		return ENC_S(0b0100111, 0b010, rs1p, rdp, lw);
+
+	case RVC(1, 0b000): // C.ADDI, C.NOP
+		return ENC_I(0b0010011, 0, rd, rd, imm);
+	case RVC(1, 0b001): // C.JAL
+	case RVC(1, 0b101): // C.J
+		off = ((c >> 1) & 0x800) | ((c >> 7) & 0x10) | ((c >> 1) & 0x300) | ((c << 2) & 0x400) |
+		      ((c >> 1) & 0x40) | ((c << 1) & 0x80) | ((c >> 2) & 0xe) | ((c << 3) & 0x20);
+		return ENC_J((c & 0x8000) ? 0 : 1, SEXT(off, 12));
+	case RVC(1, 0b010): // C.LI
+		return ENC_I(0b0010011, 0, rd, 0, imm);
+	case RVC(1, 0b011):
+		if (rd == 2) { // C.ADDI16SP
+			off = ((c >> 3) & 0x200) | ((c >> 2) & 0x10) | ((c << 1) & 0x40) |
+			      ((c << 4) & 0x180) | ((c << 3) & 0x20);
+			return off ? ENC_I(0b0010011, 0, 2, 2, SEXT(off, 10)) : 0;
+		}
+		// C.LUI
+		return imm ? ((uint32_t)imm << 12) | rd << 7 | 0b0110111 : 0;
+	case RVC(1, 0b100):
+		switch ((c >> 10) & 3) {
+		case 0b00: // C.SRLI
+			return (c & 0x1000) ? 0 : ENC_I(0b0010011, 0b101, rs1p, rs1p, rs2);
+		case 0b01: // C.SRAI
+			return (c & 0x1000) ? 0 : ENC_I(0b0010011, 0b101, rs1p, rs1p, 0x400 | rs2);
+		case 0b10: // C.ANDI
+			return ENC_I(0b0010011, 0b111, rs1p, rs1p, imm);
+		default: { // C.SUB, C.XOR, C.OR, C.AND
+			static const uint8_t funct3[4] = {0b000, 0b100, 0b110, 0b111};
+			if (c & 0x1000)
+				return 0;
+			return ENC_R(0b0110011, ((c >> 5) & 3) ? 0 : 0x20, funct3[(c >> 5) & 3], rs1p,
+			             rs1p, rdp);
+		}
+		}
+	case RVC(1, 0b110): // C.BEQZ
+	case RVC(1, 0b111): // C.BNEZ
+		off = ((c >> 4) & 0x100) | ((c >> 7) & 0x18) | ((c << 1) & 0xc0) | ((c >> 2) & 6) |
+		      ((c << 3) & 0x20);
+		return ENC_B((c >> 13) & 1, rs1p, SEXT(off, 9));
+
+	case RVC(2, 0b000): // C.SLLI
+		return (c & 0x1000) ? 0 : ENC_I(0b0010011, 0b001, rd, rd, rs2);
+	case RVC(2, 0b001): // C.FLDSP
+		return ENC_I(0b0000111, 0b011, rd, 2, ldsp);
+	case RVC(2, 0b010): // C.LWSP
+		return rd ? ENC_I(0b0000011, 0b010, rd, 2, lwsp) : 0;
+	case RVC(2, 0b011): // C.FLWSP
+		return ENC_I(0b0000111, 0b010, rd, 2, lwsp);
+	case RVC(2, 0b100):
+		if (!(c & 0x1000)) {
+			if (!rs2) // C.JR
+				return rd ? ENC_I(0b1100111, 0, 0, rd, 0) : 0;
+			return ENC_R(0b0110011, 0, 0, rd, 0, rs2); // C.MV
+		}
+		if (!rs2) // C.JALR, C.EBREAK
+			return rd ? ENC_I(0b1100111, 0, 1, rd, 0) : 0x00100073;
+		return ENC_R(0b0110011, 0, 0, rd, rd, rs2); // C.ADD
+	case RVC(2, 0b101): // C.FSDSP
+		return ENC_S(0b0100111, 0b011, 2, rs2, sdsp);
+	case RVC(2, 0b110): // C.SWSP
+		return ENC_S(0b0100011, 0b010, 2, rs2, swsp);
+	case RVC(2, 0b111): // C.FSWSP
+		return ENC_S(0b0100111, 0b010, 2, rs2, swsp);
 	default:
-		return (2 + 1); // Fault: Invalid opcode.
+		return 0;
 	}
+}
+
+#undef SEXT
+#undef RVC
+#undef ENC_R
+#undef ENC_I
+#undef ENC_S
+#undef ENC_B
+#undef ENC_J
 
-	if (rdid && rdid != -1) {
-		REG(rdid) = rval;
-	} else if ((CSR(mip) & (1 << 7)) && (CSR(mie) & (1 << 7) /*mtie*/) &&
-	           (CSR(mstatus) & 0x8 /*mie*/) ) {
-		trap = 0x80000007; // Timer interrupt.
+// Drop the cache entries covering a RAM offset that is about to be written:
+// one starting on its halfword, or a 32-bit one starting on the one before.
+static void invalidate_op(RV32_CPU* state, uint32_t ofs) {
+	RV32_insn* in = &state->icache[RV32_ICACHE_SLOT(ofs)];
+	if (in->tag == (ofs & ~1))
+		in->op = rv32_op_decode;
+	in = &state->icache[RV32_ICACHE_SLOT(ofs - 2)];
+	if (in->tag == ((ofs - 2) & ~1))
+		in->op = rv32_op_decode;
+}
+
+// Something wrote len bytes at a RAM offset inside a page marked in
+// code_map: drop whatever was decoded from those bytes.
+static void invalidate_code(RV32_CPU* state, uint32_t ofs, uint32_t len) {
+	for (uint32_t i = 0; i < len; i += 2)
+		invalidate_op(state, ofs + i);
+	invalidate_op(state, ofs + len - 1);
+	if (state->blocks.nblocks)
+		drop_blocks(state, ofs, len);
+	if (state->jit)
+		RV32_jit_invalidate(state, ofs, len);
+}
+
+// Unlist the blocks overlapping [ofs, ofs + len) and mark them dropped, so
+// neither the map nor a chain pointer leads to them again.
+static void drop_blocks(RV32_CPU* state, uint32_t ofs, uint32_t len) {
+	RV32_blocks* bc = &state->blocks;
+	uint32_t first = ofs > 4 * RV32_BLOCK_MAX ? ofs - 4 * RV32_BLOCK_MAX : 0;
+
+	for (uint32_t page = first >> 12; page <= (ofs + len - 1) >> 12; page++) {
+		RV32_block** link = &bc->pages[page & ((1 << RV32_BLOCK_PAGE_BITS) - 1)];
+		while (*link) {
+			RV32_block* b = *link;
+			if (b->start < ofs + len && b->end > ofs) {
+				b->start = ~0u;
+				*link = b->page_next;
+			} else {
+				link = &b->page_next;
+			}
+		}
 	}
-	return trap;
 }
 
-static uint32_t op_branch(RV32_CPU* state) {
-	uint32_t ir = RV32_CAST4B(get_pc(state));
-	uint32_t immm4 = ((ir & 0xf00) >> 7) | ((ir & 0x7e000000) >> 20) | ((ir & 0x80) << 4) |
-	                 ((ir >> 31) << 12);
-	if (immm4 & 0x1000)
-		immm4 |= 0xffffe000;
-	int32_t rs1 = REG((ir >> 15) & 0x1f);
-	int32_t rs2 = REG((ir >> 20) & 0x1f);
-	immm4 = CSR(pc) + immm4 - 4;
-	switch ((ir >> 12) & 0x7) {
+// Forget every decoded or translated instruction.
+void RV32_flush_code(RV32_CPU* state) {
+	memset(state->blocks.map, 0, sizeof(state->blocks.map));
+	memset(state->blocks.pages, 0, sizeof(state->blocks.pages));
+	memset(state->code_map, 0, sizeof(state->code_map));
+	// Entries only lose their handler: the instruction that flushed, say a
+	// FENCE.I, still retires through its entry and needs its length and rd.
+	for (uint32_t i = 0; i < RV32_ICACHE_SIZE; i++)
+		state->icache[i].op = rv32_op_decode;
+	state->blocks.nblocks = 0;
+	state->blocks.ncode = 0;
+	state->blocks.gen++;
+	if (state->jit)
+		RV32_jit_flush(state);
+}
+
+// The host wrote len bytes of RAM behind the hart's back (device DMA).
+void RV32_invalidate_code(RV32_CPU* state, uint32_t ofs, uint32_t len) {
+	for (uint32_t page = ofs & ~0xfff; len && page < ofs + len; page += 0x1000) {
+		if (CODE_MAPPED(page)) {
+			invalidate_code(state, ofs, len);
+			return;
+		}
+	}
+}
+
+// The hart being stepped on this thread, NULL between steps.
+RV32_CPU* RV32_current(void) {
+	return fault_cpu;
+}
+
+void RV32_decode(RV32_CPU* state, RV32_insn* in, uint32_t ofs) {
+	decode_op(state, in, ofs);
+}
+
+static uint32_t op_lui(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	*rval = in->imm;
+	return 0;
+}
+
+static uint32_t op_auipc(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	*rval = CSR(pc) + in->imm;
+	return 0;
+}
+
+// Jumps set pc to the target less the instruction's length, which
+// retire_op turns into the target less 4.
+static uint32_t op_jal(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	*rval = CSR(pc) + RV32_INSN_LEN(in);
+	CSR(pc) = CSR(pc) + in->imm - RV32_INSN_LEN(in);
+	return 0;
+}
+
+static uint32_t op_jalr(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	*rval = CSR(pc) + RV32_INSN_LEN(in);
+	CSR(pc) = ((REG(in->rs1) + in->imm) & ~1) - RV32_INSN_LEN(in);
+	return 0;
+}
+
+static uint32_t op_branch(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	int32_t rs1 = REG(in->rs1);
+	int32_t rs2 = REG(in->rs2);
+	uint32_t immm4 = CSR(pc) + in->imm - RV32_INSN_LEN(in);
+	switch (FUNCT3(in)) {
 	// BEQ, BNE, BLT, BGE, BLTU, BGEU
 	case 0b000:
 		if (rs1 == rs2)
@@ -191,132 +1491,362 @@ static uint32_t op_branch(RV32_CPU* state) {
 	return 0;
 }
 
-static uint32_t op_load(RV32_CPU* state, uint32_t* rrval) {
+// Load from the RAM offset rsval. Outside RAM the access faults and the
+// instruction is rerun by load_mmio.
+static uint32_t op_load(RV32_CPU* state, const RV32_insn* in, uint32_t rsval, uint32_t* rrval) {
 	uint32_t rval = 0;
-	uint32_t ir = RV32_CAST4B(get_pc(state));
-	uint32_t rs1 = REG((ir >> 15) & 0x1f);
-	uint32_t imm = ir >> 20;
-	int32_t imm_se = imm | ((imm & 0x800) ? 0xfffff000 : 0);
-	uint32_t rsval = rs1 + imm_se;
-
-	rsval -= state->base_ofs;
-	if (rsval >= state->total_mem - 3) {
-		rsval -= state->base_ofs;
-		if (rsval >= 0x10000000 && rsval < 0x12000000) // UART, CLNT
-		{
-			if (rsval ==
-			    0x1100bffc) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
-				rval = CSR(timerh);
-			else if (rsval == 0x1100bff8)
-				rval = CSR(timerl);
-			else
-				rval = HandleControlLoad(rsval);
-		} else if (rsval >= 0x400 && rsval < 0x400 + (18 * 4)) // CSR
-		{
-			rval = state->csr[(rsval >> 2) & 0xff];
-		} else {
-			return 6;
-			rval = rsval;
-		}
-	} else {
-		switch ((ir >> 12) & 0x7) {
-		// LB, LH, LW, LBU, LHU
-		case 0b000:
-			rval = (int8_t)RV32_CAST1B(rsval);
-			break;
-		case 0b001:
-			rval = (int16_t)RV32_CAST2B(rsval);
-			break;
-		case 0b010:
-			rval = RV32_CAST4B(rsval);
-			break;
-		case 0b100:
-			rval = RV32_CAST1B(rsval);
-			break;
-		case 0b101:
-			rval = RV32_CAST2B(rsval);
-			break;
-		default:
-			return 3;
-		}
+
+	FAULT_BARRIER();
+	switch (FUNCT3(in)) {
+	// LB, LH, LW, LBU, LHU
+	case 0b000:
+		rval = (int8_t)RV32_CAST1B(rsval);
+		break;
+	case 0b001:
+		rval = (int16_t)RV32_CAST2B(rsval);
+		break;
+	case 0b010:
+		rval = RV32_CAST4B(rsval);
+		break;
+	case 0b100:
+		rval = RV32_CAST1B(rsval);
+		break;
+	case 0b101:
+		rval = RV32_CAST2B(rsval);
+		break;
+	default:
+		return 3;
 	}
 	*rrval = rval;
 	return 0;
 }
 
-static uint32_t op_store(RV32_CPU* state, uint32_t* rval) {
-	uint32_t ir = RV32_CAST4B(get_pc(state));
-
-	uint32_t rs1 = REG((ir >> 15) & 0x1f);
-	uint32_t rs2 = REG((ir >> 20) & 0x1f);
-	uint32_t addy = ((ir >> 7) & 0x1f) | ((ir & 0xfe000000) >> 20);
-	if (addy & 0x800)
-		addy |= 0xfffff000;
-	addy += rs1 - state->base_ofs;
-
-	if (addy >= state->total_mem - 3) {
-		addy -= state->base_ofs;
-		if (addy >= 0x10000000 && addy < 0x12000000) {
-			// Should be stuff like SYSCON, 8250, CLNT
-			if (addy == 0x11004004) // CLNT
-				CSR(timermatchh) = rs2;
-			else if (addy == 0x11004000) // CLNT
-				CSR(timermatchl) = rs2;
-			else if (addy == 0x11100000) // SYSCON (reboot,
-			                             // poweroff, etc.)
-			{
-				CSR(pc) += 4;
-				return rs2; // NOTE: PC will be PC of
-				            // Syscon.
-			} else if (HandleControlStore(addy, rs2))
-				return rs2;
-		} else if (addy >= 0x400 && addy < 0x400 + (18 * 4)) // CSR
-		{
-			state->csr[(addy >> 2) & 0xff] = rs2;
-		} else {
-			*rval = addy + state->base_ofs;
-			return 8;
-		}
-	} else {
-		switch ((ir >> 12) & 0x7) {
-		// SB, SH, SW
-		case 0b000:
-			RV32_CAST1B(addy) = rs2;
-			break;
-		case 0b001:
-			RV32_CAST2B(addy) = rs2;
-			break;
-		case 0b010:
-			RV32_CAST4B(addy) = rs2;
+// addy is physical; *rrval holds the trap value already.
+static uint32_t load_mmio(RV32_CPU* state, const RV32_insn* in, uint32_t addy, uint32_t* rrval) {
+	RV32_device* dev = find_device(state, addy);
+	uint32_t rval;
+
+	if (!dev)
+		return (5 + 1); // Load access fault
+	RV32_STAT(state, mmio_loads[dev - state->bus.devices]);
+	rval = dev->load(dev->opaque, addy - dev->base, 1 << (FUNCT3(in) & 3));
+	switch (FUNCT3(in)) {
+	// LB, LH, LW, LBU, LHU
+	case 0b000:
+		rval = (int8_t)rval;
+		break;
+	case 0b001:
+		rval = (int16_t)rval;
+		break;
+	case 0b010:
+		break;
+	case 0b100:
+		rval = (uint8_t)rval;
+		break;
+	case 0b101:
+		rval = (uint16_t)rval;
+		break;
+	default:
+		return 3;
+	}
+	*rrval = rval;
+	return 0;
+}
+
+// Store to the RAM offset addy. Outside RAM the access faults and the
+// instruction is rerun by store_mmio.
+static uint32_t op_store(RV32_CPU* state, const RV32_insn* in, uint32_t addy, uint32_t* rval) {
+	uint32_t rs2 = REG(in->rs2);
+
+	FAULT_BARRIER();
+	switch (FUNCT3(in)) {
+	// SB, SH, SW
+	case 0b000:
+		RV32_CAST1B(addy) = rs2;
+		break;
+	case 0b001:
+		RV32_CAST2B(addy) = rs2;
+		break;
+	case 0b010:
+		RV32_CAST4B(addy) = rs2;
+		break;
+	default:
+		return (2 + 1);
+	}
+	// Self-modifying code: forget whatever was decoded at this address.
+	if (CODE_MAPPED(addy) || CODE_MAPPED(addy + (1 << FUNCT3(in)) - 1))
+		invalidate_code(state, addy, 1 << FUNCT3(in));
+	return 0;
+}
+
+// addy is physical; *rval holds the trap value already.
+static uint32_t store_mmio(RV32_CPU* state, const RV32_insn* in, uint32_t addy, uint32_t* rval) {
+	RV32_device* dev = find_device(state, addy);
+
+	if (FUNCT3(in) > 0b010)
+		return (2 + 1);
+	if (!dev)
+		return (7 + 1); // Store/AMO access fault
+	RV32_STAT(state, mmio_stores[dev - state->bus.devices]);
+	state->bus.request = dev->store(dev->opaque, addy - dev->base, REG(in->rs2), 1 << FUNCT3(in));
+	return state->bus.request ? TRAP_HOST : 0;
+}
+
+// FLW and FLD from the RAM offset ofs, NaN-boxing a single. Outside RAM
+// the access faults and execute_mmio raises an access fault.
+static uint32_t op_fp_load(RV32_CPU* state, const RV32_insn* in, uint32_t ofs, uint32_t* rval) {
+	uint64_t val;
+
+	if (!(CSR(mstatus) & RV32_MSTATUS_FS))
+		return (2 + 1);
+	FAULT_BARRIER();
+	if (FUNCT3(in) == 0b011)
+		val = RV32_CAST8B(ofs);
+	else
+		val = RV32_CAST4B(ofs) | 0xffffffff00000000ull;
+	state->fregs[(in->ir >> 7) & 0x1f] = val;
+	CSR(mstatus) |= RV32_MSTATUS_FS | RV32_MSTATUS_SD;
+	return 0;
+}
+
+// FSW and FSD to the RAM offset ofs, as op_fp_load.
+static uint32_t op_fp_store(RV32_CPU* state, const RV32_insn* in, uint32_t ofs, uint32_t* rval) {
+	uint64_t val = state->fregs[in->rs2];
+	uint32_t len = 4 << (FUNCT3(in) & 1);
+
+	if (!(CSR(mstatus) & RV32_MSTATUS_FS))
+		return (2 + 1);
+	FAULT_BARRIER();
+	if (len == 8)
+		RV32_CAST8B(ofs) = val;
+	else
+		RV32_CAST4B(ofs) = val;
+	if (CODE_MAPPED(ofs) || CODE_MAPPED(ofs + len - 1))
+		invalidate_code(state, ofs, len);
+	return 0;
+}
+
+// Loads and stores with translation on. Nothing faults here: the page's
+// RAM offset is checked, and MMIO goes straight to the bus.
+static uint32_t load_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* rrval) {
+	uint32_t va = REG(in->rs1) + in->imm, ofs, trap;
+
+	*rrval = va;
+	if ((trap = translate_data(state, va, 1 << (FUNCT3(in) & 3), RV32_ACCESS_LOAD, &ofs)))
+		return trap;
+	if (ofs >= state->total_mem - 3)
+		return load_mmio(state, in, ofs + state->base_ofs, rrval);
+	return op_load(state, in, ofs, rrval);
+}
+
+static uint32_t store_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	uint32_t va = REG(in->rs1) + in->imm, ofs, trap;
+
+	if (FUNCT3(in) > 0b010)
+		return (2 + 1);
+	*rval = va;
+	if ((trap = translate_data(state, va, 1 << FUNCT3(in), RV32_ACCESS_STORE, &ofs)))
+		return trap;
+	if (ofs >= state->total_mem - 3)
+		return store_mmio(state, in, ofs + state->base_ofs, rval);
+	return op_store(state, in, ofs, rval);
+}
+
+static uint32_t fp_paged(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	uint32_t va = REG(in->rs1) + in->imm, len = 4 << (FUNCT3(in) & 1), ofs = 0, trap;
+	int load = in->op == rv32_op_fp_load;
+
+	if (!(CSR(mstatus) & RV32_MSTATUS_FS))
+		return (2 + 1);
+	*rval = va;
+	if ((trap = translate_data(state, va, len, load ? RV32_ACCESS_LOAD : RV32_ACCESS_STORE, &ofs)))
+		return trap;
+	if (ofs > state->total_mem - len)
+		return load ? (5 + 1) : (7 + 1);
+	return load ? op_fp_load(state, in, ofs, rval) : op_fp_store(state, in, ofs, rval);
+}
+
+static RV32_device* find_device(RV32_CPU* state, uint32_t addr) {
+	uint8_t* dir = state->bus.dir[addr >> (12 + RV32_BUS_DIR_BITS)];
+	RV32_device* dev;
+
+	if (!dir || !dir[(addr >> 12) & ((1 << RV32_BUS_DIR_BITS) - 1)])
+		return NULL;
+	dev = &state->bus.devices[dir[(addr >> 12) & ((1 << RV32_BUS_DIR_BITS) - 1)] - 1];
+	return addr - dev->base < dev->size ? dev : NULL;
+}
+
+// Sv32. Translations are only cached once every check for their table has
+// passed, with A (and D for stores) already set, so a hit needs no more.
+static inline uint32_t translate(RV32_CPU* state, uint32_t va, int access, uint32_t* ofs) {
+	int s = access == RV32_ACCESS_FETCH ? CSR(extraflags) & 1 : !!(state->mmu & RV32_MMU_DATA_S);
+	RV32_tlb* e = &state->tlb[s][access][(va >> 12) & (RV32_TLB_SIZE - 1)];
+
+	if (e->tag == ((va & ~0xfff) | 1)) {
+		*ofs = e->ofs + (va & 0xfff);
+		return 0;
+	}
+	return walk(state, va, access, s, e, ofs);
+}
+
+// A load or store of size bytes. One that straddles two pages could land
+// anywhere, so it raises misaligned instead.
+static uint32_t translate_data(RV32_CPU* state, uint32_t va, uint32_t size, int access,
+                               uint32_t* ofs) {
+	if ((va & 0xfff) + size > 0x1000)
+		return access == RV32_ACCESS_LOAD ? (4 + 1) : (6 + 1);
+	return translate(state, va, access, ofs);
+}
+
+// Two level walk from satp for a U-mode or (s) S-mode access, filling e on
+// success.
+static uint32_t walk(RV32_CPU* state, uint32_t va, int access, int s, RV32_tlb* e,
+                     uint32_t* ofs) {
+	static const uint32_t page_fault[] = {12 + 1, 13 + 1, 15 + 1};
+	static const uint32_t access_fault[] = {1 + 1, 5 + 1, 7 + 1};
+	uint32_t table = CSR(satp) << 12, pte, pa, want;
+	uint32_t* slot;
+	int level;
+
+again:
+	// Physical addresses above 4GiB are not there.
+	if (CSR(satp) & 0x300000)
+		return access_fault[access];
+	for (level = 1;; level--) {
+		uint32_t pte_ofs = table + ((va >> (12 + 10 * level)) & 0x3ff) * 4 - state->base_ofs;
+
+		if (pte_ofs >= state->total_mem - 3)
+			return access_fault[access];
+		slot = (uint32_t*)(state->mem + pte_ofs);
+		pte = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (!(pte & PTE_V) || ((pte & (PTE_R | PTE_W)) == PTE_W))
+			return page_fault[access];
+		if (pte & (PTE_R | PTE_X))
 			break;
-		default:
-			return (2 + 1);
-		}
+		if (!level)
+			return page_fault[access];
+		if (pte >> 30)
+			return access_fault[access];
+		table = (pte >> 10) << 12;
+	}
+
+	// U-mode only reaches U pages; S-mode only reaches them with SUM, and
+	// never runs them.
+	if ((pte & PTE_U) ? s && (access == RV32_ACCESS_FETCH || !(CSR(mstatus) & MSTATUS_SUM)) : !s)
+		return page_fault[access];
+	switch (access) {
+	case RV32_ACCESS_FETCH:
+		want = PTE_X;
+		break;
+	case RV32_ACCESS_LOAD:
+		want = (CSR(mstatus) & MSTATUS_MXR) ? PTE_R | PTE_X : PTE_R;
+		break;
+	default:
+		want = PTE_W;
+		break;
 	}
+	if (!(pte & want))
+		return page_fault[access];
+	if (level && ((pte >> 10) & 0x3ff))
+		return page_fault[access]; // Misaligned superpage.
+	if (pte >> 30)
+		return access_fault[access];
+
+	// Set A, and D for a store, unless the PTE changed under us: then
+	// walk again, another hart may have unmapped it.
+	want = PTE_A | (access == RV32_ACCESS_STORE ? PTE_D : 0);
+	if ((pte & want) != want &&
+	    !__atomic_compare_exchange_n(slot, &pte, pte | want, 0, __ATOMIC_SEQ_CST,
+	                                 __ATOMIC_RELAXED)) {
+		table = CSR(satp) << 12;
+		goto again;
+	}
+
+	if (level)
+		pa = ((pte >> 20) << 22) | (va & 0x3ff000);
+	else
+		pa = (pte >> 10) << 12;
+	e->tag = (va & ~0xfff) | 1;
+	e->ofs = pa - state->base_ofs;
+	*ofs = e->ofs + (va & 0xfff);
 	return 0;
 }
 
-static uint32_t op_arithmetic(RV32_CPU* state, uint32_t* rrval) {
+// RAM offset of va as the current satp maps it for a load, for the host to
+// peek at guest memory: no faults, no A or D bits, no TLB fill. -1 if it
+// is not mapped readable, or not RAM.
+int RV32_peek_virt(RV32_CPU* state, uint32_t va, uint32_t* ofs) {
+	uint32_t table = CSR(satp) << 12, pte = 0, pa;
+	int level;
+
+	if (CSR(satp) & 0x300000)
+		return -1;
+	for (level = 1; level >= 0; level--) {
+		uint32_t pte_ofs = table + ((va >> (12 + 10 * level)) & 0x3ff) * 4 - state->base_ofs;
+
+		if (pte_ofs >= state->total_mem - 3)
+			return -1;
+		pte = __atomic_load_n((uint32_t*)(state->mem + pte_ofs), __ATOMIC_RELAXED);
+		if (!(pte & PTE_V) || (pte >> 30))
+			return -1;
+		if (pte & (PTE_R | PTE_X))
+			break;
+		table = (pte >> 10) << 12;
+	}
+	if (level < 0 || !(pte & PTE_R) || (level && ((pte >> 10) & 0x3ff)))
+		return -1;
+	if (level)
+		pa = ((pte >> 20) << 22) | (va & 0x3ff000);
+	else
+		pa = (pte >> 10) << 12;
+	*ofs = pa + (va & 0xfff) - state->base_ofs;
+	return *ofs < state->total_mem ? 0 : -1;
+}
+
+// Where translation applies: satp is on, and the access is below M-mode,
+// or a load or store with MPRV set and MPP below it.
+static void update_mmu(RV32_CPU* state) {
+	uint32_t priv = CSR(extraflags) & 3, data = priv;
+
+	if (priv == 3 && (CSR(mstatus) & MSTATUS_MPRV))
+		data = (CSR(mstatus) >> 11) & 3;
+	state->mmu = 0;
+	if (!(CSR(satp) >> 31))
+		return;
+	if (priv < 3)
+		state->mmu |= RV32_MMU_FETCH;
+	if (data < 3)
+		state->mmu |= RV32_MMU_DATA | (data ? RV32_MMU_DATA_S : 0);
+}
+
+// Drop every cached translation, as SFENCE.VMA does. The host calls it
+// after rewriting a hart's CSRs.
+void RV32_flush_tlb(RV32_CPU* state) {
+	memset(state->tlb, 0, sizeof(state->tlb));
+	update_mmu(state);
+}
+
+static uint32_t op_arithmetic(RV32_CPU* state, const RV32_insn* in, uint32_t* rrval) {
 	uint32_t rval = 0;
-	uint32_t ir = RV32_CAST4B(get_pc(state));
+	uint32_t ir = in->ir;
 
-	uint32_t imm = ir >> 20;
-	imm = imm | ((imm & 0x800) ? 0xfffff000 : 0);
-	uint32_t rs1 = REG((ir >> 15) & 0x1f);
+	uint32_t rs1 = REG(in->rs1);
 	uint32_t is_reg = !!(ir & 0b100000);
-	uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
+	uint32_t rs2 = is_reg ? REG(in->rs2) : (uint32_t)in->imm;
 
-	if (is_reg && (ir & 0x02000000)) {
-		return (2 + 1);
+	if (in->op == rv32_op_bitmanip) {
+		bitmanip(ir, rs1, rs2, &rval);
+	} else if (is_reg && (ir & 0x02000000)) {
+		rval = muldiv(FUNCT3(in), rs1, rs2);
 	} else {
-		switch ((ir >> 12) & 7) // These could be either op-immediate or op
-		                        // commands.  Be careful.
+		switch (FUNCT3(in)) // These could be either op-immediate or op
+		                    // commands.  Be careful.
 		{
 		case 0b000:
 			rval = (is_reg && (ir & 0x40000000)) ? (rs1 - rs2) : (rs1 + rs2);
 			break;
 		case 0b001:
-			rval = rs1 << rs2;
+			rval = rs1 << (rs2 & 0x1f);
 			break;
 		case 0b010:
 			rval = (int32_t)rs1 < (int32_t)rs2;
@@ -328,7 +1858,7 @@ static uint32_t op_arithmetic(RV32_CPU* state, uint32_t* rrval) {
 			rval = rs1 ^ rs2;
 			break;
 		case 0b101:
-			rval = (ir & 0x40000000) ? (((int32_t)rs1) >> rs2) : (rs1 >> rs2);
+			rval = (ir & 0x40000000) ? (((int32_t)rs1) >> (rs2 & 0x1f)) : (rs1 >> (rs2 & 0x1f));
 			break;
 		case 0b110:
 			rval = rs1 | rs2;
@@ -342,29 +1872,219 @@ static uint32_t op_arithmetic(RV32_CPU* state, uint32_t* rrval) {
 	return 0;
 }
 
-static uint32_t op_csr(RV32_CPU* state, uint32_t* rval) {
-	uint32_t ir = RV32_CAST4B(get_pc(state));
-	uint32_t i, csrno = ir >> 20;
-	int microop = (ir >> 12) & 0b111;
+// RV32M. Division by zero and INT32_MIN / -1 give what the spec says
+// instead of trapping like the host's divide would.
+static uint32_t muldiv(uint32_t funct3, uint32_t rs1, uint32_t rs2) {
+	switch (funct3) {
+	case 0b000: // MUL
+		return rs1 * rs2;
+	case 0b001: // MULH
+		return ((int64_t)(int32_t)rs1 * (int32_t)rs2) >> 32;
+	case 0b010: // MULHSU
+		return ((int64_t)(int32_t)rs1 * rs2) >> 32;
+	case 0b011: // MULHU
+		return ((uint64_t)rs1 * rs2) >> 32;
+	case 0b100: // DIV
+		if (!rs2)
+			return UINT32_MAX;
+		if (rs1 == 0x80000000 && rs2 == UINT32_MAX)
+			return rs1;
+		return (int32_t)rs1 / (int32_t)rs2;
+	case 0b101: // DIVU
+		return rs2 ? rs1 / rs2 : UINT32_MAX;
+	case 0b110: // REM
+		if (!rs2)
+			return rs1;
+		if (rs1 == 0x80000000 && rs2 == UINT32_MAX)
+			return 0;
+		return (int32_t)rs1 % (int32_t)rs2;
+	default: // REMU
+		return rs2 ? rs1 % rs2 : rs1;
+	}
+}
+
+// Whether an OP or OP-IMM encoding is RV32I or M: funct7 0, 1 (M) or 0x20
+// (SUB, SRA) for OP; OP-IMM only has one in the shifts, 0 or 0x20 (SRAI).
+static int base_alu(uint32_t ir) {
+	uint32_t funct7 = ir >> 25, funct3 = (ir >> 12) & 7;
+
+	if (ir & 0b100000)
+		return funct7 <= 1 || (funct7 == 0x20 && (funct3 == 0b000 || funct3 == 0b101));
+	if (funct3 == 0b001)
+		return funct7 == 0;
+	return funct3 != 0b101 || funct7 == 0 || funct7 == 0x20;
+}
+
+// Zba, Zbb and Zbs, the rest of OP and OP-IMM; rs2 is the immediate for
+// the latter. Returns 0 for encodings none of them has. The builtins are
+// LZCNT, TZCNT, POPCNT and BSWAP where the compiler may use them; the JIT
+// emits those itself when the host has them.
+static int bitmanip(uint32_t ir, uint32_t rs1, uint32_t rs2, uint32_t* rval) {
+	uint32_t funct7 = ir >> 25, sel = (ir >> 20) & 0x1f, sh = rs2 & 0x1f;
+
+	switch ((ir & 0b100000) << 5 | funct7 << 3 | ((ir >> 12) & 7)) {
+	// OP
+	case 0x400 | 0x10 << 3 | 0b010: // SH1ADD
+	case 0x400 | 0x10 << 3 | 0b100: // SH2ADD
+	case 0x400 | 0x10 << 3 | 0b110: // SH3ADD
+		*rval = (rs1 << ((ir >> 13) & 3)) + rs2;
+		return 1;
+	case 0x400 | 0x20 << 3 | 0b111: // ANDN
+		*rval = rs1 & ~rs2;
+		return 1;
+	case 0x400 | 0x20 << 3 | 0b110: // ORN
+		*rval = rs1 | ~rs2;
+		return 1;
+	case 0x400 | 0x20 << 3 | 0b100: // XNOR
+		*rval = ~(rs1 ^ rs2);
+		return 1;
+	case 0x400 | 0x05 << 3 | 0b100: // MIN
+		*rval = (int32_t)rs1 < (int32_t)rs2 ? rs1 : rs2;
+		return 1;
+	case 0x400 | 0x05 << 3 | 0b101: // MINU
+		*rval = rs1 < rs2 ? rs1 : rs2;
+		return 1;
+	case 0x400 | 0x05 << 3 | 0b110: // MAX
+		*rval = (int32_t)rs1 > (int32_t)rs2 ? rs1 : rs2;
+		return 1;
+	case 0x400 | 0x05 << 3 | 0b111: // MAXU
+		*rval = rs1 > rs2 ? rs1 : rs2;
+		return 1;
+	case 0x400 | 0x04 << 3 | 0b100: // ZEXT.H
+		*rval = (uint16_t)rs1;
+		return !sel;
+	case 0x400 | 0x30 << 3 | 0b001: // ROL
+		*rval = (rs1 << sh) | (rs1 >> ((32 - sh) & 0x1f));
+		return 1;
+	case 0x400 | 0x30 << 3 | 0b101: // ROR
+	case 0x30 << 3 | 0b101: // RORI
+		*rval = (rs1 >> sh) | (rs1 << ((32 - sh) & 0x1f));
+		return 1;
+	case 0x400 | 0x24 << 3 | 0b001: // BCLR
+	case 0x24 << 3 | 0b001: // BCLRI
+		*rval = rs1 & ~(1u << sh);
+		return 1;
+	case 0x400 | 0x24 << 3 | 0b101: // BEXT
+	case 0x24 << 3 | 0b101: // BEXTI
+		*rval = (rs1 >> sh) & 1;
+		return 1;
+	case 0x400 | 0x34 << 3 | 0b001: // BINV
+	case 0x34 << 3 | 0b001: // BINVI
+		*rval = rs1 ^ (1u << sh);
+		return 1;
+	case 0x400 | 0x14 << 3 | 0b001: // BSET
+	case 0x14 << 3 | 0b001: // BSETI
+		*rval = rs1 | (1u << sh);
+		return 1;
+	// OP-IMM with rs2 picking the operation.
+	case 0x30 << 3 | 0b001:
+		switch (sel) {
+		case 0: // CLZ
+			*rval = rs1 ? __builtin_clz(rs1) : 32;
+			return 1;
+		case 1: // CTZ
+			*rval = rs1 ? __builtin_ctz(rs1) : 32;
+			return 1;
+		case 2: // CPOP
+			*rval = __builtin_popcount(rs1);
+			return 1;
+		case 4: // SEXT.B
+			*rval = (int8_t)rs1;
+			return 1;
+		case 5: // SEXT.H
+			*rval = (int16_t)rs1;
+			return 1;
+		}
+		return 0;
+	case 0x14 << 3 | 0b101: // ORC.B
+		*rval = (((rs1 & 0x7f7f7f7f) + 0x7f7f7f7f) | rs1) & 0x80808080;
+		*rval = (*rval << 1) - (*rval >> 7);
+		return sel == 7;
+	case 0x34 << 3 | 0b101: // REV8
+		*rval = __builtin_bswap32(rs1);
+		return sel == 24;
+	default:
+		return 0;
+	}
+}
+
+// CSR number to 1 + its slot in RV32_CPU::csr, 0 for ones that do not
+// exist (illegal instruction) or CSR_ZERO for ones hardwired to zero.
+#define CSR_ZERO 0xff
+static const uint8_t csr_slots[4096] = {
+	// sstatus, sie and sip are masked in op_csr, fflags and frm shifted too.
+	[0x001] = 1 + csr_fcsr,       [0x002] = 1 + csr_fcsr,
+	[0x003] = 1 + csr_fcsr,
+	[0x100] = 1 + csr_mstatus,    [0x104] = 1 + csr_mie,
+	[0x105] = 1 + csr_stvec,      [0x106] = 1 + csr_scounteren,
+	[0x140] = 1 + csr_sscratch,   [0x141] = 1 + csr_sepc,
+	[0x142] = 1 + csr_scause,     [0x143] = 1 + csr_stval,
+	[0x144] = 1 + csr_mip,        [0x180] = 1 + csr_satp,
+	[0x300] = 1 + csr_mstatus,    [0x301] = 1 + csr_misa,
+	[0x302] = 1 + csr_medeleg,    [0x303] = 1 + csr_mideleg,
+	[0x304] = 1 + csr_mie,        [0x305] = 1 + csr_mtvec,
+	[0x306] = 1 + csr_mcounteren, [0x310] = CSR_ZERO, // mstatush
+	[0x320] = CSR_ZERO, // mcountinhibit
+	[0x340] = 1 + csr_mscratch,   [0x341] = 1 + csr_mepc,
+	[0x342] = 1 + csr_mcause,     [0x343] = 1 + csr_mtval,
+	[0x344] = 1 + csr_mip,
+	[0x3a0] = CSR_ZERO, [0x3b0] = CSR_ZERO, // pmpcfg0, pmpaddr0
+	// mcycle, minstret and their user-mode shadows: one instruction per cycle.
+	[0xb00] = 1 + csr_cyclel,     [0xb02] = 1 + csr_cyclel,
+	[0xb80] = 1 + csr_cycleh,     [0xb82] = 1 + csr_cycleh,
+	[0xc00] = 1 + csr_cyclel,     [0xc01] = 1 + csr_timerl,
+	[0xc02] = 1 + csr_cyclel,     [0xc80] = 1 + csr_cycleh,
+	[0xc81] = 1 + csr_timerh,     [0xc82] = 1 + csr_cycleh,
+	[0xf11] = 1 + csr_mvendorid,  [0xf12] = CSR_ZERO, // marchid
+	[0xf13] = CSR_ZERO, // mimpid
+	[0xf14] = 1 + csr_mhartid,    [0xf15] = CSR_ZERO, // mconfigptr
+};
+
+static uint32_t op_csr(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	uint32_t csrno = in->ir >> 20;
+	int microop = FUNCT3(in);
 	if ((microop & 3)) // It's a Zicsr function.
 	{
-		return (2 + 1);
-		int rs1imm = (ir >> 15) & 0x1f;
-		if (!(microop >> 2))
-			rs1imm = REG(rs1imm);
-		uint32_t csrnums[18] = {0x300, 0xC00, 0x340, 0x305, 0x304, 0x344,
-					0x341, 0x343, 0x342, 0xf11, 0x301,0xf14,0x3a0,0x3b0};
-		for (i = 0; i < 18;)
-			if (csrno == csrnums[i++])
-				break;
-		if(i > 13)
+		uint32_t rs1imm = (microop >> 2) ? in->rs1 : REG(in->rs1);
+		uint32_t slot = csr_slots[csrno];
+		uint32_t mask = ~0u, shift = 0, old;
+		// CSRRS/CSRRC with x0 (or a zero immediate) only read.
+		int writes = (microop & 3) == 0b01 || in->rs1;
+
+		if (!slot || (CSR(extraflags) & 3) < ((csrno >> 8) & 3))
+			return (2 + 1);
+		if (csrno == 0x180 && (CSR(extraflags) & 3) == 1 && (CSR(mstatus) & MSTATUS_TVM))
 			return (2 + 1);
-		if(i > 11)
+		if (writes && (csrno >> 10) == 3) // Read-only.
+			return (2 + 1);
+		// User-mode counters, as far as mcounteren lets them through.
+		// scounteren is kept but not checked: the nommu kernel never sets it.
+		if ((CSR(extraflags) & 3) < 3 && (csrno >> 8) == 0xc &&
+		    !(CSR(mcounteren) & (1u << (csrno & 0x1f))))
+			return (2 + 1);
+		if (slot == CSR_ZERO) {
+			*rval = 0;
 			return 0;
+		}
+		if (slot - 1 == csr_fcsr) {
+			if (!(CSR(mstatus) & RV32_MSTATUS_FS))
+				return (2 + 1);
+			RV32_fp_fold_flags(state);
+		}
 
-		csrno = i-1;
-		uint32_t writeval = state->csr[csrno];
+		if (csrno == 0x100)
+			mask = SSTATUS_MASK;
+		else if (csrno == 0x104 || csrno == 0x144)
+			mask = CSR(mideleg);
+		else if (csrno == 0x001) // fflags
+			mask = 0x1f;
+		else if (csrno == 0x002) // frm
+			mask = 0xe0, shift = 5;
+		old = state->csr[slot - 1];
+		uint32_t writeval = (old & mask) >> shift;
 		*rval = writeval;
+		if (!writes)
+			return 0;
 		switch (microop & 0x3) {
 		case 0b01:
 			writeval = rs1imm;
@@ -376,34 +2096,109 @@ static uint32_t op_csr(RV32_CPU* state, uint32_t* rval) {
 			writeval &= ~rs1imm;
 			break; // CSRRC
 		}
-		state->csr[csrno] = writeval;
+		writeval = (old & ~mask) | ((writeval << shift) & mask);
+		switch (slot - 1) {
+		case csr_mstatus:
+			writeval &= MSTATUS_SIE | MSTATUS_MIE | MSTATUS_SPIE | MSTATUS_MPIE | MSTATUS_SPP |
+			            MSTATUS_MPP | RV32_MSTATUS_FS | MSTATUS_MPRV | MSTATUS_SUM |
+			            MSTATUS_MXR | MSTATUS_TVM | MSTATUS_TW | MSTATUS_TSR;
+			if ((writeval & MSTATUS_MPP) == (2 << 11))
+				writeval &= ~MSTATUS_MPP; // No H-mode.
+			if ((writeval & RV32_MSTATUS_FS) == RV32_MSTATUS_FS)
+				writeval |= RV32_MSTATUS_SD;
+			break;
+		case csr_fcsr:
+			writeval &= 0xff;
+			CSR(mstatus) |= RV32_MSTATUS_FS | RV32_MSTATUS_SD;
+			break;
+		case csr_mtvec:
+		case csr_stvec:
+			writeval &= ~3; // Direct mode only.
+			break;
+		case csr_mepc:
+		case csr_sepc:
+			writeval &= ~1; // IALIGN is 16 with RVC.
+			break;
+		case csr_medeleg:
+			writeval &= 0xb3ff; // Not ECALL from M-mode, nor reserved causes.
+			break;
+		case csr_mideleg:
+			writeval &= 0x222; // SSIP, STIP, SEIP.
+			break;
+		case csr_mip:
+			// The S-mode bits are for software, the rest are set by the
+			// timer, the CLINT and the PLIC. Through sip, only SSIP.
+			writeval = (old & ~0x222) | (writeval & (csrno == 0x144 ? 0x2 : 0x222));
+			break;
+		case csr_satp:
+			writeval &= 0x803fffff; // No ASIDs.
+			break;
+		case csr_misa: // Fixed.
+			return 0;
+		}
+		state->csr[slot - 1] = writeval;
+		// Cached translations checked SUM and MXR, and any satp may have
+		// other page tables behind it. The nommu kernel flips SUM around
+		// every user access, with nothing to flush.
+		if ((slot - 1 == csr_mstatus && (CSR(satp) >> 31) &&
+		     ((old ^ writeval) & (MSTATUS_SUM | MSTATUS_MXR))) ||
+		    slot - 1 == csr_satp)
+			RV32_flush_tlb(state);
+		else if (slot - 1 == csr_mstatus)
+			update_mmu(state);
 	} else if (microop == 0b000) // "SYSTEM"
 	{
+		uint32_t priv = CSR(extraflags) & 3;
+		uint32_t startmstatus = CSR(mstatus);
+
 		if (csrno == 0x105) // WFI (Wait for interrupts)
 		{
+			if (priv < 3 && (startmstatus & MSTATUS_TW))
+				return (2 + 1);
+			RV32_STAT(state, wfi);
 			CSR(mstatus) |= 8;    // Enable interrupts
 			CSR(extraflags) |= 4; // Infor environment we want to go to sleep.
 			CSR(pc) += 4;
 			return 0;
-		} else if (((csrno & 0xff) == 0x02)) // MRET
+		} else if (csrno == 0x302) // MRET
 		{
 			// https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
 			// Table 7.6. MRET then in mstatus/mstatush sets
-			// MPV=0, MPP=0, MIE=MPIE, and MPIE=1. La
-			//  Should also update mstatus to reflect correct
-			//  mode.
-			uint32_t startmstatus = CSR(mstatus);
-			uint32_t startextraflags = CSR(extraflags);
-			CSR(extraflags) = (startextraflags & ~3) | ((startmstatus >> 11) & 3);
-			CSR(mstatus) = ((startmstatus & 0x80) >> 4) | ((startextraflags & 3) << 11) | 0x80;
+			// MPV=0, MPP=0, MIE=MPIE, and MPIE=1. Leaving M-mode
+			// also clears MPRV.
+			uint32_t mpp = (startmstatus >> 11) & 3;
+
+			if (priv < 3)
+				return (2 + 1);
+			CSR(extraflags) = (CSR(extraflags) & ~3) | mpp;
+			CSR(mstatus) = (startmstatus & ~(MSTATUS_MIE | MSTATUS_MPP)) |
+			               ((startmstatus & MSTATUS_MPIE) >> 4) | MSTATUS_MPIE;
+			if (mpp != 3)
+				CSR(mstatus) &= ~MSTATUS_MPRV;
 			CSR(pc) = CSR(mepc) - 4;
+			update_mmu(state);
+		} else if (csrno == 0x102) // SRET
+		{
+			// SIE=SPIE, SPIE=1, SPP=U, and back to the mode in SPP.
+			if (priv < 1 || (priv == 1 && (startmstatus & MSTATUS_TSR)))
+				return (2 + 1);
+			CSR(extraflags) = (CSR(extraflags) & ~3) | ((startmstatus & MSTATUS_SPP) >> 8);
+			CSR(mstatus) = (startmstatus & ~(MSTATUS_SIE | MSTATUS_SPP | MSTATUS_MPRV)) |
+			               ((startmstatus & MSTATUS_SPIE) >> 4) | MSTATUS_SPIE;
+			CSR(pc) = CSR(sepc) - 4;
+			update_mmu(state);
+		} else if ((csrno >> 5) == 0x09) // SFENCE.VMA
+		{
+			// Flushes everything, whatever the address and ASID.
+			if (priv < 1 || (priv == 1 && (startmstatus & MSTATUS_TVM)))
+				return (2 + 1);
+			RV32_flush_tlb(state);
 		} else {
 			switch (csrno) {
 			case 0:
-				return (CSR(extraflags) & 3) ? (11 + 1) : (8 + 1);
+				return (8 + priv) + 1;
 				break; // ECALL; 8 = "Environment call from
-				       // U-mode"; 11 = "Environment call
-				       // from M-mode"
+				       // U-mode", 9 from S-mode, 11 from M-mode
 			case 1:
 				return (3 + 1);
 				break; // EBREAK 3 = "Breakpoint"
@@ -417,63 +2212,268 @@ static uint32_t op_csr(RV32_CPU* state, uint32_t* rval) {
 	return 0;
 }
 
-static uint32_t op_amo(RV32_CPU* state, uint32_t* rval)  {
-	uint32_t ir = RV32_CAST4B(get_pc(state));
-	uint32_t rs1 = REG((ir >> 15) & 0x1f);
-	uint32_t rs2 = REG((ir >> 20) & 0x1f);
-	uint32_t irmid = (ir >> 27) & 0x1f;
+// Other harts share RAM, so every read-modify-write is one host atomic.
+static uint32_t op_amo(RV32_CPU* state, const RV32_insn* in, uint32_t* rval)  {
+	uint32_t rs2 = REG(in->rs2);
+	uint32_t ofs = REG(in->rs1) - state->base_ofs;
+	uint32_t* word;
+	uint32_t old, new, trap;
 
-	rs1 -= state->base_ofs;
+	if (ofs & 3) {
+		*rval = REG(in->rs1);
+		return (6 + 1); // Store/AMO address misaligned
+	}
+	if (state->mmu & RV32_MMU_DATA) {
+		int lr = ((in->ir >> 27) & 0x1f) == 0b00010;
 
-	if (rs1 >= state->total_mem - 3) {
-		*rval = rs1 + state->base_ofs;
-		return	(7 + 1); // Store/AMO access fault
-	} else {
-		*rval = RV32_CAST4B(rs1);
-
-		// Referenced a little bit of
-		// https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
-		uint32_t dowrite = 1;
-		switch (irmid) {
-		case 0b00010:
-			dowrite = 0;
-			break; // LR.W
-		case 0b00011:
-			*rval = 0;
-			break; // SC.W (Lie and always say it's good)
-		case 0b00001:
-			break; // AMOSWAP.W
-		case 0b00000:
-			rs2 += *rval;
-			break; // AMOADD.W
-		case 0b00100:
-			rs2 ^= *rval;
-			break; // AMOXOR.W
-		case 0b01100:
-			rs2 &= *rval;
-			break; // AMOAND.W
-		case 0b01000:
-			rs2 |= *rval;
-			break; // AMOOR.W
-		case 0b10000:
-			rs2 = ((int32_t)rs2 < (int32_t)*rval) ? rs2 : *rval;
-			break; // AMOMIN.W
-		case 0b10100:
-			rs2 = ((int32_t)rs2 > (int32_t)*rval) ? rs2 : *rval;
-			break; // AMOMAX.W
-		case 0b11000:
-			rs2 = (rs2 < *rval) ? rs2 : *rval;
-			break; // AMOMINU.W
-		case 0b11100:
-			rs2 = (rs2 > *rval) ? rs2 : *rval;
-			break; // AMOMAXU.W
-		default:
-			return (2 + 1);
-			dowrite = 0;
-			break; // Not supported.
+		*rval = REG(in->rs1);
+		if ((trap = translate(state, REG(in->rs1), lr ? RV32_ACCESS_LOAD : RV32_ACCESS_STORE,
+		                      &ofs)))
+			return trap;
+		if (ofs >= state->total_mem - 3)
+			return lr ? (5 + 1) : (7 + 1); // No atomics outside RAM.
+	}
+	word = (uint32_t*)(state->mem + ofs);
+	// Outside RAM the access faults; execute_mmio turns that into an access fault.
+	FAULT_BARRIER();
+	// Referenced a little bit of
+	// https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
+	switch ((in->ir >> 27) & 0x1f) {
+	case 0b00010: // LR.W
+		*rval = state->lr_val = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+		state->lr_addr = REG(in->rs1);
+		return 0;
+	case 0b00011: // SC.W
+		// Succeeds if the word still holds what LR.W read, like QEMU does.
+		old = state->lr_val;
+		*rval = !(state->lr_addr == REG(in->rs1) &&
+		          __atomic_compare_exchange_n(word, &old, rs2, 0, __ATOMIC_SEQ_CST,
+		                                      __ATOMIC_RELAXED));
+		state->lr_addr = 0;
+		if (*rval)
+			return 0;
+		break;
+	case 0b00001: // AMOSWAP.W
+		*rval = __atomic_exchange_n(word, rs2, __ATOMIC_SEQ_CST);
+		break;
+	case 0b00000: // AMOADD.W
+		*rval = __atomic_fetch_add(word, rs2, __ATOMIC_SEQ_CST);
+		break;
+	case 0b00100: // AMOXOR.W
+		*rval = __atomic_fetch_xor(word, rs2, __ATOMIC_SEQ_CST);
+		break;
+	case 0b01100: // AMOAND.W
+		*rval = __atomic_fetch_and(word, rs2, __ATOMIC_SEQ_CST);
+		break;
+	case 0b01000: // AMOOR.W
+		*rval = __atomic_fetch_or(word, rs2, __ATOMIC_SEQ_CST);
+		break;
+	case 0b10000: // AMOMIN.W
+	case 0b10100: // AMOMAX.W
+	case 0b11000: // AMOMINU.W
+	case 0b11100: // AMOMAXU.W
+		old = __atomic_load_n(word, __ATOMIC_RELAXED);
+		do {
+			switch ((in->ir >> 27) & 0x1f) {
+			case 0b10000:
+				new = ((int32_t)rs2 < (int32_t)old) ? rs2 : old;
+				break;
+			case 0b10100:
+				new = ((int32_t)rs2 > (int32_t)old) ? rs2 : old;
+				break;
+			case 0b11000:
+				new = (rs2 < old) ? rs2 : old;
+				break;
+			default:
+				new = (rs2 > old) ? rs2 : old;
+				break;
+			}
+		} while (!__atomic_compare_exchange_n(word, &old, new, 1, __ATOMIC_SEQ_CST,
+		                                      __ATOMIC_RELAXED));
+		*rval = old;
+		break;
+	default:
+		return (2 + 1); // Not supported.
+	}
+	if (CODE_MAPPED(ofs))
+		invalidate_code(state, ofs, 4);
+	return 0;
+}
+
+static uint32_t op_fence(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	switch (FUNCT3(in)) {
+	case 0b000: // FENCE
+		if (state->harts)
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		break;
+	case 0b001: // FENCE.I
+		// This hart's own stores already drop the code they hit, only
+		// another hart's can leave stale translations behind.
+		if (state->harts)
+			RV32_flush_code(state);
+		break;
+	default:
+		return (2 + 1);
+	}
+	return 0;
+}
+
+uint8_t* RV32_map_ram(uint32_t size, int hugepages) {
+	static int handler_installed;
+	struct sigaction sa = {0};
+	size_t align = hugepages ? RV32_HUGEPAGE_SIZE : 0;
+	size_t len = size;
+	uint8_t *window, *mem;
+
+	// Reserve the whole window; only the front of it becomes RAM.
+	window = mmap(NULL, RV32_RAM_WINDOW + align, PROT_NONE,
+	              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (window == MAP_FAILED)
+		return NULL;
+	mem = window;
+	if (align) {
+		// Trim the slack so the window is exactly what RV32_unmap_ram frees.
+		mem = (uint8_t*)(((uintptr_t)window + align - 1) & ~(uintptr_t)(align - 1));
+		if (mem != window)
+			munmap(window, mem - window);
+		if (mem + RV32_RAM_WINDOW != window + RV32_RAM_WINDOW + align)
+			munmap(mem + RV32_RAM_WINDOW, window + align - mem);
+	}
+
+	if (hugepages) {
+		len = (len + RV32_HUGEPAGE_SIZE - 1) & ~(size_t)(RV32_HUGEPAGE_SIZE - 1);
+		if (mmap(mem, len, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED)
+			goto mapped;
+		// No hugetlbfs pages reserved, ask for transparent ones instead.
+	}
+	if (mmap(mem, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+	         0) == MAP_FAILED) {
+		munmap(mem, RV32_RAM_WINDOW);
+		return NULL;
+	}
+	if (hugepages)
+		madvise(mem, len, MADV_HUGEPAGE);
+mapped:
+	// Machines may be set up from several threads at once; the handler is
+	// the same for all of them.
+	if (!__atomic_exchange_n(&handler_installed, 1, __ATOMIC_ACQ_REL)) {
+		// SA_NODEFER: the handler leaves through siglongjmp without
+		// restoring the signal mask.
+		sa.sa_sigaction = fault_handler;
+		sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGSEGV, &sa, NULL)) {
+			__atomic_store_n(&handler_installed, 0, __ATOMIC_RELEASE);
+			munmap(mem, RV32_RAM_WINDOW);
+			return NULL;
 		}
-		if (dowrite)
-			RV32_CAST4B(rs1) = rs2;
 	}
+	return mem;
+}
+
+// Frees RAM from RV32_map_ram, along with the rest of its window.
+void RV32_unmap_ram(uint8_t* mem) {
+	if (mem)
+		munmap(mem, RV32_RAM_WINDOW);
+}
+
+int RV32_attach_device(RV32_CPU* state, const RV32_device* dev) {
+	RV32_bus* bus = &state->bus;
+	uint32_t first = dev->base >> 12, last = (dev->base + dev->size - 1) >> 12;
+
+	if (bus->ndevices == RV32_BUS_DEVICES || !dev->size || last < first)
+		return -1;
+	// Pages belong to one device; refuse overlaps before touching anything.
+	for (uint32_t page = first; page <= last; page++) {
+		uint8_t* dir = bus->dir[page >> RV32_BUS_DIR_BITS];
+		if (dir && dir[page & ((1 << RV32_BUS_DIR_BITS) - 1)])
+			return -1;
+	}
+	for (uint32_t page = first; page <= last; page++) {
+		uint8_t** dir = &bus->dir[page >> RV32_BUS_DIR_BITS];
+		if (!*dir && !(*dir = calloc(1 << RV32_BUS_DIR_BITS, 1)))
+			return -1;
+		(*dir)[page & ((1 << RV32_BUS_DIR_BITS) - 1)] = bus->ndevices + 1;
+	}
+	bus->devices[bus->ndevices++] = *dev;
+	return 0;
+}
+
+// The kernel reads and writes its CSRs through this window at 0x400.
+static uint32_t csr_window_load(void* opaque, uint32_t addr, int size) {
+	return ((RV32_CPU*)opaque)->csr[addr >> 2];
+}
+
+static uint32_t csr_window_store(void* opaque, uint32_t addr, uint32_t val, int size) {
+	((RV32_CPU*)opaque)->csr[addr >> 2] = val;
 	return 0;
 }
+
+// https://chromitem-soc.readthedocs.io/en/latest/clint.html
+// msip per hart at 0x0, mtimecmp per hart at 0x4000, the shared mtime at 0xbff8.
+static RV32_CPU* clint_hart(RV32_CPU* state, uint32_t hartid) {
+	if (!state->harts)
+		return hartid == state->hartid ? state : NULL;
+	return hartid < state->nharts ? state->harts[hartid] : NULL;
+}
+
+static uint32_t clint_load(void* opaque, uint32_t addr, int size) {
+	RV32_CPU* state = opaque;
+	RV32_CPU* hart;
+
+	if (addr == 0xbffc)
+		return CSR(timerh);
+	if (addr == 0xbff8)
+		return CSR(timerl);
+	if (addr < 0x4000 && (hart = clint_hart(state, addr >> 2)))
+		return __atomic_load_n(&hart->msip, __ATOMIC_RELAXED);
+	if (addr >= 0x4000 && (hart = clint_hart(state, (addr - 0x4000) >> 3)))
+		return hart->csr[(addr & 4) ? csr_timermatchh : csr_timermatchl];
+	return 0;
+}
+
+static uint32_t clint_store(void* opaque, uint32_t addr, uint32_t val, int size) {
+	RV32_CPU* state = opaque;
+	RV32_CPU* hart;
+
+	if (addr < 0x4000 && (hart = clint_hart(state, addr >> 2))) {
+		__atomic_store_n(&hart->msip, val & 1, __ATOMIC_RELEASE);
+		if (hart == state)
+			RV32_update_timer(state);
+		else
+			RV32_post(hart, RV32_POST_IRQ);
+	} else if (addr >= 0x4000 && addr < 0xbff8 && (hart = clint_hart(state, (addr - 0x4000) >> 3))) {
+		__atomic_store_n(&hart->csr[(addr & 4) ? csr_timermatchh : csr_timermatchl], val,
+		                 __ATOMIC_RELAXED);
+		// MTIP follows mtimecmp at once: the timer driver re-enables MTIE
+		// right after moving the match, and a stale MTIP would fire early.
+		// The step was sized for the old match; end it so the next one
+		// is sized for this.
+		if (hart == state) {
+			RV32_update_timer(state);
+			__atomic_fetch_or(&state->posted, RV32_POST_TIMER, __ATOMIC_RELAXED);
+		} else
+			RV32_post(hart, RV32_POST_IRQ | RV32_POST_TIMER);
+	}
+	return 0;
+}
+
+int RV32_init_bus(RV32_CPU* state) {
+	RV32_device csr_window = {0x400, 18 * 4, csr_window_load, csr_window_store, state};
+	RV32_device clint = {0x11000000, 0x10000, clint_load, clint_store, state};
+
+	if (RV32_attach_device(state, &csr_window) || RV32_attach_device(state, &clint))
+		return -1;
+	return 0;
+}
+
+void RV32_free_bus(RV32_CPU* state) {
+	RV32_bus* bus = &state->bus;
+
+	for (uint32_t i = 0; i < sizeof(bus->dir) / sizeof(bus->dir[0]); i++) {
+		free(bus->dir[i]);
+		bus->dir[i] = NULL;
+	}
+	bus->ndevices = 0;
+}
@@ -1,19 +1,292 @@
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef __RISCV_EMU_H__
 #define __RISCV_EMU_H__
 
+/* Guest RAM sits at the front of a window covering every 32-bit offset from
+ * base_ofs, plus a guard for accesses that straddle its end. The rest of the
+ * window is never mapped, so touching it faults into the MMIO path. */
+#define RV32_RAM_WINDOW ((1ull << 32) + (1 << 16))
+#define RV32_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* Predecoded instruction cache, direct mapped on the RAM offset of the pc.
+ * RVC puts instructions on every halfword, so it is indexed by those. */
+#define RV32_ICACHE_BITS 15
+#define RV32_ICACHE_SIZE (1 << RV32_ICACHE_BITS)
+#define RV32_ICACHE_SLOT(ofs) (((ofs) >> 1) & (RV32_ICACHE_SIZE - 1))
+
+typedef struct RV32_insn {
+	uint32_t tag; // RAM offset the entry was decoded from.
+	// Compressed instructions are expanded to their 32-bit form but keep
+	// their own quadrant in bits 1:0, which is how RV32_INSN_LEN tells.
+	uint32_t ir;
+	int32_t imm; // Sign-extended immediate.
+	uint8_t op; // Handler, one of rv32_op_*. rv32_op_decode means empty.
+	uint8_t rd, rs1, rs2;
+} RV32_insn;
+
+/* Bytes from this instruction to the next. */
+#define RV32_INSN_LEN(in) (((in)->ir & 3) == 3 ? 4 : 2)
+
+/* Basic blocks for the threaded engine (RV32_step_blocks). */
+#define RV32_BLOCK_BITS 12
+#define RV32_BLOCK_MAX 32
+#define RV32_BLOCK_POOL (1 << 16)
+/* Blocks are also listed by the 4KiB page they start on, hashed. */
+#define RV32_BLOCK_PAGE_BITS 10
+/* One bit per 4KiB page of RAM that holds decoded instructions. */
+#define RV32_CODE_MAP_SIZE (1 << (32 - 12 - 5))
+
+/* Instruction pairs the threaded engine runs as one operation. */
+enum {
+	RV32_FUSE_LUI_ADDI,   // 32-bit constant.
+	RV32_FUSE_AUIPC_JALR, // Far call or jump.
+	RV32_FUSE_AUIPC_LOAD, // PC-relative load.
+	RV32_FUSE_SLT_BRANCH, // SLT(I)(U) into BEQZ/BNEZ.
+	RV32_FUSE_ADDI_BNE,   // Loop counter.
+	RV32_FUSE_COUNT,
+};
+
+typedef struct RV32_tinsn {
+	const void* handler; // Label in RV32_step_blocks.
+	RV32_insn in;
+} RV32_tinsn;
+
+typedef struct RV32_block {
+	uint32_t start; // RAM offset of the first instruction, ~0 once dropped.
+	uint32_t end;   // RAM offset past the last one.
+	uint32_t len;
+	RV32_tinsn* code;
+	struct RV32_block* next[2]; // Chained successors: fall-through, taken.
+	struct RV32_block* page_next;
+} RV32_block;
+
+typedef struct RV32_blocks {
+	RV32_block* map[1 << RV32_BLOCK_BITS];
+	RV32_block* pages[1 << RV32_BLOCK_PAGE_BITS];
+	RV32_block pool[RV32_BLOCK_POOL / 8];
+	RV32_tinsn code[RV32_BLOCK_POOL];
+	uint32_t nblocks, ncode;
+	uint32_t gen; // Bumped on every flush.
+} RV32_blocks;
+
+/* MMIO device bus. Devices own whole 4KiB pages of the physical address
+ * space and are found through a two level page radix, so lookup costs the
+ * same however many are attached. RAM accesses never get here. */
+#define RV32_BUS_DEVICES 32
+#define RV32_BUS_DIR_BITS 10 // Each directory covers 4MiB.
+
+typedef struct RV32_device {
+	uint32_t base, size;
+	// addr is relative to base, size is the access width in bytes.
+	uint32_t (*load)(void* opaque, uint32_t addr, int size);
+	// A non-zero return ends the step and is handed back by RV32_step.
+	uint32_t (*store)(void* opaque, uint32_t addr, uint32_t val, int size);
+	void* opaque;
+} RV32_device;
+
+typedef struct RV32_bus {
+	uint8_t* dir[1 << (32 - 12 - RV32_BUS_DIR_BITS)]; // Device number + 1 per page.
+	RV32_device devices[RV32_BUS_DEVICES];
+	uint32_t ndevices;
+	uint32_t request; // Pending store result for the host.
+} RV32_bus;
+
+/* Harts sharing one RAM, each stepped by its own host thread. */
+#define RV32_MAX_HARTS 32
+
+#ifdef RV32_STATS
+/* Execution counters, per hart. Built in with make STATS=1; without it,
+ * RV32_STAT compiles to nothing. */
+typedef struct RV32_stats {
+	uint64_t opcodes[32]; // Instructions retired, by major opcode (ir[6:2]).
+	uint64_t traps[16]; // Exceptions taken, by mcause.
+	uint64_t irqs[16]; // Interrupts taken, by mcause without the interrupt bit.
+	uint64_t mmio_loads[RV32_BUS_DEVICES]; // By device, as in RV32_bus::devices.
+	uint64_t mmio_stores[RV32_BUS_DEVICES];
+	uint64_t fused[RV32_FUSE_COUNT]; // Pairs run as one, by RV32_FUSE_*.
+	uint64_t wfi;
+	uint64_t step_ns, loop_ns; // Host time in the step function and the rest of the main loop.
+} RV32_stats;
+#define RV32_STAT(state, counter) ((state)->stats.counter++)
+#else
+#define RV32_STAT(state, counter) ((void)0)
+#endif
+
+/* Interrupts in mip/mie a hart can take: software, timer, external, for
+ * S-mode and M-mode. */
+#define RV32_IRQ_MASK ((1 << 1) | (1 << 3) | (1 << 5) | (1 << 7) | (1 << 9) | (1 << 11))
+
+/* What changed under a running hart, see RV32_post. */
+#define RV32_POST_IRQ 1 // msip or meip: fold them into mip.
+#define RV32_POST_TIMER 2 // mtimecmp: end the step, so the host can size the next one.
+
+/* Slots in RV32_CPU::csr, csr_* below. */
+#define RV32_CSR_COUNT 30
+
+/* mstatus.FS, the state of the F and D registers. Off makes their
+ * instructions illegal; anything that may change them, fcsr included, sets
+ * dirty, and SD with it. */
+#define RV32_MSTATUS_FS (3 << 13)
+#define RV32_MSTATUS_SD (1u << 31)
+
+/* Sv32 translations, one direct mapped table on the virtual page number per
+ * privilege (U, S) and access type, so a hit needs no permission check. */
+#define RV32_TLB_BITS 8
+#define RV32_TLB_SIZE (1 << RV32_TLB_BITS)
+
+enum { RV32_ACCESS_FETCH, RV32_ACCESS_LOAD, RV32_ACCESS_STORE };
+
+typedef struct RV32_tlb {
+	uint32_t tag; // Virtual page | 1, 0 for an empty entry.
+	// RAM offset of the physical page, so the host address is mem + ofs as
+	// for untranslated accesses. Past total_mem for MMIO.
+	uint32_t ofs;
+} RV32_tlb;
+
+/* Where RV32_CPU::mmu says addresses are virtual. */
+#define RV32_MMU_FETCH 1
+#define RV32_MMU_DATA 2
+#define RV32_MMU_DATA_S 4 // Loads and stores check S-mode permissions, not U-mode.
+
 typedef struct RV32_CPU {
 	uint32_t regs[32];
-	uint32_t csr[18];
+	uint32_t csr[RV32_CSR_COUNT];
+	uint64_t fregs[32]; // F and D, singles NaN-boxed.
 	uint32_t total_mem;
 	uint32_t base_ofs;
 	uint8_t *mem;
+	uint32_t hartid;
+	uint32_t nharts;
+	struct RV32_CPU** harts; // Every hart by ID, NULL for a lone hart.
+	// Wakes the host thread of a hart in WFI after another hart posted an IPI
+	// or moved its timer. May be NULL.
+	void (*kick)(struct RV32_CPU* hart);
+	uint32_t lr_addr, lr_val; // LR.W reservation: address, 0 for none, and value read.
+	// Software interrupt posted through the CLINT, folded into mip when
+	// the hart next updates its timer so mip only changes between steps.
+	uint32_t msip;
+	// External interrupt line from the PLIC, folded into mip the same way.
+	uint32_t meip;
+	// RV32_POST_* bits, acted on by the engines at the next block boundary
+	// rather than the next step.
+	uint32_t posted;
+	// RV32_MMU_* for the current privilege, satp and mstatus.MPRV. Only the
+	// interpreter translates: the other engines hand over while it is set.
+	uint32_t mmu;
+	RV32_tlb tlb[2][3][RV32_TLB_SIZE];
+	RV32_insn icache[RV32_ICACHE_SIZE];
+	uint32_t code_map[RV32_CODE_MAP_SIZE];
+	RV32_blocks blocks;
+	struct RV32_jit* jit; // Set up by RV32_jit_init, NULL otherwise.
+	RV32_bus bus;
+#ifdef RV32_STATS
+	RV32_stats stats;
+#endif
 } RV32_CPU;
 
-uint32_t HandleControlLoad(uint32_t addy);
-uint32_t HandleControlStore(uint32_t addy, uint32_t val);
 int32_t RV32_step(RV32_CPU* state, int count);
+int32_t RV32_run(RV32_CPU* state, int count);
+int32_t RV32_step_blocks(RV32_CPU* state, int count);
+int32_t RV32_step_jit(RV32_CPU* state, int count);
+void RV32_update_timer(RV32_CPU* state);
+void RV32_post(RV32_CPU* hart, uint32_t what);
+uint32_t RV32_irq_pending(RV32_CPU* state);
+void RV32_flush_tlb(RV32_CPU* state);
+int RV32_peek_virt(RV32_CPU* state, uint32_t va, uint32_t* ofs);
+void RV32_decode(RV32_CPU* state, RV32_insn* in, uint32_t ofs);
+void RV32_flush_code(RV32_CPU* state);
+void RV32_invalidate_code(RV32_CPU* state, uint32_t ofs, uint32_t len);
+RV32_CPU* RV32_current(void);
+
+uint8_t* RV32_map_ram(uint32_t size, int hugepages);
+void RV32_unmap_ram(uint8_t* mem);
+int RV32_init_bus(RV32_CPU* state);
+int RV32_attach_device(RV32_CPU* state, const RV32_device* dev);
+void RV32_free_bus(RV32_CPU* state);
+
+/* F and D on the host's FPU, see riscv-fp.c. */
+uint32_t RV32_fp_op(RV32_CPU* state, const RV32_insn* in, uint32_t* rval);
+void RV32_fp_fold_flags(RV32_CPU* state);
+
+int RV32_jit_init(RV32_CPU* state, int lockstep);
+void RV32_jit_flush(RV32_CPU* state);
+void RV32_jit_invalidate(RV32_CPU* state, uint32_t ofs, uint32_t len);
+void RV32_jit_free(RV32_CPU* state);
+
+/* Whole machine snapshots, see riscv-snap.c. Device state beyond the harts
+ * rides along as an opaque blob, see RV32_vm_save_devices. */
+typedef struct RV32_snapshot {
+	int fd;
+	uint32_t nharts;
+	uint32_t total_mem;
+	uint64_t ram_ofs; // Guest RAM in the file, page aligned.
+	void* devices; // Filled in by RV32_snapshot_restore, for the caller to free.
+	uint32_t devices_len;
+} RV32_snapshot;
+
+int RV32_snapshot_save(RV32_CPU* const* harts, uint32_t nharts, const void* devices,
+                       uint32_t devices_len, const char* path);
+int RV32_snapshot_open(RV32_snapshot* snap, const char* path);
+int RV32_snapshot_restore(RV32_snapshot* snap, RV32_CPU* const* harts);
+
+/* Sampling profiler with folded stack output, see riscv-prof.c. symbols is
+ * an ELF file or System.map, or NULL to leave addresses as they are. */
+#define RV32_PROFILE_DEPTH 32 // Frames kept per sample.
+
+typedef struct RV32_profile RV32_profile;
+
+RV32_profile* RV32_profile_create(const char* symbols);
+void RV32_profile_sample(RV32_profile* prof, RV32_CPU* state);
+uint64_t RV32_profile_samples(RV32_profile* prof);
+int RV32_profile_write(RV32_profile* prof, const char* path);
+void RV32_profile_free(RV32_profile* prof);
+
+/* virtio-mmio devices, see riscv-virtio.c. A device moves data straight
+ * between guest RAM and its backend; the machine it sits in says where RAM
+ * is and wires up its interrupt line. */
+typedef struct RV32_virtio_host {
+	uint8_t* mem;
+	uint32_t ram_base, ram_size;
+	void (*irq)(void* opaque, int level);
+	// The device wrote guest RAM, which may hold code.
+	void (*written)(void* opaque, uint32_t ofs, uint32_t len);
+	void* opaque;
+} RV32_virtio_host;
+
+typedef struct RV32_virtio RV32_virtio;
+
+#define RV32_VIRTIO_SIZE 0x1000 // Register window of one device.
+
+RV32_virtio* RV32_virtio_blk(const RV32_virtio_host* host, const char* path, int readonly);
+int RV32_virtio_blk_private(RV32_virtio* dev); // 0 for other devices.
+RV32_virtio* RV32_virtio_console(const RV32_virtio_host* host,
+                                 void (*out)(void* opaque, const uint8_t* buf, size_t len),
+                                 size_t (*in)(void* opaque, uint8_t* buf, size_t len),
+                                 void* opaque);
+/* Hands the console's input to the guest, if it has buffers for it. */
+void RV32_virtio_console_poll(RV32_virtio* dev);
+uint32_t RV32_virtio_load(void* opaque, uint32_t addr, int size);
+uint32_t RV32_virtio_store(void* opaque, uint32_t addr, uint32_t val, int size);
+void RV32_virtio_free(RV32_virtio* dev);
+
+/* What the driver set up in a device's transport, for snapshots: status,
+ * features and the rings. Restoring fails for another kind of device. */
+#define RV32_VIRTIO_QUEUES 2
+typedef struct RV32_virtio_state {
+	uint32_t device_id, status, isr;
+	uint32_t features_sel, driver_features_sel, queue_sel;
+	uint64_t driver_features;
+	struct {
+		uint32_t num, ready;
+		uint32_t desc_lo, desc_hi, avail_lo, avail_hi, used_lo, used_hi;
+		uint16_t last_avail, pending;
+	} queues[RV32_VIRTIO_QUEUES];
+} RV32_virtio_state;
+
+void RV32_virtio_save(RV32_virtio* dev, RV32_virtio_state* s);
+int RV32_virtio_restore(RV32_virtio* dev, const RV32_virtio_state* s);
 
 enum {
 	csr_mstatus,
@@ -34,6 +307,43 @@ enum {
 	csr_timerh,
 	csr_timermatchl,
 	csr_timermatchh,
+	// Only reachable through Zicsr, past the end of the window at 0x400.
+	csr_mhartid,
+	csr_mcounteren,
+	csr_medeleg,
+	csr_mideleg,
+	// S-mode. sstatus, sie and sip are views of their M-mode registers.
+	csr_stvec,
+	csr_scounteren,
+	csr_sscratch,
+	csr_sepc,
+	csr_scause,
+	csr_stval,
+	csr_satp,
+	// fflags and frm as fcsr[7:0]; the fflags and frm CSRs are views of it.
+	csr_fcsr,
+};
+
+enum {
+	rv32_op_decode,
+	rv32_op_illegal,
+	rv32_op_lui,
+	rv32_op_auipc,
+	rv32_op_jal,
+	rv32_op_jalr,
+	rv32_op_branch,
+	rv32_op_load,
+	rv32_op_store,
+	rv32_op_arithmetic,
+	rv32_op_csr,
+	rv32_op_amo,
+	rv32_op_fence,
+	rv32_op_load_mmio, // Loads and stores that once faulted, bounds checked.
+	rv32_op_store_mmio,
+	rv32_op_fp, // OP-FP and the fused multiply-adds.
+	rv32_op_fp_load,
+	rv32_op_fp_store,
+	rv32_op_bitmanip, // Zba, Zbb, Zbs: OP and OP-IMM beyond RV32I and M.
 };
 
 #endif
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "librv32emu.h"
+
+/*
+ * Fleets of independent machines on a pool of host threads.
+ *
+ * Each worker owns a queue of runnable jobs. It takes from the front, runs
+ * the job for a quantum and puts it back at the end, so its jobs share it
+ * round robin. A worker with nothing left steals from the back of the
+ * others' queues. A job whose harts all wait for an interrupt is parked on
+ * a list ordered by its next timer match, and taken off again by whichever
+ * worker is free once that time comes; until then it costs nothing.
+ *
+ * Machines are only created when their job first runs and are destroyed as
+ * soon as it ends.
+ */
+
+#define FLEET_QUANTUM 1000000 // Instructions per turn on a worker.
+#define FLEET_PARK_MAX 100000 // Microseconds, for machines with no timer set.
+
+typedef struct fleet_task {
+	RV32_job* job;
+	RV32_vm* vm;
+	FILE* out;
+	uint8_t* input;
+	size_t input_len, input_ofs; // Fed to the console up to input_ofs.
+	uint64_t wake; // When parked: host microseconds to run again at.
+	struct fleet_task* next; // Parked list.
+} fleet_task;
+
+typedef struct fleet_queue {
+	pthread_mutex_t lock;
+	fleet_task** tasks; // Ring of size entries, head to tail.
+	uint32_t size;
+	uint32_t head, tail; // Run free; changed under lock.
+} fleet_queue;
+
+typedef struct fleet {
+	fleet_queue* queues; // One per worker.
+	uint32_t nqueues;
+	fleet_task* tasks;
+	uint32_t ntasks;
+	int engine;
+	uint64_t start;
+	pthread_mutex_t lock; // The rest.
+	pthread_cond_t wake; // Work showed up, or everything is done.
+	fleet_task* parked; // Soonest first.
+	uint64_t first_wake; // parked->wake, 0 when none; read without the lock.
+	uint32_t idle; // Workers waiting on wake.
+	uint32_t done;
+} fleet;
+
+typedef struct fleet_worker {
+	fleet* f;
+	uint32_t id;
+	pthread_t thread;
+} fleet_worker;
+
+enum { TASK_RUN, TASK_PARK, TASK_DONE };
+
+static uint64_t now_us(void);
+static void* worker(void* arg);
+static fleet_task* next_task(fleet* f, uint32_t id);
+static int run_task(fleet* f, fleet_task* t);
+static int start_task(fleet* f, fleet_task* t);
+static void finish_task(fleet* f, fleet_task* t, int32_t status);
+static void park_task(fleet* f, fleet_task* t);
+static void push_task(fleet* f, fleet_queue* q, fleet_task* t);
+static fleet_task* pop_front(fleet_queue* q);
+static fleet_task* pop_back(fleet_queue* q);
+static void console_out(void* opaque, const uint8_t* buf, size_t len);
+
+int RV32_fleet_run(RV32_job* jobs, uint32_t njobs, uint32_t nthreads, int engine) {
+	fleet f = {.ntasks = njobs, .engine = engine};
+	fleet_worker* workers;
+	pthread_condattr_t attr;
+	uint32_t i;
+	int ret = -1;
+
+	if (!nthreads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = cpus > 0 ? cpus : 1;
+	}
+	if (nthreads > njobs)
+		nthreads = njobs ? njobs : 1;
+	f.nqueues = nthreads;
+	f.tasks = calloc(njobs, sizeof(fleet_task));
+	f.queues = calloc(nthreads, sizeof(fleet_queue));
+	workers = calloc(nthreads, sizeof(fleet_worker));
+	if ((njobs && !f.tasks) || !f.queues || !workers)
+		goto out;
+	pthread_mutex_init(&f.lock, NULL);
+	// Parked jobs are timed with now_us.
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&f.wake, &attr);
+	pthread_condattr_destroy(&attr);
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&f.queues[i].lock, NULL);
+		// Big enough for every job, so a push never fails.
+		f.queues[i].size = njobs ? njobs : 1;
+		if (!(f.queues[i].tasks = calloc(f.queues[i].size, sizeof(fleet_task*))))
+			goto out;
+	}
+	// Dealt out round robin; stealing evens out whatever is left.
+	for (i = 0; i < njobs; i++) {
+		fleet_queue* q = &f.queues[i % nthreads];
+
+		f.tasks[i].job = &jobs[i];
+		jobs[i].status = -1;
+		jobs[i].insns = jobs[i].run_us = jobs[i].latency_us = 0;
+		q->tasks[q->tail++ % q->size] = &f.tasks[i];
+	}
+
+	f.start = now_us();
+	for (i = 0; i < nthreads; i++) {
+		workers[i] = (fleet_worker){&f, i};
+		if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]))
+			break;
+	}
+	if (!i)
+		goto out;
+	// Short a thread or two: the ones that did start steal the rest.
+	while (i--)
+		pthread_join(workers[i].thread, NULL);
+	ret = 0;
+	pthread_cond_destroy(&f.wake);
+out:
+	for (i = 0; f.queues && i < nthreads; i++)
+		free(f.queues[i].tasks);
+	free(f.queues);
+	free(f.tasks);
+	free(workers);
+	return ret;
+}
+
+static void* worker(void* arg) {
+	fleet_worker* w = arg;
+	fleet* f = w->f;
+	fleet_task* t;
+
+	while ((t = next_task(f, w->id))) {
+		switch (run_task(f, t)) {
+		case TASK_RUN:
+			push_task(f, &f->queues[w->id], t);
+			break;
+		case TASK_PARK:
+			park_task(f, t);
+			break;
+		}
+	}
+	return NULL;
+}
+
+// Parked jobs that are due first, then this worker's own, then anyone's.
+// NULL once every job is done.
+static fleet_task* next_task(fleet* f, uint32_t id) {
+	fleet_task* t;
+
+	while (1) {
+		uint64_t first = __atomic_load_n(&f->first_wake, __ATOMIC_RELAXED);
+		uint64_t now = first ? now_us() : 0;
+
+		pthread_mutex_lock(&f->lock);
+		if (f->parked && f->parked->wake <= now) {
+			t = f->parked;
+			f->parked = t->next;
+			__atomic_store_n(&f->first_wake, f->parked ? f->parked->wake : 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&f->lock);
+			return t;
+		}
+		pthread_mutex_unlock(&f->lock);
+
+		if ((t = pop_front(&f->queues[id])))
+			return t;
+		for (uint32_t i = 1; i < f->nqueues; i++)
+			if ((t = pop_back(&f->queues[(id + i) % f->nqueues])))
+				return t;
+
+		// Nothing to run. Queues are checked again under the lock, which
+		// push_task takes to wake us, so no new work can slip by.
+		pthread_mutex_lock(&f->lock);
+		if (f->done == f->ntasks) {
+			pthread_mutex_unlock(&f->lock);
+			return NULL;
+		}
+		for (uint32_t i = 0; i < f->nqueues; i++)
+			if (__atomic_load_n(&f->queues[i].tail, __ATOMIC_ACQUIRE) !=
+			    __atomic_load_n(&f->queues[i].head, __ATOMIC_ACQUIRE))
+				goto again;
+		f->idle++;
+		if (f->parked) {
+			struct timespec ts = {f->parked->wake / 1000000, f->parked->wake % 1000000 * 1000};
+			pthread_cond_timedwait(&f->wake, &f->lock, &ts);
+		} else
+			pthread_cond_wait(&f->wake, &f->lock);
+		f->idle--;
+	again:
+		pthread_mutex_unlock(&f->lock);
+	}
+}
+
+// One quantum of a job.
+static int run_task(fleet* f, fleet_task* t) {
+	RV32_job* job = t->job;
+	uint64_t start = now_us();
+	uint64_t count = FLEET_QUANTUM;
+	int32_t ret;
+
+	if (!t->vm && start_task(f, t)) {
+		finish_task(f, t, -1);
+		return TASK_DONE;
+	}
+	if (t->input_ofs < t->input_len)
+		t->input_ofs += RV32_vm_input(t->vm, t->input + t->input_ofs, t->input_len - t->input_ofs);
+	if (job->max_insns) {
+		uint64_t done = RV32_vm_insns(t->vm);
+		if (done >= job->max_insns) {
+			finish_task(f, t, RV32_VM_RUNNING);
+			return TASK_DONE;
+		}
+		if (job->max_insns - done < count)
+			count = job->max_insns - done;
+	}
+	ret = RV32_vm_run(t->vm, count);
+	job->run_us += now_us() - start;
+	switch (ret) {
+	case RV32_VM_RUNNING:
+	case RV32_VM_SNAPSHOT: // Nowhere to save it.
+	case RV32_VM_FORK: // Jobs are not cloned; the guest reads index 0.
+		return TASK_RUN;
+	case RV32_VM_IDLE: {
+		uint64_t next = RV32_vm_next_timer(t->vm), now = RV32_vm_time(t->vm);
+		uint64_t wait = !next ? FLEET_PARK_MAX : next > now ? next - now : 0;
+
+		// It ate all the input it was given; more wakes it at once.
+		if (t->input_ofs < t->input_len)
+			return TASK_RUN;
+		t->wake = now_us() + (wait < FLEET_PARK_MAX ? wait : FLEET_PARK_MAX);
+		return TASK_PARK;
+	}
+	default:
+		finish_task(f, t, ret);
+		return TASK_DONE;
+	}
+}
+
+static int start_task(fleet* f, fleet_task* t) {
+	RV32_job* job = t->job;
+	FILE* in;
+	long len;
+
+	if (job->output && !(t->out = fopen(job->output, "wb")))
+		return -1;
+	if (job->input) {
+		if (!(in = fopen(job->input, "rb")))
+			return -1;
+		if (fseek(in, 0, SEEK_END) || (len = ftell(in)) < 0 || fseek(in, 0, SEEK_SET) ||
+		    !(t->input = malloc(len ? len : 1)) || (len && fread(t->input, len, 1, in) != 1)) {
+			fclose(in);
+			return -1;
+		}
+		fclose(in);
+		t->input_len = len;
+	}
+	t->vm = RV32_vm_create(&(RV32_vm_config){job->ram_size, 1, f->engine, 0,
+	                                         t->out ? console_out : NULL, NULL, t->out});
+	// Jobs may share a disk image, so none of them gets to write it.
+	if (!t->vm || (job->disk && RV32_vm_attach_disk(t->vm, job->disk, 1)) ||
+	    RV32_vm_load_files(t->vm, job->image, job->dtb))
+		return -1;
+	return 0;
+}
+
+static void finish_task(fleet* f, fleet_task* t, int32_t status) {
+	RV32_job* job = t->job;
+
+	job->status = status;
+	job->latency_us = now_us() - f->start;
+	if (t->vm) {
+		job->insns = RV32_vm_insns(t->vm);
+		RV32_vm_destroy(t->vm);
+		t->vm = NULL;
+	}
+	if (t->out)
+		fclose(t->out);
+	free(t->input);
+	t->out = NULL;
+	t->input = NULL;
+
+	pthread_mutex_lock(&f->lock);
+	if (++f->done == f->ntasks)
+		pthread_cond_broadcast(&f->wake);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void park_task(fleet* f, fleet_task* t) {
+	fleet_task** p;
+
+	pthread_mutex_lock(&f->lock);
+	for (p = &f->parked; *p && (*p)->wake <= t->wake; p = &(*p)->next)
+		;
+	t->next = *p;
+	*p = t;
+	__atomic_store_n(&f->first_wake, f->parked->wake, __ATOMIC_RELAXED);
+	// A worker waiting for the old first job would oversleep this one.
+	if (f->idle && f->parked == t)
+		pthread_cond_signal(&f->wake);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void push_task(fleet* f, fleet_queue* q, fleet_task* t) {
+	pthread_mutex_lock(&q->lock);
+	q->tasks[q->tail % q->size] = t;
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&f->lock);
+	if (f->idle)
+		pthread_cond_signal(&f->wake);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static fleet_task* pop_front(fleet_queue* q) {
+	fleet_task* t = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		t = q->tasks[q->head % q->size];
+		__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return t;
+}
+
+static fleet_task* pop_back(fleet_queue* q) {
+	fleet_task* t = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		t = q->tasks[(q->tail - 1) % q->size];
+		__atomic_store_n(&q->tail, q->tail - 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return t;
+}
+
+static void console_out(void* opaque, const uint8_t* buf, size_t len) {
+	fwrite(buf, 1, len, opaque);
+}
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,381 @@
+#include <fenv.h>
+#include <math.h>
+#include <string.h>
+
+#include "riscv-emu.h"
+
+/*
+ * F and D, on the host's FPU.
+ *
+ * Singles sit in the low half of a 64-bit register with the upper half all
+ * ones (NaN boxing); one that is not boxed reads as the canonical NaN, and
+ * every NaN an operation produces is canonical, as the spec allows.
+ *
+ * Operations that round run on the host in the instruction's rounding mode,
+ * which is only switched away from round to nearest even for the one
+ * operation. The host has no round to nearest, ties to max magnitude: for
+ * arithmetic RMM rounds to nearest even, conversions to integers get it
+ * right. Exception flags pile up in the host's sticky flags while a hart
+ * runs and are folded into fflags when the guest reads them and at the end
+ * of every step (RV32_fp_fold_flags). The host spots underflow before
+ * rounding and RISC-V after, so UF can differ for results that round up to
+ * the smallest normal.
+ *
+ * Built with -frounding-math, so the compiler folds nothing that depends on
+ * the rounding mode; the operations themselves are kept in a function it
+ * cannot see through, so none of them drift across a mode switch.
+ */
+
+#define CONCAT(A, B) A##B
+#define CSR(x) state->csr[CONCAT(csr_, x)]
+#define REG(x) state->regs[x]
+#define FREG(x) state->fregs[x]
+#define FUNCT3(in) (((in)->ir >> 12) & 0x7)
+
+#define FFLAG_NX 1
+#define FFLAG_UF 2
+#define FFLAG_OF 4
+#define FFLAG_DZ 8
+#define FFLAG_NV 16
+
+#define BOX 0xffffffff00000000ull
+#define CANON_S 0x7fc00000u
+
+// What calc_s and calc_d do.
+enum {
+	FP_ADD,
+	FP_SUB,
+	FP_MUL,
+	FP_DIV,
+	FP_SQRT,
+	FP_MADD, // FMADD, FMSUB, FNMSUB, FNMADD, in opcode order.
+	FP_MSUB,
+	FP_NMSUB,
+	FP_NMADD,
+	FP_CVT, // From the other precision.
+	FP_CVT_W,
+	FP_CVT_WU,
+};
+
+static const int host_rm[5] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD,
+                               FE_TONEAREST};
+
+static int round_mode(RV32_CPU* state, const RV32_insn* in);
+static uint32_t rounded(RV32_CPU* state, const RV32_insn* in, int op);
+static float calc_s(int op, float a, float b, float c, double wide, uint32_t x);
+static double calc_d(int op, double a, double b, double c, float narrow, uint32_t x);
+static uint32_t to_int(double v, int rm, int is_unsigned, uint32_t* flags);
+static double operand(RV32_CPU* state, int r, int d, int* nan);
+static uint32_t classify(uint64_t bits, int d);
+
+static uint32_t bits_s(RV32_CPU* state, int r) {
+	return (FREG(r) >> 32) == 0xffffffff ? (uint32_t)FREG(r) : CANON_S;
+}
+
+static float get_s(RV32_CPU* state, int r) {
+	uint32_t bits = bits_s(state, r);
+	float f;
+
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static double get_d(RV32_CPU* state, int r) {
+	double d;
+
+	memcpy(&d, &FREG(r), sizeof(d));
+	return d;
+}
+
+static void set_s(RV32_CPU* state, int r, float f) {
+	uint32_t bits = CANON_S;
+
+	if (!isnan(f))
+		memcpy(&bits, &f, sizeof(bits));
+	FREG(r) = BOX | bits;
+}
+
+static void set_d(RV32_CPU* state, int r, double d) {
+	if (isnan(d))
+		d = NAN;
+	memcpy(&FREG(r), &d, sizeof(d));
+}
+
+// OP-FP and the fused multiply-adds. Loads and stores are op_fp_load and
+// op_fp_store in riscv-emu.c.
+uint32_t RV32_fp_op(RV32_CPU* state, const RV32_insn* in, uint32_t* rval) {
+	uint32_t ir = in->ir, flags = 0;
+	int d = (ir >> 25) & 3, rd = (ir >> 7) & 0x1f, rm = FUNCT3(in), an, bn;
+	double a, b;
+
+	if (!(CSR(mstatus) & RV32_MSTATUS_FS) || d > 1) // Off, or H or Q.
+		return (2 + 1);
+	if (((ir >> 2) & 0x1f) != 0b10100)
+		return rounded(state, in, FP_MADD + ((ir >> 2) & 3));
+	switch (ir >> 27) {
+	case 0b00000: // FADD
+	case 0b00001: // FSUB
+	case 0b00010: // FMUL
+	case 0b00011: // FDIV
+		return rounded(state, in, ir >> 27);
+	case 0b01011: // FSQRT
+		return in->rs2 ? (2 + 1) : rounded(state, in, FP_SQRT);
+	case 0b01000: // FCVT.S.D, FCVT.D.S
+		return in->rs2 != (uint32_t)!d ? (2 + 1) : rounded(state, in, FP_CVT);
+	case 0b11010: // FCVT.S.W(U), FCVT.D.W(U)
+		return in->rs2 > 1 ? (2 + 1) : rounded(state, in, FP_CVT_W + in->rs2);
+	case 0b00100: // FSGNJ, FSGNJN, FSGNJX
+		if (rm > 2)
+			return (2 + 1);
+		if (d) {
+			uint64_t x = FREG(in->rs1), y = FREG(in->rs2), sign = 1ull << 63;
+			y = rm == 0 ? y : rm == 1 ? ~y : x ^ y;
+			FREG(rd) = (x & ~sign) | (y & sign);
+		} else {
+			uint32_t x = bits_s(state, in->rs1), y = bits_s(state, in->rs2), sign = 1u << 31;
+			y = rm == 0 ? y : rm == 1 ? ~y : x ^ y;
+			FREG(rd) = BOX | (x & ~sign) | (y & sign);
+		}
+		break;
+	case 0b00101: // FMIN, FMAX: a NaN loses to a number, and -0 < +0.
+		if (rm > 1)
+			return (2 + 1);
+		a = operand(state, in->rs1, d, &an);
+		b = operand(state, in->rs2, d, &bn);
+		if ((an | bn) & 2)
+			flags |= FFLAG_NV;
+		if (an && bn)
+			a = NAN;
+		else if (an)
+			a = b;
+		else if (!bn && (a == b ? !!signbit(a) == rm : (a < b) == rm))
+			a = b;
+		if (d)
+			set_d(state, rd, a);
+		else
+			set_s(state, rd, a);
+		break;
+	case 0b10100: // FLE, FLT, FEQ: only FEQ is quiet about quiet NaNs.
+		if (rm > 2)
+			return (2 + 1);
+		a = operand(state, in->rs1, d, &an);
+		b = operand(state, in->rs2, d, &bn);
+		if (an || bn) {
+			if (rm != 2 || ((an | bn) & 2))
+				flags |= FFLAG_NV;
+			*rval = 0;
+		} else {
+			*rval = rm == 2 ? a == b : rm == 1 ? a < b : a <= b;
+		}
+		if (!flags)
+			return 0;
+		break;
+	case 0b11000: // FCVT.W(U).S, FCVT.W(U).D
+		if (in->rs2 > 1 || (rm = round_mode(state, in)) < 0)
+			return (2 + 1);
+		a = operand(state, in->rs1, d, &an);
+		*rval = to_int(an ? NAN : a, rm, in->rs2, &flags);
+		if (!flags)
+			return 0;
+		break;
+	case 0b11100: // FMV.X.W, FCLASS
+		if (in->rs2 || rm > 1 || (d && !rm))
+			return (2 + 1);
+		*rval = rm ? classify(d ? FREG(in->rs1) : bits_s(state, in->rs1), d)
+		           : (uint32_t)FREG(in->rs1);
+		return 0; // Reads only.
+	case 0b11110: // FMV.W.X
+		if (in->rs2 || rm || d)
+			return (2 + 1);
+		FREG(rd) = BOX | REG(in->rs1);
+		break;
+	default:
+		return (2 + 1);
+	}
+	CSR(fcsr) |= flags;
+	CSR(mstatus) |= RV32_MSTATUS_FS | RV32_MSTATUS_SD;
+	return 0;
+}
+
+// Host exception flags raised since the last call, into fflags.
+void RV32_fp_fold_flags(RV32_CPU* state) {
+	int ex = fetestexcept(FE_ALL_EXCEPT);
+
+	if (!ex)
+		return;
+	feclearexcept(ex);
+	if (!(CSR(mstatus) & RV32_MSTATUS_FS))
+		return;
+	CSR(fcsr) |= (ex & FE_INEXACT ? FFLAG_NX : 0) | (ex & FE_UNDERFLOW ? FFLAG_UF : 0) |
+	             (ex & FE_OVERFLOW ? FFLAG_OF : 0) | (ex & FE_DIVBYZERO ? FFLAG_DZ : 0) |
+	             (ex & FE_INVALID ? FFLAG_NV : 0);
+	CSR(mstatus) |= RV32_MSTATUS_FS | RV32_MSTATUS_SD;
+}
+
+// The instruction's rounding mode, frm for dynamic, -1 if reserved.
+static int round_mode(RV32_CPU* state, const RV32_insn* in) {
+	int rm = FUNCT3(in);
+
+	if (rm == 7)
+		rm = (CSR(fcsr) >> 5) & 7;
+	return rm <= 4 ? rm : -1;
+}
+
+// An operation that rounds, into an FP register.
+static uint32_t rounded(RV32_CPU* state, const RV32_insn* in, int op) {
+	int rm = round_mode(state, in), rd = (in->ir >> 7) & 0x1f, rs3 = in->ir >> 27;
+	uint32_t x = REG(in->rs1);
+
+	if (rm < 0)
+		return (2 + 1);
+	if (op >= FP_MADD && op <= FP_NMADD) {
+		// Invalid even when the addend is a quiet NaN, which the host
+		// may not flag.
+		double a = get_d(state, in->rs1), b = get_d(state, in->rs2);
+		if (!(in->ir & (1 << 25)))
+			a = get_s(state, in->rs1), b = get_s(state, in->rs2);
+		if ((isinf(a) && b == 0) || (a == 0 && isinf(b)))
+			CSR(fcsr) |= FFLAG_NV;
+	}
+	if (rm & 3)
+		fesetround(host_rm[rm]);
+	if (in->ir & (1 << 25))
+		set_d(state, rd, calc_d(op, get_d(state, in->rs1), get_d(state, in->rs2),
+		                        get_d(state, rs3), get_s(state, in->rs1), x));
+	else
+		set_s(state, rd, calc_s(op, get_s(state, in->rs1), get_s(state, in->rs2),
+		                        get_s(state, rs3), get_d(state, in->rs1), x));
+	if (rm & 3)
+		fesetround(FE_TONEAREST);
+	CSR(mstatus) |= RV32_MSTATUS_FS | RV32_MSTATUS_SD;
+	return 0;
+}
+
+__attribute__((noipa)) static float calc_s(int op, float a, float b, float c, double wide,
+                                           uint32_t x) {
+	switch (op) {
+	case FP_ADD:
+		return a + b;
+	case FP_SUB:
+		return a - b;
+	case FP_MUL:
+		return a * b;
+	case FP_DIV:
+		return a / b;
+	case FP_SQRT:
+		return sqrtf(a);
+	case FP_MADD:
+		return fmaf(a, b, c);
+	case FP_MSUB:
+		return fmaf(a, b, -c);
+	case FP_NMSUB:
+		return fmaf(-a, b, c);
+	case FP_NMADD:
+		return fmaf(-a, b, -c);
+	case FP_CVT:
+		return wide;
+	case FP_CVT_W:
+		return (int32_t)x;
+	default:
+		return x;
+	}
+}
+
+__attribute__((noipa)) static double calc_d(int op, double a, double b, double c, float narrow,
+                                            uint32_t x) {
+	switch (op) {
+	case FP_ADD:
+		return a + b;
+	case FP_SUB:
+		return a - b;
+	case FP_MUL:
+		return a * b;
+	case FP_DIV:
+		return a / b;
+	case FP_SQRT:
+		return sqrt(a);
+	case FP_MADD:
+		return fma(a, b, c);
+	case FP_MSUB:
+		return fma(a, b, -c);
+	case FP_NMSUB:
+		return fma(-a, b, c);
+	case FP_NMADD:
+		return fma(-a, b, -c);
+	case FP_CVT:
+		return narrow;
+	case FP_CVT_W:
+		return (int32_t)x;
+	default:
+		return x;
+	}
+}
+
+// FCVT.W(U): rounded in rm, saturating (NaN counts as too big) and
+// flagging invalid when out of range.
+static uint32_t to_int(double v, int rm, int is_unsigned, uint32_t* flags) {
+	double lo = is_unsigned ? 0.0 : -2147483648.0, hi = is_unsigned ? 4294967295.0 : 2147483647.0;
+	double r;
+
+	if (isnan(v)) {
+		*flags |= FFLAG_NV;
+		return is_unsigned ? UINT32_MAX : INT32_MAX;
+	}
+	switch (rm) {
+	case 0:
+		r = nearbyint(v); // The host is in round to nearest even here.
+		break;
+	case 1:
+		r = trunc(v);
+		break;
+	case 2:
+		r = floor(v);
+		break;
+	case 3:
+		r = ceil(v);
+		break;
+	default:
+		r = round(v);
+		break;
+	}
+	if (r < lo || r > hi) {
+		*flags |= FFLAG_NV;
+		return r < lo ? (is_unsigned ? 0 : (uint32_t)INT32_MIN)
+		              : (is_unsigned ? UINT32_MAX : INT32_MAX);
+	}
+	if (r != v)
+		*flags |= FFLAG_NX;
+	return is_unsigned ? (uint32_t)r : (uint32_t)(int32_t)r;
+}
+
+// The value of an FP register as a double, exact for a single. *nan is 1
+// for a quiet NaN and 2 for a signalling one, which is left unconverted:
+// that would raise invalid on the host.
+static double operand(RV32_CPU* state, int r, int d, int* nan) {
+	uint64_t bits = d ? FREG(r) : bits_s(state, r);
+	uint64_t exp = d ? 0x7ff0000000000000ull : 0x7f800000;
+	uint64_t mant = d ? (1ull << 52) - 1 : (1u << 23) - 1, quiet = d ? 1ull << 51 : 1 << 22;
+
+	*nan = 0;
+	if ((bits & exp) == exp && (bits & mant)) {
+		*nan = bits & quiet ? 1 : 2;
+		return 0;
+	}
+	return d ? get_d(state, r) : get_s(state, r);
+}
+
+// FCLASS: one bit, from -inf (0) to quiet NaN (9).
+static uint32_t classify(uint64_t bits, int d) {
+	int sign = d ? bits >> 63 : (bits >> 31) & 1;
+	uint64_t exp = d ? (bits >> 52) & 0x7ff : (bits >> 23) & 0xff;
+	uint64_t mant = d ? bits & ((1ull << 52) - 1) : bits & ((1u << 23) - 1);
+
+	if (exp == (d ? 0x7ffu : 0xffu)) {
+		if (mant)
+			return mant >> (d ? 51 : 22) ? 1 << 9 : 1 << 8;
+		return sign ? 1 << 0 : 1 << 7;
+	}
+	if (!exp)
+		return mant ? (sign ? 1 << 2 : 1 << 5) : (sign ? 1 << 3 : 1 << 4);
+	return sign ? 1 << 1 : 1 << 6;
+}
@@ -0,0 +1,966 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "riscv-emu.h"
+
+/*
+ * Dynamic translation of RV32I basic blocks to x86-64.
+ *
+ * Guest registers stay in RV32_CPU::regs; generated code runs with
+ *   rbx = RV32_CPU*, r12 = guest RAM, r13 = RV32_jit*,
+ *   r14 = instruction budget left, r15 = where to store the budget on exit.
+ * Anything a block cannot do itself (CSRs, system, AMO, MMIO, faults) makes
+ * it leave with EXIT_FALLBACK and the pc of that instruction, which the
+ * dispatcher then runs through RV32_run.
+ */
+
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+#define JIT_BLOCK_MAX 64
+#define JIT_MAP_BITS 16
+#define JIT_BLOCKS (1 << 16)
+#define JIT_PAGE_BITS 10
+/* Worst case for one block: every instruction plus its cold stubs. */
+#define JIT_BLOCK_ROOM (JIT_BLOCK_MAX * 128 + 256)
+
+enum {
+	EXIT_BUDGET,   // Budget too short for the block, or an interrupt was posted.
+	EXIT_LINK,     // Unlinked direct jump, site in link_site.
+	EXIT_NEXT,     // Indirect jump, look the pc up.
+	EXIT_FALLBACK, // Interpret the instruction at pc.
+	EXIT_SMC,      // A store overwrote the block it was in.
+};
+
+typedef struct jit_block {
+	uint32_t start, end; // RAM offsets; start is ~0 once dropped.
+	uint8_t* entry;
+	struct jit_block* page_next;
+} jit_block;
+
+typedef uint32_t (*jit_enter_fn)(RV32_CPU* state, const void* code, int64_t* budget,
+                                 struct RV32_jit* jit);
+
+typedef struct RV32_jit {
+	uint8_t* code;
+	size_t used, reset; // reset: start of the flushable area.
+	uint32_t gen;
+	jit_enter_fn enter;
+	const uint8_t* exit;
+	uint8_t* link_site;
+	struct {
+		uint32_t start;
+		const uint8_t* entry;
+	} map[1 << JIT_MAP_BITS];
+	// Every translation, also listed by the 4KiB page it starts on, so a
+	// store can drop just the ones it overwrites.
+	jit_block blocks[JIT_BLOCKS];
+	jit_block* pages[1 << JIT_PAGE_BITS];
+	uint32_t nblocks;
+
+	// Lockstep checking.
+	int lockstep;
+	RV32_CPU* state;
+	uint32_t nlog;
+	struct {
+		uint32_t ofs, old, new;
+	} log[JIT_BLOCK_MAX];
+} RV32_jit;
+
+// Host LZCNT, TZCNT (BMI1) and POPCNT, from cpuid in RV32_jit_init.
+static int has_lzcnt, has_tzcnt, has_popcnt;
+
+#define OFS_PC (offsetof(RV32_CPU, csr) + 4 * csr_pc)
+#define OFS_REG(r) (offsetof(RV32_CPU, regs) + 4 * (r))
+#define OFS_CODE_MAP offsetof(RV32_CPU, code_map)
+
+typedef struct emitter {
+	uint8_t* p;
+} emitter;
+
+static void emit8(emitter* e, uint8_t b) { *e->p++ = b; }
+
+static void emit32(emitter* e, uint32_t v) {
+	memcpy(e->p, &v, 4);
+	e->p += 4;
+}
+
+static void emit64(emitter* e, uint64_t v) {
+	memcpy(e->p, &v, 8);
+	e->p += 8;
+}
+
+static void emitn(emitter* e, const char* bytes, int n) {
+	memcpy(e->p, bytes, n);
+	e->p += n;
+}
+
+// op r32, [rbx + disp] with the register in ModRM.reg.
+static void emit_rbx(emitter* e, uint8_t opcode, int reg, uint32_t disp) {
+	emit8(e, opcode);
+	if (disp < 0x80) {
+		emit8(e, 0x43 | (reg << 3));
+		emit8(e, disp);
+	} else {
+		emit8(e, 0x83 | (reg << 3));
+		emit32(e, disp);
+	}
+}
+
+enum { EAX, ECX, EDX };
+
+static void load_reg(emitter* e, int hreg, int greg) {
+	if (greg)
+		emit_rbx(e, 0x8b, hreg, OFS_REG(greg)); // mov hreg, [rbx + regs]
+	else
+		emit8(e, 0x31), emit8(e, 0xc0 | (hreg << 3) | hreg); // xor hreg, hreg
+}
+
+static void store_reg(emitter* e, int hreg, int greg) {
+	emit_rbx(e, 0x89, hreg, OFS_REG(greg)); // mov [rbx + regs], hreg
+}
+
+#ifdef RV32_STATS
+// inc (reg 0) or dec (reg 1) qword [rbx + stats.opcodes[major]]: blocks count
+// what they run themselves, and take it back on a fallback to the interpreter.
+static void emit_stat_op(emitter* e, const RV32_insn* in, int reg) {
+	emit8(e, 0x48); // REX.W
+	emit_rbx(e, 0xff, reg, offsetof(RV32_CPU, stats.opcodes) + 8 * ((in->ir >> 2) & 31));
+}
+#endif
+
+static void store_imm(emitter* e, uint32_t disp, uint32_t imm) {
+	emit_rbx(e, 0xc7, 0, disp); // mov dword [rbx + disp], imm32
+	emit32(e, imm);
+}
+
+// jcc/jmp rel32 to be patched later; returns the rel32 field.
+static uint8_t* emit_jcc(emitter* e, uint8_t cc) {
+	uint8_t* site;
+	if (cc)
+		emit8(e, 0x0f), emit8(e, cc);
+	else
+		emit8(e, 0xe9);
+	site = e->p;
+	emit32(e, 0);
+	return site;
+}
+
+static void patch(uint8_t* site, const uint8_t* target) {
+	int32_t rel = target - (site + 4);
+	memcpy(site, &rel, 4);
+}
+
+static void emit_exit(emitter* e, RV32_jit* jit, uint32_t reason) {
+	emit8(e, 0xb8); // mov eax, reason
+	emit32(e, reason);
+	patch(emit_jcc(e, 0), jit->exit);
+}
+
+// Leave the block at guest pc with the given budget refund.
+static void emit_leave(emitter* e, RV32_jit* jit, uint32_t pc, uint32_t refund, uint32_t reason) {
+	store_imm(e, OFS_PC, pc);
+	if (refund) {
+		emitn(e, "\x49\x81\xc6", 3); // add r14, refund
+		emit32(e, refund);
+	}
+	emit_exit(e, jit, reason);
+}
+
+// Direct jump to another block. It goes through a stub that asks the
+// dispatcher to link it until the target has been translated.
+static void emit_chain(emitter* e, RV32_jit* jit, uint32_t pc, uint8_t** stub_site) {
+	store_imm(e, OFS_PC, pc);
+	*stub_site = emit_jcc(e, 0);
+}
+
+static void emit_link_stub(emitter* e, RV32_jit* jit, uint8_t* site) {
+	patch(site, e->p);
+	emitn(e, "\x48\xb8", 2); // mov rax, site
+	emit64(e, (uintptr_t)site);
+	emitn(e, "\x49\x89\x85", 3); // mov [r13 + link_site], rax
+	emit32(e, offsetof(RV32_jit, link_site));
+	emit_exit(e, jit, EXIT_LINK);
+}
+
+// A store hit a page with translated code. Did it overwrite block b?
+static int jit_smc(RV32_CPU* state, uint32_t ofs, uint32_t len, const jit_block* b) {
+	RV32_invalidate_code(state, ofs, len);
+	return b->start == ~0u;
+}
+
+static void jit_log_store(RV32_jit* jit, uint32_t ofs) {
+	memcpy(&jit->log[jit->nlog].old, jit->state->mem + ofs, 4);
+	jit->log[jit->nlog++].ofs = ofs;
+}
+
+// Is this something the translator handles, and does it end the block?
+static int jit_supported(const RV32_insn* in, int* ends) {
+	*ends = 0;
+	switch (in->op) {
+	case rv32_op_lui:
+	case rv32_op_auipc:
+		return 1;
+	case rv32_op_jal:
+	case rv32_op_jalr:
+		*ends = 1;
+		return 1;
+	case rv32_op_branch:
+		// A reserved funct3 must not end the block, or nothing leaves it.
+		if (((in->ir >> 12) & 7) == 2 || ((in->ir >> 12) & 7) == 3)
+			return 0;
+		*ends = 1;
+		return 1;
+	case rv32_op_load:
+		return in->rd && ((in->ir >> 12) & 7) != 3 && ((in->ir >> 12) & 7) < 6;
+	case rv32_op_store:
+		return ((in->ir >> 12) & 7) < 3;
+	case rv32_op_arithmetic:
+		return 1;
+	case rv32_op_bitmanip:
+		// CLZ, CTZ and CPOP need the host instruction; without LZCNT the
+		// same bytes are BSR, which counts the other way.
+		if ((in->ir & 0xfe00707f) == 0x60001013) {
+			switch ((in->ir >> 20) & 0x1f) {
+			case 0:
+				return has_lzcnt;
+			case 1:
+				return has_tzcnt;
+			case 2:
+				return has_popcnt;
+			}
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// RV32M, eax = rs1 and ecx = rs2 in, result in eax. The high multiplies
+// and signed divides widen to 64 bits, where INT32_MIN / -1 cannot trap;
+// only a zero divisor needs its own path.
+static void emit_muldiv(emitter* e, int funct3) {
+	uint8_t *zero, *done;
+
+	switch (funct3) {
+	case 0b000:
+		emitn(e, "\x0f\xaf\xc1", 3); // imul eax, ecx
+		return;
+	case 0b001:
+		emitn(e, "\x48\x63\xc0\x48\x63\xc9", 6); // movsxd rax, eax; movsxd rcx, ecx
+		break;
+	case 0b010:
+		emitn(e, "\x48\x63\xc0\x89\xc9", 5); // movsxd rax, eax; mov ecx, ecx
+		break;
+	case 0b011:
+		emitn(e, "\x89\xc0\x89\xc9", 4); // mov eax, eax; mov ecx, ecx
+		break;
+	default:
+		emitn(e, "\x85\xc9", 2); // test ecx, ecx
+		zero = emit_jcc(e, 0x84);  // jz
+		if (funct3 & 1)
+			emitn(e, "\x31\xd2\xf7\xf1", 4); // xor edx, edx; div ecx
+		else
+			emitn(e, "\x48\x63\xc0\x48\x63\xc9\x48\x99\x48\xf7\xf9",
+			      11); // movsxd rax, eax; movsxd rcx, ecx; cqo; idiv rcx
+		if (funct3 & 2)
+			emitn(e, "\x89\xd0", 2); // mov eax, edx
+		done = emit_jcc(e, 0);
+		patch(zero, e->p);
+		if (!(funct3 & 2))
+			emitn(e, "\xb8\xff\xff\xff\xff", 5); // mov eax, -1 (REM keeps rs1)
+		patch(done, e->p);
+		return;
+	}
+	emitn(e, "\x48\x0f\xaf\xc1\x48\xc1\xe8\x20", 8); // imul rax, rcx; shr rax, 32
+}
+
+static void emit_arithmetic(emitter* e, const RV32_insn* in) {
+	int funct3 = (in->ir >> 12) & 7;
+	int is_reg = !!(in->ir & 0b100000);
+	int alt = !!(in->ir & 0x40000000);
+
+	if (!in->rd)
+		return;
+	load_reg(e, EAX, in->rs1);
+	if (is_reg && (in->ir & 0x02000000)) {
+		load_reg(e, ECX, in->rs2);
+		emit_muldiv(e, funct3);
+	} else if (is_reg) {
+		load_reg(e, ECX, in->rs2);
+		switch (funct3) {
+		case 0b000:
+			emitn(e, alt ? "\x29\xc8" : "\x01\xc8", 2); // sub/add eax, ecx
+			break;
+		case 0b001:
+			emitn(e, "\xd3\xe0", 2); // shl eax, cl
+			break;
+		case 0b010:
+			emitn(e, "\x39\xc8\x0f\x9c\xc0\x0f\xb6\xc0", 8); // cmp; setl; movzx
+			break;
+		case 0b011:
+			emitn(e, "\x39\xc8\x0f\x92\xc0\x0f\xb6\xc0", 8); // cmp; setb; movzx
+			break;
+		case 0b100:
+			emitn(e, "\x31\xc8", 2); // xor eax, ecx
+			break;
+		case 0b101:
+			emitn(e, alt ? "\xd3\xf8" : "\xd3\xe8", 2); // sar/shr eax, cl
+			break;
+		case 0b110:
+			emitn(e, "\x09\xc8", 2); // or eax, ecx
+			break;
+		case 0b111:
+			emitn(e, "\x21\xc8", 2); // and eax, ecx
+			break;
+		}
+	} else {
+		switch (funct3) {
+		case 0b000:
+			emit8(e, 0x05); // add eax, imm32
+			emit32(e, in->imm);
+			break;
+		case 0b001:
+			emitn(e, "\xc1\xe0", 2); // shl eax, imm8
+			emit8(e, in->imm & 0x1f);
+			break;
+		case 0b010:
+			emit8(e, 0x3d); // cmp eax, imm32
+			emit32(e, in->imm);
+			emitn(e, "\x0f\x9c\xc0\x0f\xb6\xc0", 6); // setl; movzx
+			break;
+		case 0b011:
+			emit8(e, 0x3d);
+			emit32(e, in->imm);
+			emitn(e, "\x0f\x92\xc0\x0f\xb6\xc0", 6); // setb; movzx
+			break;
+		case 0b100:
+			emit8(e, 0x35); // xor eax, imm32
+			emit32(e, in->imm);
+			break;
+		case 0b101:
+			emitn(e, alt ? "\xc1\xf8" : "\xc1\xe8", 2); // sar/shr eax, imm8
+			emit8(e, in->imm & 0x1f);
+			break;
+		case 0b110:
+			emit8(e, 0x0d); // or eax, imm32
+			emit32(e, in->imm);
+			break;
+		case 0b111:
+			emit8(e, 0x25); // and eax, imm32
+			emit32(e, in->imm);
+			break;
+		}
+	}
+	store_reg(e, EAX, in->rd);
+}
+
+// Zba, Zbb and Zbs as decode_ir accepted them, eax = rs1 and ecx = rs2
+// in, result in eax. Every one is an instruction or two on the host.
+static void emit_bitmanip(emitter* e, const RV32_insn* in) {
+	int funct3 = (in->ir >> 12) & 7;
+	int funct7 = in->ir >> 25;
+
+	if (!in->rd)
+		return;
+	load_reg(e, EAX, in->rs1);
+	if (in->ir & 0b100000) {
+		load_reg(e, ECX, in->rs2);
+		switch (funct7 << 3 | funct3) {
+		case 0x10 << 3 | 0b010:
+			emitn(e, "\x8d\x04\x41", 3); // lea eax, [rcx + rax * 2]
+			break;
+		case 0x10 << 3 | 0b100:
+			emitn(e, "\x8d\x04\x81", 3); // lea eax, [rcx + rax * 4]
+			break;
+		case 0x10 << 3 | 0b110:
+			emitn(e, "\x8d\x04\xc1", 3); // lea eax, [rcx + rax * 8]
+			break;
+		case 0x20 << 3 | 0b111:
+			emitn(e, "\xf7\xd1\x21\xc8", 4); // not ecx; and eax, ecx
+			break;
+		case 0x20 << 3 | 0b110:
+			emitn(e, "\xf7\xd1\x09\xc8", 4); // not ecx; or eax, ecx
+			break;
+		case 0x20 << 3 | 0b100:
+			emitn(e, "\x31\xc8\xf7\xd0", 4); // xor eax, ecx; not eax
+			break;
+		case 0x05 << 3 | 0b100:
+			emitn(e, "\x39\xc8\x0f\x4f\xc1", 5); // cmp eax, ecx; cmovg eax, ecx
+			break;
+		case 0x05 << 3 | 0b101:
+			emitn(e, "\x39\xc8\x0f\x47\xc1", 5); // cmp; cmova
+			break;
+		case 0x05 << 3 | 0b110:
+			emitn(e, "\x39\xc8\x0f\x4c\xc1", 5); // cmp; cmovl
+			break;
+		case 0x05 << 3 | 0b111:
+			emitn(e, "\x39\xc8\x0f\x42\xc1", 5); // cmp; cmovb
+			break;
+		case 0x04 << 3 | 0b100:
+			emitn(e, "\x0f\xb7\xc0", 3); // movzx eax, ax
+			break;
+		case 0x30 << 3 | 0b001:
+			emitn(e, "\xd3\xc0", 2); // rol eax, cl
+			break;
+		case 0x30 << 3 | 0b101:
+			emitn(e, "\xd3\xc8", 2); // ror eax, cl
+			break;
+		case 0x24 << 3 | 0b001:
+			emitn(e, "\x0f\xb3\xc8", 3); // btr eax, ecx
+			break;
+		case 0x24 << 3 | 0b101:
+			emitn(e, "\x0f\xa3\xc8\x0f\x92\xc0\x0f\xb6\xc0", 9); // bt; setc; movzx
+			break;
+		case 0x34 << 3 | 0b001:
+			emitn(e, "\x0f\xbb\xc8", 3); // btc eax, ecx
+			break;
+		case 0x14 << 3 | 0b001:
+			emitn(e, "\x0f\xab\xc8", 3); // bts eax, ecx
+			break;
+		}
+	} else {
+		switch (funct7 << 3 | funct3) {
+		case 0x30 << 3 | 0b001:
+			switch ((in->ir >> 20) & 0x1f) {
+			case 0:
+				emitn(e, "\xf3\x0f\xbd\xc0", 4); // lzcnt eax, eax
+				break;
+			case 1:
+				emitn(e, "\xf3\x0f\xbc\xc0", 4); // tzcnt eax, eax
+				break;
+			case 2:
+				emitn(e, "\xf3\x0f\xb8\xc0", 4); // popcnt eax, eax
+				break;
+			case 4:
+				emitn(e, "\x0f\xbe\xc0", 3); // movsx eax, al
+				break;
+			case 5:
+				emitn(e, "\x0f\xbf\xc0", 3); // movsx eax, ax
+				break;
+			}
+			break;
+		case 0x30 << 3 | 0b101:
+			emitn(e, "\xc1\xc8", 2); // ror eax, imm8
+			emit8(e, in->imm & 0x1f);
+			break;
+		case 0x24 << 3 | 0b001:
+			emitn(e, "\x0f\xba\xf0", 3); // btr eax, imm8
+			emit8(e, in->imm & 0x1f);
+			break;
+		case 0x24 << 3 | 0b101:
+			emitn(e, "\x0f\xba\xe0", 3); // bt eax, imm8
+			emit8(e, in->imm & 0x1f);
+			emitn(e, "\x0f\x92\xc0\x0f\xb6\xc0", 6); // setc; movzx
+			break;
+		case 0x34 << 3 | 0b001:
+			emitn(e, "\x0f\xba\xf8", 3); // btc eax, imm8
+			emit8(e, in->imm & 0x1f);
+			break;
+		case 0x14 << 3 | 0b001:
+			emitn(e, "\x0f\xba\xe8", 3); // bts eax, imm8
+			emit8(e, in->imm & 0x1f);
+			break;
+		case 0x14 << 3 | 0b101:
+			// ORC.B: the high bit of each byte says whether it is nonzero,
+			// then times 0xff fills the byte.
+			emitn(e, "\x89\xc1\x81\xe1", 4); // mov ecx, eax; and ecx, imm32
+			emit32(e, 0x7f7f7f7f);
+			emitn(e, "\x81\xc1", 2); // add ecx, imm32
+			emit32(e, 0x7f7f7f7f);
+			emitn(e, "\x09\xc1\x81\xe1", 4); // or ecx, eax; and ecx, imm32
+			emit32(e, 0x80808080);
+			emitn(e, "\xc1\xe9\x07\x69\xc1", 5); // shr ecx, 7; imul eax, ecx, imm32
+			emit32(e, 0xff);
+			break;
+		case 0x34 << 3 | 0b101:
+			emitn(e, "\x0f\xc8", 2); // bswap eax
+			break;
+		}
+	}
+	store_reg(e, EAX, in->rd);
+}
+
+// eax = RAM offset of the access; jump to the fallback stub unless it is
+// inside RAM (and aligned, for stores, so it cannot straddle two pages).
+static void emit_address(emitter* e, RV32_CPU* state, const RV32_insn* in, int align,
+                         uint8_t** slow) {
+	load_reg(e, EAX, in->rs1);
+	emit8(e, 0x05); // add eax, imm - base_ofs
+	emit32(e, in->imm - state->base_ofs);
+	emit8(e, 0x3d); // cmp eax, total_mem - 3
+	emit32(e, state->total_mem - 3);
+	slow[0] = emit_jcc(e, 0x83); // jae
+	if (align > 1) {
+		emit8(e, 0xa8); // test al, align - 1
+		emit8(e, align - 1);
+		slow[1] = emit_jcc(e, 0x85); // jnz
+	}
+}
+
+static void emit_load(emitter* e, RV32_CPU* state, const RV32_insn* in, uint8_t** slow) {
+	static const char* const ops[8] = {
+		"\x41\x0f\xbe\x0c\x04", // movsx ecx, byte [r12 + rax]
+		"\x41\x0f\xbf\x0c\x04", // movsx ecx, word [r12 + rax]
+		"\x41\x8b\x0c\x04\x90", // mov ecx, [r12 + rax]; nop
+		NULL,
+		"\x41\x0f\xb6\x0c\x04", // movzx ecx, byte [r12 + rax]
+		"\x41\x0f\xb7\x0c\x04", // movzx ecx, word [r12 + rax]
+	};
+	emit_address(e, state, in, 1, slow);
+	emitn(e, ops[(in->ir >> 12) & 7], 5);
+	store_reg(e, ECX, in->rd);
+}
+
+static void emit_store(emitter* e, RV32_jit* jit, RV32_CPU* state, const RV32_insn* in,
+                       uint8_t** slow, uint8_t** smc) {
+	int funct3 = (in->ir >> 12) & 7;
+
+	emit_address(e, state, in, 1 << funct3, slow);
+	if (jit->lockstep) {
+		emitn(e, "\x89\xc5", 2);         // mov ebp, eax
+		emitn(e, "\x4c\x89\xef", 3);     // mov rdi, r13
+		emitn(e, "\x89\xc6", 2);         // mov esi, eax
+		emitn(e, "\x48\xb8", 2);         // mov rax, jit_log_store
+		emit64(e, (uintptr_t)jit_log_store);
+		emitn(e, "\xff\xd0", 2);         // call rax
+		emitn(e, "\x89\xe8", 2);         // mov eax, ebp
+	}
+	load_reg(e, ECX, in->rs2);
+	if (funct3 == 0)
+		emitn(e, "\x41\x88\x0c\x04", 4); // mov [r12 + rax], cl
+	else if (funct3 == 1)
+		emitn(e, "\x66\x41\x89\x0c\x04", 5); // mov [r12 + rax], cx
+	else
+		emitn(e, "\x41\x89\x0c\x04", 4); // mov [r12 + rax], ecx
+	// Self-modifying code: test the page's bit in code_map, keeping the
+	// address in eax for the cold path.
+	emitn(e, "\x89\xc2\xc1\xea\x11", 5); // mov edx, eax; shr edx, 17
+	emitn(e, "\x8b\x94\x93", 3);         // mov edx, [rbx + rdx * 4 + code_map]
+	emit32(e, OFS_CODE_MAP);
+	emitn(e, "\x89\xc1\xc1\xe9\x0c", 5); // mov ecx, eax; shr ecx, 12
+	emitn(e, "\x0f\xa3\xca", 3);         // bt edx, ecx
+	*smc = emit_jcc(e, 0x82);             // jc
+}
+
+// Cold path of a store into a code page: drop what it overwrote, then go
+// back to site unless that included this block.
+static void emit_smc(emitter* e, const RV32_insn* in, const jit_block* b, uint8_t* site) {
+	emitn(e, "\x48\x89\xdf", 3); // mov rdi, rbx
+	emitn(e, "\x89\xc6", 2);     // mov esi, eax
+	emit8(e, 0xba);              // mov edx, len
+	emit32(e, 1 << ((in->ir >> 12) & 7));
+	emitn(e, "\x48\xb9", 2); // mov rcx, b
+	emit64(e, (uintptr_t)b);
+	emitn(e, "\x48\xb8", 2); // mov rax, jit_smc
+	emit64(e, (uintptr_t)jit_smc);
+	emitn(e, "\xff\xd0", 2); // call rax
+	emitn(e, "\x85\xc0", 2); // test eax, eax
+	patch(emit_jcc(e, 0x84), site + 4); // jz back
+}
+
+static const uint8_t* translate(RV32_CPU* state, RV32_jit* jit, uint32_t ofs) {
+	RV32_insn ins[JIT_BLOCK_MAX];
+	uint8_t* slow[JIT_BLOCK_MAX][2];
+	uint8_t* smc[JIT_BLOCK_MAX];
+	uint8_t* links[2] = {NULL, NULL};
+	uint8_t *budget, *posted, *entry;
+	jit_block* b;
+	emitter e;
+	uint32_t at = ofs; // End of the block so far.
+	int n, i, ends = 0;
+
+	if (jit->used + JIT_BLOCK_ROOM > JIT_CODE_SIZE || jit->nblocks == JIT_BLOCKS)
+		RV32_flush_code(state);
+	b = &jit->blocks[jit->nblocks++];
+
+	// Find the block: everything up to a jump, branch, or an instruction
+	// that has to be interpreted.
+	for (n = 0; n < JIT_BLOCK_MAX && !ends; n++) {
+		if (at > state->total_mem - 4)
+			break;
+		RV32_decode(state, &ins[n], at);
+		if (!jit_supported(&ins[n], &ends))
+			break;
+		at += RV32_INSN_LEN(&ins[n]);
+	}
+
+	e.p = jit->code + jit->used;
+	entry = e.p;
+	memset(slow, 0, sizeof(slow));
+	memset(smc, 0, sizeof(smc));
+
+	emitn(&e, "\x49\x81\xfe", 3); // cmp r14, n
+	emit32(&e, n);
+	budget = emit_jcc(&e, 0x8c); // jl
+	emit_rbx(&e, 0x83, 7, offsetof(RV32_CPU, posted)); // cmp dword [rbx + posted], 0
+	emit8(&e, 0);
+	posted = emit_jcc(&e, 0x85); // jne
+	emitn(&e, "\x49\x81\xee", 3); // sub r14, n
+	emit32(&e, n);
+
+	for (i = 0; i < n; i++) {
+		const RV32_insn* in = &ins[i];
+		uint32_t pc = state->base_ofs + in->tag;
+		uint32_t next = pc + RV32_INSN_LEN(in);
+#ifdef RV32_STATS
+		emit_stat_op(&e, in, 0);
+#endif
+		switch (in->op) {
+		case rv32_op_lui:
+			if (in->rd)
+				store_imm(&e, OFS_REG(in->rd), in->imm);
+			break;
+		case rv32_op_auipc:
+			if (in->rd)
+				store_imm(&e, OFS_REG(in->rd), pc + in->imm);
+			break;
+		case rv32_op_jal:
+			if (in->rd)
+				store_imm(&e, OFS_REG(in->rd), next);
+			emit_chain(&e, jit, pc + in->imm, &links[0]);
+			break;
+		case rv32_op_jalr:
+			load_reg(&e, EAX, in->rs1);
+			emit8(&e, 0x05); // add eax, imm
+			emit32(&e, in->imm);
+			emit8(&e, 0x25); // and eax, ~1
+			emit32(&e, ~1u);
+			emit_rbx(&e, 0x89, EAX, OFS_PC);
+			if (in->rd)
+				store_imm(&e, OFS_REG(in->rd), next);
+			emit_exit(&e, jit, EXIT_NEXT);
+			break;
+		case rv32_op_branch: {
+			static const uint8_t cc[8] = {0x84, 0x85, 0, 0, 0x8c, 0x8d, 0x82, 0x83};
+			uint8_t* taken;
+			load_reg(&e, EAX, in->rs1);
+			load_reg(&e, ECX, in->rs2);
+			emitn(&e, "\x39\xc8", 2); // cmp eax, ecx
+			taken = emit_jcc(&e, cc[(in->ir >> 12) & 7]);
+			emit_chain(&e, jit, next, &links[0]);
+			patch(taken, e.p);
+			emit_chain(&e, jit, pc + in->imm, &links[1]);
+			break;
+		}
+		case rv32_op_load:
+			emit_load(&e, state, in, slow[i]);
+			break;
+		case rv32_op_store:
+			emit_store(&e, jit, state, in, slow[i], &smc[i]);
+			break;
+		case rv32_op_arithmetic:
+			emit_arithmetic(&e, in);
+			break;
+		case rv32_op_bitmanip:
+			emit_bitmanip(&e, in);
+			break;
+		}
+	}
+
+	// Fell off the end: either the next instruction has to be
+	// interpreted, or the block just got long.
+	if (!ends) {
+		if (n < JIT_BLOCK_MAX)
+			emit_leave(&e, jit, state->base_ofs + at, 0, EXIT_FALLBACK);
+		else
+			emit_chain(&e, jit, state->base_ofs + at, &links[0]);
+	}
+
+	// Cold paths.
+	patch(budget, e.p);
+	patch(posted, e.p);
+	emit_exit(&e, jit, EXIT_BUDGET);
+	for (i = 0; i < n; i++) {
+		uint32_t pc = state->base_ofs + ins[i].tag;
+		if (slow[i][0]) {
+			patch(slow[i][0], e.p);
+			if (slow[i][1])
+				patch(slow[i][1], e.p);
+#ifdef RV32_STATS
+			emit_stat_op(&e, &ins[i], 1);
+#endif
+			emit_leave(&e, jit, pc, n - i, EXIT_FALLBACK);
+		}
+		if (smc[i]) {
+			patch(smc[i], e.p);
+			emit_smc(&e, &ins[i], b, smc[i]);
+			emit_leave(&e, jit, pc + RV32_INSN_LEN(&ins[i]), n - i - 1, EXIT_SMC);
+		}
+	}
+	for (i = 0; i < 2; i++)
+		if (links[i])
+			emit_link_stub(&e, jit, links[i]);
+
+	jit->used = e.p - jit->code;
+	b->start = ofs;
+	b->end = at;
+	b->entry = entry;
+	b->page_next = jit->pages[(ofs >> 12) & ((1 << JIT_PAGE_BITS) - 1)];
+	jit->pages[(ofs >> 12) & ((1 << JIT_PAGE_BITS) - 1)] = b;
+	jit->map[(ofs >> 1) & ((1 << JIT_MAP_BITS) - 1)].start = ofs;
+	jit->map[(ofs >> 1) & ((1 << JIT_MAP_BITS) - 1)].entry = entry;
+	return entry;
+}
+
+static const uint8_t* lookup(RV32_CPU* state, RV32_jit* jit, uint32_t ofs) {
+	uint32_t slot = (ofs >> 1) & ((1 << JIT_MAP_BITS) - 1);
+	if (jit->map[slot].entry && jit->map[slot].start == ofs)
+		return jit->map[slot].entry;
+	return translate(state, jit, ofs);
+}
+
+int RV32_jit_init(RV32_CPU* state, int lockstep) {
+#if defined(__x86_64__)
+	static const char enter[] =
+		"\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57" // push rbx, rbp, r12-r15
+		"\x48\x83\xec\x08"                         // sub rsp, 8
+		"\x48\x89\xfb"                             // mov rbx, rdi
+		"\x4c\x8b\xa7";                            // mov r12, [rdi + mem]
+	static const char enter2[] =
+		"\x49\x89\xcd"  // mov r13, rcx
+		"\x49\x89\xd7"  // mov r15, rdx
+		"\x4c\x8b\x32"  // mov r14, [rdx]
+		"\xff\xe6";     // jmp rsi
+	static const char leave[] =
+		"\x4d\x89\x37"                             // mov [r15], r14
+		"\x48\x83\xc4\x08"                         // add rsp, 8
+		"\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b" // pop r15-r12, rbp, rbx
+		"\xc3";                                    // ret
+	RV32_jit* jit = calloc(1, sizeof(RV32_jit));
+	unsigned int a, b, c, d;
+	emitter e;
+
+	if (!jit)
+		return -1;
+	if (__get_cpuid(1, &a, &b, &c, &d))
+		has_popcnt = !!(c & bit_POPCNT);
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		has_tzcnt = !!(b & bit_BMI);
+	if (__get_cpuid(0x80000001, &a, &b, &c, &d))
+		has_lzcnt = !!(c & bit_LZCNT);
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		free(jit);
+		return -1;
+	}
+	e.p = jit->code;
+	memcpy(&jit->enter, &e.p, sizeof(jit->enter)); // ISO C has no object to function cast.
+	emitn(&e, enter, sizeof(enter) - 1);
+	emit32(&e, offsetof(RV32_CPU, mem));
+	emitn(&e, enter2, sizeof(enter2) - 1);
+	jit->exit = e.p;
+	emitn(&e, leave, sizeof(leave) - 1);
+	jit->used = jit->reset = e.p - jit->code;
+	jit->lockstep = lockstep;
+	jit->state = state;
+	state->jit = jit;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void RV32_jit_flush(RV32_CPU* state) {
+	RV32_jit* jit = state->jit;
+	memset(jit->map, 0, sizeof(jit->map));
+	memset(jit->pages, 0, sizeof(jit->pages));
+	jit->nblocks = 0;
+	jit->used = jit->reset;
+	jit->gen++;
+}
+
+// Drop the translations overlapping [ofs, ofs + len). Direct jumps already
+// linked to one keep going there, so its entry now leaves for the
+// dispatcher, which looks the pc up again.
+void RV32_jit_invalidate(RV32_CPU* state, uint32_t ofs, uint32_t len) {
+	RV32_jit* jit = state->jit;
+	uint32_t first = ofs > 4 * JIT_BLOCK_MAX ? ofs - 4 * JIT_BLOCK_MAX : 0;
+	emitter e;
+
+	for (uint32_t page = first >> 12; page <= (ofs + len - 1) >> 12; page++) {
+		jit_block** link = &jit->pages[page & ((1 << JIT_PAGE_BITS) - 1)];
+		while (*link) {
+			jit_block* b = *link;
+			uint32_t slot = (b->start >> 1) & ((1 << JIT_MAP_BITS) - 1);
+			if (b->start >= ofs + len || b->end <= ofs) {
+				link = &b->page_next;
+				continue;
+			}
+			if (jit->map[slot].entry == b->entry)
+				jit->map[slot].entry = NULL;
+			e.p = b->entry;
+			emit_exit(&e, jit, EXIT_NEXT);
+			b->start = ~0u;
+			*link = b->page_next;
+		}
+	}
+}
+
+void RV32_jit_free(RV32_CPU* state) {
+	RV32_jit* jit = state->jit;
+
+	if (!jit)
+		return;
+	munmap(jit->code, JIT_CODE_SIZE);
+	free(jit);
+	state->jit = NULL;
+}
+
+static void add_cycles(RV32_CPU* state, uint64_t n) {
+	uint64_t cycle = state->csr[csr_cyclel] | ((uint64_t)state->csr[csr_cycleh] << 32);
+	cycle += n;
+	state->csr[csr_cyclel] = cycle & UINT32_MAX;
+	state->csr[csr_cycleh] = cycle >> 32;
+}
+
+// Run one block under the JIT, then undo it and run the same instructions
+// through the interpreter. The interpreter's result is the one kept.
+static uint32_t run_lockstep(RV32_CPU* state, RV32_jit* jit, const uint8_t* entry,
+                             int64_t* left) {
+	uint32_t regs[32], csr[RV32_CSR_COUNT], jregs[32], jpc, reason, mie, i;
+	int64_t budget = *left;
+	uint32_t pc = state->csr[csr_pc];
+
+	memcpy(regs, state->regs, sizeof(regs));
+	memcpy(csr, state->csr, sizeof(csr));
+#ifdef RV32_STATS
+	RV32_stats stats = state->stats; // The replay counts the block again.
+#endif
+	jit->nlog = 0;
+	reason = jit->enter(state, entry, &budget, jit);
+	budget = *left - budget;
+	if (!budget)
+		return reason;
+
+	memcpy(jregs, state->regs, sizeof(jregs));
+	jpc = state->csr[csr_pc];
+	for (i = 0; i < jit->nlog; i++)
+		memcpy(&jit->log[i].new, state->mem + jit->log[i].ofs, 4);
+	for (i = jit->nlog; i-- > 0;)
+		memcpy(state->mem + jit->log[i].ofs, &jit->log[i].old, 4);
+	memcpy(state->regs, regs, sizeof(regs));
+	memcpy(state->csr, csr, sizeof(csr));
+#ifdef RV32_STATS
+	memcpy(state->stats.opcodes, stats.opcodes, sizeof(stats.opcodes));
+#endif
+
+	// The JIT only takes interrupts between blocks.
+	mie = state->csr[csr_mie];
+	state->csr[csr_mie] = 0;
+	RV32_run(state, budget);
+	state->csr[csr_mie] = mie;
+	*left -= budget;
+
+	if (memcmp(jregs, state->regs, sizeof(jregs)) || jpc != state->csr[csr_pc])
+		goto mismatch;
+	for (i = 0; i < jit->nlog; i++)
+		if (memcmp(&jit->log[i].new, state->mem + jit->log[i].ofs, 4))
+			goto mismatch;
+	return reason;
+
+mismatch:
+	fprintf(stderr, "JIT lockstep mismatch in block at %08x (%d instructions)\n", pc,
+	        (int)budget);
+	fprintf(stderr, "  pc jit %08x interp %08x\n", jpc, state->csr[csr_pc]);
+	for (i = 0; i < 32; i++)
+		if (jregs[i] != state->regs[i])
+			fprintf(stderr, "  x%d jit %08x interp %08x\n", i, jregs[i], state->regs[i]);
+	for (i = 0; i < jit->nlog; i++)
+		if (memcmp(&jit->log[i].new, state->mem + jit->log[i].ofs, 4))
+			fprintf(stderr, "  mem %08x differs\n", state->base_ofs + jit->log[i].ofs);
+	abort();
+}
+
+static int32_t step_jit(RV32_CPU* state, int count) {
+	RV32_jit* jit = state->jit;
+	int64_t left = count;
+	int32_t ret;
+
+	RV32_update_timer(state);
+
+	// If WFI, don't run processor.
+	if (state->csr[csr_extraflags] & 4)
+		return 1;
+
+	while (left > 0) {
+		uint32_t ofs = state->csr[csr_pc] - state->base_ofs;
+		const uint8_t* entry;
+		uint32_t reason, gen;
+		int64_t budget = left;
+
+		if (__atomic_load_n(&state->posted, __ATOMIC_RELAXED)) {
+			uint32_t what = __atomic_exchange_n(&state->posted, 0, __ATOMIC_ACQUIRE);
+			RV32_update_timer(state);
+			if (what & RV32_POST_TIMER)
+				break;
+		}
+		// Translated code only runs in the interpreter.
+		if (state->mmu)
+			return RV32_run(state, left);
+		// Interrupts, fetch faults: the interpreter knows how.
+		if (RV32_irq_pending(state) || ofs > state->total_mem - 4 || (ofs & 1)) {
+			if ((ret = RV32_run(state, 1)))
+				return ret;
+			left--;
+			goto check_wfi;
+		}
+
+		entry = lookup(state, jit, ofs);
+		if (jit->lockstep) {
+			reason = run_lockstep(state, jit, entry, &left);
+		} else {
+			reason = jit->enter(state, entry, &budget, jit);
+			add_cycles(state, left - budget);
+			left = budget;
+		}
+
+		switch (reason) {
+		case EXIT_BUDGET:
+			// Fewer instructions left than the block holds: interpret
+			// them, so the step ends exactly on its count.
+			if (left > 0 && !__atomic_load_n(&state->posted, __ATOMIC_RELAXED)) {
+				if ((ret = RV32_run(state, left)))
+					return ret;
+				left = 0;
+			}
+			break;
+		case EXIT_LINK:
+			gen = jit->gen;
+			ofs = state->csr[csr_pc] - state->base_ofs;
+			if (ofs > state->total_mem - 4 || (ofs & 1))
+				break;
+			entry = lookup(state, jit, ofs);
+			if (gen == jit->gen && !jit->lockstep)
+				patch(jit->link_site, entry);
+			break;
+		case EXIT_FALLBACK:
+			// Out of budget: leave it for the next step, after the timer
+			// has been sampled, so steps do not keep ending right after
+			// an interpreted instruction (typically a CSR window store).
+			if (left <= 0)
+				break;
+			if ((ret = RV32_run(state, 1)))
+				return ret; // A device wants the host.
+			left--;
+			break;
+		}
+	check_wfi:
+		if (state->csr[csr_extraflags] & 4)
+			break;
+	}
+	return 0;
+}
+
+int32_t RV32_step_jit(RV32_CPU* state, int count) {
+	int32_t ret = step_jit(state, count);
+
+	RV32_fp_fold_flags(state);
+	return ret;
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv-emu.h"
+
+/*
+ * Sampling profiler.
+ *
+ * The host calls RV32_profile_sample every so many guest instructions. A
+ * sample is the privilege mode, the pc, and whatever call chain the frame
+ * pointer gives: ra for a leaf, then the {ra, fp} pairs RISC-V frames save
+ * just below s0. Frames are reduced to the start of their symbol at once,
+ * so the table only grows with distinct call paths, and written out as
+ * folded stacks for flamegraph.pl.
+ *
+ * Code without frame pointers gives short or wrong chains; the leaf, which
+ * is what the samples are counted against, is always right.
+ */
+
+#define PROF_BUCKETS 4096 // Initial table size, a power of two.
+
+typedef struct prof_symbol {
+	uint32_t addr;
+	char* name;
+} prof_symbol;
+
+typedef struct prof_stack {
+	uint64_t count; // 0 for an empty slot.
+	uint32_t hash;
+	uint8_t mode, depth;
+	uint32_t frames[RV32_PROFILE_DEPTH]; // Leaf first.
+} prof_stack;
+
+struct RV32_profile {
+	pthread_mutex_t lock; // Harts sample from their own threads.
+	prof_symbol* symbols; // Sorted by address.
+	size_t nsymbols;
+	prof_stack* stacks;
+	uint32_t nbuckets, nstacks;
+	uint64_t samples;
+};
+
+static int load_symbols(RV32_profile* prof, const char* path);
+static int load_elf(RV32_profile* prof, const uint8_t* file, size_t len);
+static int load_map(RV32_profile* prof, FILE* f);
+static int add_symbol(RV32_profile* prof, uint32_t addr, const char* name);
+static int cmp_symbol(const void* a, const void* b);
+static const prof_symbol* find_symbol(const RV32_profile* prof, uint32_t pc);
+static int guest_word(RV32_CPU* state, uint32_t addr, uint32_t* val);
+static int grow(RV32_profile* prof);
+
+RV32_profile* RV32_profile_create(const char* symbols) {
+	RV32_profile* prof = calloc(1, sizeof(RV32_profile));
+
+	if (!prof)
+		return NULL;
+	pthread_mutex_init(&prof->lock, NULL);
+	prof->nbuckets = PROF_BUCKETS;
+	if (!(prof->stacks = calloc(prof->nbuckets, sizeof(prof_stack))) ||
+	    (symbols && load_symbols(prof, symbols))) {
+		RV32_profile_free(prof);
+		return NULL;
+	}
+	qsort(prof->symbols, prof->nsymbols, sizeof(prof_symbol), cmp_symbol);
+	return prof;
+}
+
+void RV32_profile_free(RV32_profile* prof) {
+	if (!prof)
+		return;
+	for (size_t i = 0; i < prof->nsymbols; i++)
+		free(prof->symbols[i].name);
+	free(prof->symbols);
+	free(prof->stacks);
+	pthread_mutex_destroy(&prof->lock);
+	free(prof);
+}
+
+void RV32_profile_sample(RV32_profile* prof, RV32_CPU* state) {
+	prof_stack s = {.mode = state->csr[csr_extraflags] & 3};
+	uint32_t fp = state->regs[8], ra, next;
+	const prof_symbol* sym;
+
+	s.frames[s.depth++] = state->csr[csr_pc];
+	// A leaf keeps its caller in ra; anything else saved the same ra in its
+	// frame, which the walk below finds first.
+	if (state->regs[1])
+		s.frames[s.depth++] = state->regs[1];
+	while (s.depth < RV32_PROFILE_DEPTH) {
+		if (guest_word(state, fp - 4, &ra) || guest_word(state, fp - 8, &next) || !ra)
+			break;
+		if (ra != s.frames[s.depth - 1])
+			s.frames[s.depth++] = ra;
+		if (next <= fp) // Stacks grow down; anything else is not a frame.
+			break;
+		fp = next;
+	}
+	// A return address points past the call, which may already be the next
+	// function when the call ends one, so look up the call itself.
+	for (uint32_t i = 0; i < s.depth; i++) {
+		sym = find_symbol(prof, i ? s.frames[i] - 2 : s.frames[i]);
+		if (sym)
+			s.frames[i] = sym->addr;
+	}
+	// ra back into the sampled function is from a call it already made.
+	if (s.depth > 1 && s.frames[1] == s.frames[0] && prof->nsymbols)
+		memmove(&s.frames[1], &s.frames[2], (--s.depth - 1) * sizeof(uint32_t));
+	s.hash = 2166136261u ^ s.mode; // FNV-1a
+	for (uint32_t i = 0; i < s.depth; i++)
+		s.hash = (s.hash ^ s.frames[i]) * 16777619u;
+
+	pthread_mutex_lock(&prof->lock);
+	prof->samples++;
+	if (prof->nstacks * 2 >= prof->nbuckets && grow(prof)) {
+		pthread_mutex_unlock(&prof->lock);
+		return;
+	}
+	for (uint32_t i = s.hash;; i++) {
+		prof_stack* slot = &prof->stacks[i & (prof->nbuckets - 1)];
+		if (!slot->count) {
+			s.count = 1;
+			*slot = s;
+			prof->nstacks++;
+			break;
+		}
+		if (slot->hash == s.hash && slot->mode == s.mode && slot->depth == s.depth &&
+		    !memcmp(slot->frames, s.frames, s.depth * sizeof(uint32_t))) {
+			slot->count++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&prof->lock);
+}
+
+// Folded stacks, outermost frame first under the privilege mode, one line
+// per call path: "[M];start_kernel;do_idle;arch_cpu_idle 42".
+int RV32_profile_write(RV32_profile* prof, const char* path) {
+	FILE* f = fopen(path, "w");
+
+	if (!f)
+		return -1;
+	pthread_mutex_lock(&prof->lock);
+	for (uint32_t i = 0; i < prof->nbuckets; i++) {
+		const prof_stack* s = &prof->stacks[i];
+		if (!s->count)
+			continue;
+		fputs(s->mode == 3 ? "[M]" : s->mode == 1 ? "[S]" : "[U]", f);
+		for (int j = s->depth - 1; j >= 0; j--) {
+			const prof_symbol* sym = find_symbol(prof, s->frames[j]);
+			if (sym && sym->addr == s->frames[j])
+				fprintf(f, ";%s", sym->name);
+			else
+				fprintf(f, ";0x%08x", s->frames[j]);
+		}
+		fprintf(f, " %llu\n", (unsigned long long)s->count);
+	}
+	pthread_mutex_unlock(&prof->lock);
+	return fclose(f) ? -1 : 0;
+}
+
+uint64_t RV32_profile_samples(RV32_profile* prof) {
+	return __atomic_load_n(&prof->samples, __ATOMIC_RELAXED);
+}
+
+// An ELF file with a symbol table, or a System.map ("c0001000 T name").
+static int load_symbols(RV32_profile* prof, const char* path) {
+	FILE* f = fopen(path, "rb");
+	uint8_t* file = NULL;
+	long len;
+	int ret = -1;
+
+	if (!f)
+		return -1;
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+		goto out;
+	if (len >= SELFMAG && (file = malloc(len)) && fread(file, 1, len, f) == (size_t)len &&
+	    !memcmp(file, ELFMAG, SELFMAG))
+		ret = load_elf(prof, file, len);
+	else if (!fseek(f, 0, SEEK_SET))
+		ret = load_map(prof, f);
+out:
+	free(file);
+	fclose(f);
+	return ret;
+}
+
+// 32-bit little-endian only, like the guest. Symbols in relocatable objects
+// are placed at their section's address.
+static int load_elf(RV32_profile* prof, const uint8_t* file, size_t len) {
+	const Elf32_Ehdr* eh = (const Elf32_Ehdr*)file;
+	const Elf32_Shdr* sh;
+
+	if (len < sizeof(Elf32_Ehdr) || eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+	    eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_shentsize != sizeof(Elf32_Shdr) ||
+	    eh->e_shoff > len || eh->e_shnum > (len - eh->e_shoff) / sizeof(Elf32_Shdr))
+		return -1;
+	sh = (const Elf32_Shdr*)(file + eh->e_shoff);
+	for (uint32_t i = 0; i < eh->e_shnum; i++) {
+		const Elf32_Sym* syms = (const Elf32_Sym*)(file + sh[i].sh_offset);
+		const char* strtab;
+		uint32_t strsize;
+
+		if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum ||
+		    sh[i].sh_offset > len || sh[i].sh_size > len - sh[i].sh_offset ||
+		    sh[sh[i].sh_link].sh_offset > len ||
+		    sh[sh[i].sh_link].sh_size > len - sh[sh[i].sh_link].sh_offset)
+			continue;
+		strtab = (const char*)file + sh[sh[i].sh_link].sh_offset;
+		strsize = sh[sh[i].sh_link].sh_size;
+		for (uint32_t j = 0; j < sh[i].sh_size / sizeof(Elf32_Sym); j++) {
+			const Elf32_Sym* sym = &syms[j];
+			uint32_t addr = sym->st_value;
+			int type = ELF32_ST_TYPE(sym->st_info);
+
+			if ((type != STT_FUNC && type != STT_NOTYPE) || sym->st_shndx == SHN_UNDEF ||
+			    sym->st_shndx >= SHN_LORESERVE || sym->st_name >= strsize ||
+			    !memchr(strtab + sym->st_name, 0, strsize - sym->st_name))
+				continue;
+			// Skip mapping symbols ($x, $d) and assembler locals.
+			if (strchr("$.", strtab[sym->st_name]) || !strtab[sym->st_name])
+				continue;
+			if (eh->e_type == ET_REL && sym->st_shndx < eh->e_shnum)
+				addr += sh[sym->st_shndx].sh_addr;
+			if (add_symbol(prof, addr, strtab + sym->st_name))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int load_map(RV32_profile* prof, FILE* f) {
+	char line[512], name[256], type;
+	unsigned int addr;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%x %c %255s", &addr, &type, name) != 3)
+			return -1;
+		if (strchr("tTwW", type) && add_symbol(prof, addr, name))
+			return -1;
+	}
+	return 0;
+}
+
+static int add_symbol(RV32_profile* prof, uint32_t addr, const char* name) {
+	prof_symbol* syms = prof->symbols;
+
+	if (!(prof->nsymbols & (prof->nsymbols - 1))) {
+		size_t n = prof->nsymbols ? prof->nsymbols * 2 : 64;
+		if (!(syms = realloc(syms, n * sizeof(prof_symbol))))
+			return -1;
+		prof->symbols = syms;
+	}
+	if (!(syms[prof->nsymbols].name = strdup(name)))
+		return -1;
+	syms[prof->nsymbols++].addr = addr;
+	return 0;
+}
+
+static int cmp_symbol(const void* a, const void* b) {
+	uint32_t x = ((const prof_symbol*)a)->addr, y = ((const prof_symbol*)b)->addr;
+
+	return x < y ? -1 : x > y;
+}
+
+// The last symbol at or below pc.
+static const prof_symbol* find_symbol(const RV32_profile* prof, uint32_t pc) {
+	size_t lo = 0, hi = prof->nsymbols;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (prof->symbols[mid].addr <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? &prof->symbols[lo - 1] : NULL;
+}
+
+// A word of the sampled hart's stack, through its page tables when it is
+// running translated.
+static int guest_word(RV32_CPU* state, uint32_t addr, uint32_t* val) {
+	uint32_t ofs = addr - state->base_ofs;
+
+	if (addr & 3)
+		return -1;
+	if ((state->mmu & RV32_MMU_FETCH) && RV32_peek_virt(state, addr, &ofs))
+		return -1;
+	if (ofs > state->total_mem - 4)
+		return -1;
+	*val = *(uint32_t*)(state->mem + ofs);
+	return 0;
+}
+
+// Doubles the table. Called with the lock held.
+static int grow(RV32_profile* prof) {
+	uint32_t n = prof->nbuckets * 2;
+	prof_stack* stacks = calloc(n, sizeof(prof_stack));
+
+	if (!stacks)
+		return -1;
+	for (uint32_t i = 0; i < prof->nbuckets; i++) {
+		const prof_stack* s = &prof->stacks[i];
+		uint32_t j = s->hash;
+		if (!s->count)
+			continue;
+		while (stacks[j & (n - 1)].count)
+			j++;
+		stacks[j & (n - 1)] = *s;
+	}
+	free(prof->stacks);
+	prof->stacks = stacks;
+	prof->nbuckets = n;
+	return 0;
+}
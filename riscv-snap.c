@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "riscv-emu.h"
+
+/*
+ * Whole machine snapshots.
+ *
+ * A header, the architectural state of every hart, the host's device state
+ * (opaque here), then guest RAM at a page aligned offset. RAM pages that
+ * are all zero are left as holes, so a booted 64MiB guest takes only as
+ * much disk as it has touched. Restoring maps RAM straight from the file,
+ * copy-on-write: nothing is read until the guest touches it, and the file
+ * itself is never written.
+ *
+ * Fields are in host byte order; a snapshot is only good on the same kind
+ * of host, and only for the emulator version that wrote it.
+ */
+
+#define SNAP_MAGIC "RV32SNAP"
+#define SNAP_VERSION 3
+#define SNAP_PAGE 4096
+
+typedef struct snap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nharts;
+	uint32_t total_mem;
+	uint32_t csr_count; // RV32_CSR_COUNT of the writer.
+	uint32_t devices_len;
+	uint64_t ram_ofs;
+} snap_header;
+
+typedef struct snap_hart {
+	uint32_t regs[32];
+	uint32_t csr[RV32_CSR_COUNT];
+	uint64_t fregs[32];
+	uint32_t lr_addr, lr_val;
+	uint32_t msip;
+} snap_hart;
+
+static uint64_t devices_offset(uint32_t nharts) {
+	return sizeof(snap_header) + (uint64_t)nharts * sizeof(snap_hart);
+}
+
+static uint64_t ram_offset(uint32_t nharts, uint32_t devices_len) {
+	uint64_t ofs = devices_offset(nharts) + devices_len;
+
+	return (ofs + SNAP_PAGE - 1) & ~(uint64_t)(SNAP_PAGE - 1);
+}
+
+static int zero_page(const uint8_t* p, size_t len) {
+	const uint64_t* w = (const uint64_t*)p;
+
+	for (size_t i = 0; i < len / 8; i++)
+		if (w[i])
+			return 0;
+	for (size_t i = len & ~(size_t)7; i < len; i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+static int write_all(int fd, const void* buf, size_t len, uint64_t ofs) {
+	const uint8_t* p = buf;
+
+	while (len) {
+		ssize_t n = pwrite(fd, p, len, ofs);
+		if (n <= 0)
+			return -1;
+		p += n;
+		ofs += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Every hart must be stopped between steps. Written to a temporary file
+// first, so a snapshot that fails half way leaves the old one alone.
+int RV32_snapshot_save(RV32_CPU* const* harts, uint32_t nharts, const void* devices,
+                       uint32_t devices_len, const char* path) {
+	const RV32_CPU* core = harts[0];
+	snap_header hdr = {SNAP_MAGIC, SNAP_VERSION, nharts, core->total_mem,
+	                   RV32_CSR_COUNT, devices_len, ram_offset(nharts, devices_len)};
+	size_t len = strlen(path) + sizeof(".tmp");
+	char* tmp = malloc(len);
+	int fd = -1;
+
+	if (!tmp)
+		return -1;
+	snprintf(tmp, len, "%s.tmp", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto fail;
+	// Size it up front: pages left unwritten read back as zeros.
+	if (ftruncate(fd, hdr.ram_ofs + core->total_mem) ||
+	    write_all(fd, &hdr, sizeof(hdr), 0))
+		goto fail;
+	for (uint32_t i = 0; i < nharts; i++) {
+		snap_hart h = {0};
+
+		memcpy(h.regs, harts[i]->regs, sizeof(h.regs));
+		memcpy(h.csr, harts[i]->csr, sizeof(h.csr));
+		memcpy(h.fregs, harts[i]->fregs, sizeof(h.fregs));
+		h.lr_addr = harts[i]->lr_addr;
+		h.lr_val = harts[i]->lr_val;
+		h.msip = __atomic_load_n(&harts[i]->msip, __ATOMIC_ACQUIRE);
+		if (write_all(fd, &h, sizeof(h), sizeof(hdr) + (uint64_t)i * sizeof(h)))
+			goto fail;
+	}
+	if (write_all(fd, devices, devices_len, devices_offset(nharts)))
+		goto fail;
+	for (uint32_t ofs = 0; ofs < core->total_mem; ofs += SNAP_PAGE) {
+		size_t n = core->total_mem - ofs < SNAP_PAGE ? core->total_mem - ofs : SNAP_PAGE;
+
+		if (!zero_page(core->mem + ofs, n) &&
+		    write_all(fd, core->mem + ofs, n, hdr.ram_ofs + ofs))
+			goto fail;
+	}
+	if (close(fd)) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (rename(tmp, path))
+		goto fail;
+	free(tmp);
+	return 0;
+fail:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+// Reads the header, so the caller knows how many harts and how much RAM to
+// set up before RV32_snapshot_restore.
+int RV32_snapshot_open(RV32_snapshot* snap, const char* path) {
+	snap_header hdr;
+
+	if ((snap->fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (pread(snap->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) || hdr.version != SNAP_VERSION ||
+	    hdr.csr_count != RV32_CSR_COUNT || !hdr.nharts || hdr.nharts > RV32_MAX_HARTS ||
+	    hdr.ram_ofs != ram_offset(hdr.nharts, hdr.devices_len)) {
+		close(snap->fd);
+		snap->fd = -1;
+		return -1;
+	}
+	snap->nharts = hdr.nharts;
+	snap->total_mem = hdr.total_mem;
+	snap->ram_ofs = hdr.ram_ofs;
+	snap->devices = NULL;
+	snap->devices_len = hdr.devices_len;
+	return 0;
+}
+
+// harts must number snap->nharts and share RAM of snap->total_mem bytes,
+// as set up by RV32_map_ram. Closes the snapshot either way; on success
+// snap->devices holds the device state for the caller.
+int RV32_snapshot_restore(RV32_snapshot* snap, RV32_CPU* const* harts) {
+	RV32_CPU* core = harts[0];
+	size_t len = (core->total_mem + SNAP_PAGE - 1) & ~(size_t)(SNAP_PAGE - 1);
+	int ret = -1;
+
+	if (core->total_mem != snap->total_mem ||
+	    !(snap->devices = malloc(snap->devices_len ? snap->devices_len : 1)) ||
+	    pread(snap->fd, snap->devices, snap->devices_len, devices_offset(snap->nharts)) !=
+	        (ssize_t)snap->devices_len)
+		goto out;
+	for (uint32_t i = 0; i < snap->nharts; i++) {
+		snap_hart h;
+
+		if (pread(snap->fd, &h, sizeof(h), sizeof(snap_header) + (uint64_t)i * sizeof(h)) !=
+		    sizeof(h))
+			goto out;
+		memcpy(harts[i]->regs, h.regs, sizeof(h.regs));
+		memcpy(harts[i]->csr, h.csr, sizeof(h.csr));
+		memcpy(harts[i]->fregs, h.fregs, sizeof(h.fregs));
+		harts[i]->lr_addr = h.lr_addr;
+		harts[i]->lr_val = h.lr_val;
+		harts[i]->msip = h.msip;
+	}
+	// Private mapping over the front of the RAM window: pages come in from
+	// the file as the guest touches them, and its writes stay in memory.
+	if (mmap(core->mem, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snap->fd,
+	         snap->ram_ofs) == MAP_FAILED)
+		goto out;
+	for (uint32_t i = 0; i < snap->nharts; i++) {
+		RV32_flush_code(harts[i]);
+		RV32_flush_tlb(harts[i]);
+	}
+	ret = 0;
+out:
+	if (ret) {
+		free(snap->devices);
+		snap->devices = NULL;
+	}
+	close(snap->fd);
+	snap->fd = -1;
+	return ret;
+}
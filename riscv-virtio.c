@@ -0,0 +1,688 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "riscv-emu.h"
+
+/*
+ * virtio-mmio devices (virtio 1.x, register layout version 2).
+ *
+ * The transport keeps the registers and split virtqueues; a device type
+ * only says what to do with a chain of buffers. Buffers are used in place:
+ * a chain is turned into host pointers into guest RAM, and the device
+ * copies between those and its backend directly. Everything the driver has
+ * made available is handled on one notify, and the interrupt is raised once
+ * for the lot.
+ *
+ * Register accesses come from whichever hart touches the device, so they
+ * are serialized by a lock per device.
+ */
+
+#define VIRTIO_MAGIC 0x74726976 // "virt"
+#define VIRTIO_VENDOR 0x554d4551 // "QEMU", as Linux expects nothing in particular.
+#define VIRTIO_QUEUES RV32_VIRTIO_QUEUES
+#define VIRTQ_MAX 128 // Descriptors per queue, and buffers per chain.
+
+#define VIRTIO_F_INDIRECT_DESC (1ull << 28)
+#define VIRTIO_F_VERSION_1 (1ull << 32)
+
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_NEEDS_RESET 64
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+#define VIRTIO_BLK_F_SEG_MAX (1ull << 2)
+#define VIRTIO_BLK_F_RO (1ull << 5)
+#define VIRTIO_BLK_F_BLK_SIZE (1ull << 6)
+#define VIRTIO_BLK_F_FLUSH (1ull << 9)
+
+#define VIRTIO_CONSOLE_F_EMERG_WRITE (1ull << 2)
+
+enum { VIRTIO_ID_BLOCK = 2, VIRTIO_ID_CONSOLE = 3 };
+
+typedef struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags, next;
+} virtq_desc;
+
+typedef struct virtq_used_elem {
+	uint32_t id, len;
+} virtq_used_elem;
+
+typedef struct virtq {
+	uint32_t num, ready;
+	uint32_t desc_lo, desc_hi, avail_lo, avail_hi, used_lo, used_hi;
+	// Host views of the rings, set up when the driver marks the queue ready.
+	virtq_desc* desc;
+	uint16_t* avail; // flags, idx, ring[num]
+	uint16_t* used;  // flags, idx, then virtq_used_elem[num]
+	uint16_t last_avail;
+	uint16_t pending; // Used entries since the last interrupt.
+} virtq;
+
+// One buffer of a chain, in guest RAM.
+typedef struct virtio_buf {
+	uint8_t* p;
+	uint32_t ofs; // RAM offset, for RV32_virtio_host::written.
+	uint32_t len;
+	int writable;
+} virtio_buf;
+
+struct RV32_virtio {
+	RV32_virtio_host host;
+	pthread_mutex_t lock;
+	uint32_t device_id;
+	uint64_t features, driver_features;
+	uint32_t features_sel, driver_features_sel;
+	uint32_t queue_sel;
+	uint32_t status;
+	uint32_t isr;
+	virtq queues[VIRTIO_QUEUES];
+	uint32_t nqueues;
+	uint8_t config[64]; // Device specific configuration, little endian.
+	// The driver notified a queue.
+	void (*notify)(RV32_virtio* dev, virtq* q);
+	// The driver wrote the configuration, may be NULL.
+	void (*config_store)(RV32_virtio* dev, uint32_t addr, uint32_t val, int size);
+	void (*release)(RV32_virtio* dev);
+	// Block devices.
+	uint8_t* disk;
+	uint64_t disk_size;
+	int fd;
+	// Consoles.
+	void (*out)(void* opaque, const uint8_t* buf, size_t len);
+	size_t (*in)(void* opaque, uint8_t* buf, size_t len);
+	void* io_opaque;
+};
+
+static void virtio_reset(RV32_virtio* dev);
+static void queue_ready(RV32_virtio* dev, virtq* q);
+static int queue_map(RV32_virtio* dev, virtq* q);
+static void blk_notify(RV32_virtio* dev, virtq* q);
+static void blk_release(RV32_virtio* dev);
+static void console_notify(RV32_virtio* dev, virtq* q);
+static void console_config_store(RV32_virtio* dev, uint32_t addr, uint32_t val, int size);
+static void console_input(RV32_virtio* dev);
+
+static RV32_virtio* virtio_new(const RV32_virtio_host* host, uint32_t device_id,
+                               uint32_t nqueues) {
+	RV32_virtio* dev = calloc(1, sizeof(RV32_virtio));
+
+	if (!dev)
+		return NULL;
+	dev->host = *host;
+	dev->device_id = device_id;
+	dev->nqueues = nqueues;
+	dev->features = VIRTIO_F_VERSION_1 | VIRTIO_F_INDIRECT_DESC;
+	dev->fd = -1;
+	pthread_mutex_init(&dev->lock, NULL);
+	return dev;
+}
+
+void RV32_virtio_free(RV32_virtio* dev) {
+	if (!dev)
+		return;
+	if (dev->release)
+		dev->release(dev);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
+}
+
+// Guest physical range to a host pointer, NULL unless it is all RAM.
+static void* guest(RV32_virtio* dev, uint64_t addr, uint64_t len) {
+	uint64_t ofs = addr - dev->host.ram_base;
+
+	if (addr < dev->host.ram_base || ofs > dev->host.ram_size || len > dev->host.ram_size - ofs)
+		return NULL;
+	return dev->host.mem + ofs;
+}
+
+uint32_t RV32_virtio_load(void* opaque, uint32_t addr, int size) {
+	RV32_virtio* dev = opaque;
+	virtq* q;
+	uint32_t val = 0;
+
+	pthread_mutex_lock(&dev->lock);
+	q = dev->queue_sel < dev->nqueues ? &dev->queues[dev->queue_sel] : NULL;
+	if (addr >= 0x100) {
+		if (addr - 0x100 + size <= sizeof(dev->config))
+			memcpy(&val, dev->config + addr - 0x100, size);
+		goto out;
+	}
+	switch (addr) {
+	case 0x000:
+		val = VIRTIO_MAGIC;
+		break;
+	case 0x004: // Version
+		val = 2;
+		break;
+	case 0x008:
+		val = dev->device_id;
+		break;
+	case 0x00c:
+		val = VIRTIO_VENDOR;
+		break;
+	case 0x010: // DeviceFeatures
+		val = dev->features_sel < 2 ? dev->features >> (32 * dev->features_sel) : 0;
+		break;
+	case 0x034: // QueueNumMax
+		val = q ? VIRTQ_MAX : 0;
+		break;
+	case 0x044: // QueueReady
+		val = q ? q->ready : 0;
+		break;
+	case 0x060: // InterruptStatus
+		val = dev->isr;
+		break;
+	case 0x070:
+		val = dev->status;
+		break;
+	case 0x0fc: // ConfigGeneration: the configuration never changes under the driver.
+		val = 0;
+		break;
+	}
+out:
+	pthread_mutex_unlock(&dev->lock);
+	return val;
+}
+
+uint32_t RV32_virtio_store(void* opaque, uint32_t addr, uint32_t val, int size) {
+	RV32_virtio* dev = opaque;
+	virtq* q;
+
+	pthread_mutex_lock(&dev->lock);
+	q = dev->queue_sel < dev->nqueues ? &dev->queues[dev->queue_sel] : NULL;
+	if (addr >= 0x100 && dev->config_store)
+		dev->config_store(dev, addr - 0x100, val, size);
+	switch (addr) {
+	case 0x014: // DeviceFeaturesSel
+		dev->features_sel = val;
+		break;
+	case 0x020: // DriverFeatures
+		if (dev->driver_features_sel < 2) {
+			dev->driver_features &= ~(0xffffffffull << (32 * dev->driver_features_sel));
+			dev->driver_features |= (uint64_t)val << (32 * dev->driver_features_sel);
+		}
+		break;
+	case 0x024: // DriverFeaturesSel
+		dev->driver_features_sel = val;
+		break;
+	case 0x030: // QueueSel
+		dev->queue_sel = val;
+		break;
+	case 0x038: // QueueNum
+		if (q && !q->ready && val && val <= VIRTQ_MAX && !(val & (val - 1)))
+			q->num = val;
+		break;
+	case 0x044: // QueueReady
+		if (q && val)
+			queue_ready(dev, q);
+		else if (q)
+			q->ready = 0;
+		break;
+	case 0x050: // QueueNotify
+		if (val < dev->nqueues && dev->queues[val].ready)
+			dev->notify(dev, &dev->queues[val]);
+		break;
+	case 0x064: // InterruptACK
+		dev->isr &= ~val;
+		if (!dev->isr)
+			dev->host.irq(dev->host.opaque, 0);
+		break;
+	case 0x070: // Status
+		if (!val) {
+			virtio_reset(dev);
+			break;
+		}
+		// Refuse features we never offered, and drivers from before 1.0.
+		if ((val & VIRTIO_STATUS_FEATURES_OK) &&
+		    ((dev->driver_features & ~dev->features) ||
+		     !(dev->driver_features & VIRTIO_F_VERSION_1)))
+			val &= ~VIRTIO_STATUS_FEATURES_OK;
+		dev->status = val;
+		break;
+	case 0x080:
+		if (q)
+			q->desc_lo = val;
+		break;
+	case 0x084:
+		if (q)
+			q->desc_hi = val;
+		break;
+	case 0x090:
+		if (q)
+			q->avail_lo = val;
+		break;
+	case 0x094:
+		if (q)
+			q->avail_hi = val;
+		break;
+	case 0x0a0:
+		if (q)
+			q->used_lo = val;
+		break;
+	case 0x0a4:
+		if (q)
+			q->used_hi = val;
+		break;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+static void virtio_reset(RV32_virtio* dev) {
+	dev->driver_features = 0;
+	dev->features_sel = dev->driver_features_sel = dev->queue_sel = 0;
+	dev->status = 0;
+	memset(dev->queues, 0, sizeof(dev->queues));
+	if (dev->isr) {
+		dev->isr = 0;
+		dev->host.irq(dev->host.opaque, 0);
+	}
+}
+
+// The rings have to lie in RAM, or the device gives up until reset.
+static void queue_ready(RV32_virtio* dev, virtq* q) {
+	if (!q->num)
+		q->num = VIRTQ_MAX;
+	if (queue_map(dev, q)) {
+		dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+		return;
+	}
+	q->last_avail = 0;
+	q->pending = 0;
+	q->ready = 1;
+}
+
+// Host views of the rings, -1 unless they are aligned and all RAM.
+static int queue_map(RV32_virtio* dev, virtq* q) {
+	uint64_t desc = (uint64_t)q->desc_hi << 32 | q->desc_lo;
+	uint64_t avail = (uint64_t)q->avail_hi << 32 | q->avail_lo;
+	uint64_t used = (uint64_t)q->used_hi << 32 | q->used_lo;
+
+	q->desc = guest(dev, desc, 16ull * q->num);
+	q->avail = guest(dev, avail, 6 + 2ull * q->num);
+	q->used = guest(dev, used, 6 + 8ull * q->num);
+	return !q->desc || !q->avail || !q->used || (desc & 15) || (avail & 1) || (used & 3) ? -1 : 0;
+}
+
+void RV32_virtio_save(RV32_virtio* dev, RV32_virtio_state* s) {
+	pthread_mutex_lock(&dev->lock);
+	*s = (RV32_virtio_state){dev->device_id, dev->status, dev->isr, dev->features_sel,
+	                         dev->driver_features_sel, dev->queue_sel, dev->driver_features};
+	for (uint32_t i = 0; i < VIRTIO_QUEUES; i++) {
+		const virtq* q = &dev->queues[i];
+
+		s->queues[i].num = q->num;
+		s->queues[i].ready = q->ready;
+		s->queues[i].desc_lo = q->desc_lo;
+		s->queues[i].desc_hi = q->desc_hi;
+		s->queues[i].avail_lo = q->avail_lo;
+		s->queues[i].avail_hi = q->avail_hi;
+		s->queues[i].used_lo = q->used_lo;
+		s->queues[i].used_hi = q->used_hi;
+		s->queues[i].last_avail = q->last_avail;
+		s->queues[i].pending = q->pending;
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+// Into a device just attached, so nothing to undo on failure but a reset.
+// The interrupt line is the PLIC's to restore.
+int RV32_virtio_restore(RV32_virtio* dev, const RV32_virtio_state* s) {
+	int ret = 0;
+
+	if (s->device_id != dev->device_id)
+		return -1;
+	pthread_mutex_lock(&dev->lock);
+	dev->status = s->status;
+	dev->isr = s->isr;
+	dev->features_sel = s->features_sel;
+	dev->driver_features_sel = s->driver_features_sel;
+	dev->queue_sel = s->queue_sel;
+	dev->driver_features = s->driver_features;
+	for (uint32_t i = 0; i < VIRTIO_QUEUES; i++) {
+		virtq* q = &dev->queues[i];
+
+		*q = (virtq){s->queues[i].num, 0, s->queues[i].desc_lo, s->queues[i].desc_hi,
+		             s->queues[i].avail_lo, s->queues[i].avail_hi, s->queues[i].used_lo,
+		             s->queues[i].used_hi};
+		q->last_avail = s->queues[i].last_avail;
+		q->pending = s->queues[i].pending;
+		if (!s->queues[i].ready)
+			continue;
+		if (i >= dev->nqueues || !q->num || q->num > VIRTQ_MAX || (q->num & (q->num - 1)) ||
+		    queue_map(dev, q)) {
+			ret = -1;
+			break;
+		}
+		q->ready = 1;
+	}
+	if (ret)
+		virtio_reset(dev);
+	pthread_mutex_unlock(&dev->lock);
+	return ret;
+}
+
+// Next chain the driver made available, as buffers in guest RAM. Returns
+// how many, 0 for none left, or -1 for a chain that is not all RAM.
+static int virtq_pop(RV32_virtio* dev, virtq* q, uint16_t* head, virtio_buf* bufs) {
+	virtq_desc* table = q->desc;
+	uint32_t size = q->num, i, n = 0, seen = 0;
+
+	if (q->last_avail == __atomic_load_n(&q->avail[1], __ATOMIC_ACQUIRE))
+		return 0;
+	*head = i = q->avail[2 + (q->last_avail++ & (q->num - 1))];
+	for (;;) {
+		virtq_desc d;
+
+		if (i >= size || ++seen > size)
+			return -1; // Out of the table, or a loop.
+		d = table[i];
+		if (d.flags & VIRTQ_DESC_F_INDIRECT) {
+			// A table of its own, which the chain continues in.
+			if (table != q->desc || (d.len & 15) || !d.len ||
+			    !(table = guest(dev, d.addr, d.len)))
+				return -1;
+			size = d.len / 16;
+			i = seen = 0;
+			continue;
+		}
+		if (n == VIRTQ_MAX || !(bufs[n].p = guest(dev, d.addr, d.len)))
+			return -1;
+		bufs[n].ofs = d.addr - dev->host.ram_base;
+		bufs[n].len = d.len;
+		bufs[n].writable = !!(d.flags & VIRTQ_DESC_F_WRITE);
+		n++;
+		if (!(d.flags & VIRTQ_DESC_F_NEXT))
+			return n;
+		i = d.next;
+	}
+}
+
+static void virtq_push(RV32_virtio* dev, virtq* q, uint16_t head, uint32_t len) {
+	uint16_t idx = q->used[1];
+	virtq_used_elem* ring = (virtq_used_elem*)(q->used + 2);
+
+	ring[idx & (q->num - 1)] = (virtq_used_elem){head, len};
+	__atomic_store_n(&q->used[1], (uint16_t)(idx + 1), __ATOMIC_RELEASE);
+	q->pending++;
+}
+
+// One interrupt for everything pushed since the last one.
+static void virtq_interrupt(RV32_virtio* dev, virtq* q) {
+	if (!q->pending)
+		return;
+	q->pending = 0;
+	if (__atomic_load_n(&q->avail[0], __ATOMIC_ACQUIRE) & VIRTQ_AVAIL_F_NO_INTERRUPT)
+		return;
+	dev->isr |= 1;
+	dev->host.irq(dev->host.opaque, 1);
+}
+
+// Block device: requests are a 16 byte header, the data, and a status
+// byte, served by copying between the buffers and the mapped image.
+enum {
+	VIRTIO_BLK_T_IN = 0,
+	VIRTIO_BLK_T_OUT = 1,
+	VIRTIO_BLK_T_FLUSH = 4,
+	VIRTIO_BLK_T_GET_ID = 8,
+};
+enum { VIRTIO_BLK_S_OK, VIRTIO_BLK_S_IOERR, VIRTIO_BLK_S_UNSUPP };
+
+typedef struct virtio_blk_req {
+	uint32_t type, reserved;
+	uint64_t sector;
+} virtio_blk_req;
+
+RV32_virtio* RV32_virtio_blk(const RV32_virtio_host* host, const char* path, int readonly) {
+	RV32_virtio* dev = virtio_new(host, VIRTIO_ID_BLOCK, 1);
+	struct stat st;
+	uint64_t capacity;
+	uint32_t seg_max = VIRTQ_MAX - 2, blk_size = 512;
+
+	if (!dev)
+		return NULL;
+	dev->notify = blk_notify;
+	dev->release = blk_release;
+	dev->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+	if (dev->fd < 0 && !readonly && (errno == EACCES || errno == EROFS)) {
+		readonly = 1;
+		dev->fd = open(path, O_RDONLY);
+	}
+	if (dev->fd < 0 || fstat(dev->fd, &st) || st.st_size < 512)
+		goto fail;
+	// Shared, so the guest's writes land in the file.
+	dev->disk_size = st.st_size & ~511ull;
+	dev->disk = mmap(NULL, dev->disk_size, PROT_READ | (readonly ? 0 : PROT_WRITE), MAP_SHARED,
+	                 dev->fd, 0);
+	if (dev->disk == MAP_FAILED) {
+		dev->disk = NULL;
+		goto fail;
+	}
+	dev->features |= VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH;
+	if (readonly)
+		dev->features |= VIRTIO_BLK_F_RO;
+	capacity = dev->disk_size / 512;
+	memcpy(dev->config, &capacity, 8);
+	memcpy(dev->config + 12, &seg_max, 4);
+	memcpy(dev->config + 20, &blk_size, 4);
+	return dev;
+fail:
+	RV32_virtio_free(dev);
+	return NULL;
+}
+
+// For a clone of the machine: a writable disk becomes a private mapping
+// of the same file, so the clone's writes stay in its own memory, copy on
+// write like its RAM, instead of landing in the image under the others.
+int RV32_virtio_blk_private(RV32_virtio* dev) {
+	if (!dev->disk || (dev->features & VIRTIO_BLK_F_RO))
+		return 0;
+	if (mmap(dev->disk, dev->disk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	         dev->fd, 0) == MAP_FAILED)
+		return -1;
+	return 0;
+}
+
+static void blk_release(RV32_virtio* dev) {
+	if (dev->disk)
+		munmap(dev->disk, dev->disk_size);
+	if (dev->fd >= 0)
+		close(dev->fd);
+}
+
+// Serves one request; returns how many bytes went into its writable buffers.
+static uint32_t blk_request(RV32_virtio* dev, virtio_buf* bufs, int n) {
+	virtio_blk_req req;
+	uint8_t* status;
+	uint64_t pos;
+	uint32_t got = 0, written = 1, len;
+	int i;
+
+	// The header may be split over buffers; everything readable after it
+	// is data to write.
+	for (i = 0; i < n && !bufs[i].writable && got < sizeof(req); i++) {
+		len = bufs[i].len < sizeof(req) - got ? bufs[i].len : sizeof(req) - got;
+		memcpy((uint8_t*)&req + got, bufs[i].p, len);
+		got += len;
+		if (len < bufs[i].len) {
+			bufs[i].p += len;
+			bufs[i].ofs += len;
+			bufs[i].len -= len;
+			break;
+		}
+	}
+	// The status byte ends the last buffer, which the device writes.
+	if (got < sizeof(req) || !bufs[n - 1].writable || !bufs[n - 1].len)
+		return 0;
+	status = &bufs[n - 1].p[--bufs[n - 1].len];
+	*status = VIRTIO_BLK_S_OK;
+
+	pos = req.sector * 512;
+	switch (req.type) {
+	case VIRTIO_BLK_T_IN:
+		for (; i < n; i++) {
+			if (!bufs[i].writable || pos > dev->disk_size ||
+			    bufs[i].len > dev->disk_size - pos) {
+				*status = VIRTIO_BLK_S_IOERR;
+				break;
+			}
+			memcpy(bufs[i].p, dev->disk + pos, bufs[i].len);
+			dev->host.written(dev->host.opaque, bufs[i].ofs, bufs[i].len);
+			pos += bufs[i].len;
+			written += bufs[i].len;
+		}
+		break;
+	case VIRTIO_BLK_T_OUT:
+		if (dev->features & VIRTIO_BLK_F_RO) {
+			*status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		for (; i < n && !bufs[i].writable; i++) {
+			if (pos > dev->disk_size || bufs[i].len > dev->disk_size - pos) {
+				*status = VIRTIO_BLK_S_IOERR;
+				break;
+			}
+			memcpy(dev->disk + pos, bufs[i].p, bufs[i].len);
+			pos += bufs[i].len;
+		}
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		if (!(dev->features & VIRTIO_BLK_F_RO) && msync(dev->disk, dev->disk_size, MS_SYNC))
+			*status = VIRTIO_BLK_S_IOERR;
+		break;
+	case VIRTIO_BLK_T_GET_ID: // Up to 20 bytes, NUL padded if shorter.
+		if (i < n && bufs[i].writable) {
+			len = bufs[i].len < 20 ? bufs[i].len : 20;
+			memcpy(bufs[i].p, "rv32emu-virtio-blk\0\0", len);
+			written += len;
+		}
+		break;
+	default:
+		*status = VIRTIO_BLK_S_UNSUPP;
+		break;
+	}
+	return written;
+}
+
+static void blk_notify(RV32_virtio* dev, virtq* q) {
+	virtio_buf bufs[VIRTQ_MAX];
+	uint16_t head;
+	int n;
+
+	while ((n = virtq_pop(dev, q, &head, bufs))) {
+		if (n < 0) {
+			dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+			break;
+		}
+		virtq_push(dev, q, head, blk_request(dev, bufs, n));
+	}
+	virtq_interrupt(dev, q);
+}
+
+// Console, a single port: queue 0 takes input for the guest, queue 1
+// carries its output, a whole buffer per call to out.
+RV32_virtio* RV32_virtio_console(const RV32_virtio_host* host,
+                                 void (*out)(void* opaque, const uint8_t* buf, size_t len),
+                                 size_t (*in)(void* opaque, uint8_t* buf, size_t len),
+                                 void* opaque) {
+	RV32_virtio* dev = virtio_new(host, VIRTIO_ID_CONSOLE, 2);
+
+	if (!dev)
+		return NULL;
+	dev->notify = console_notify;
+	dev->config_store = console_config_store;
+	dev->features |= VIRTIO_CONSOLE_F_EMERG_WRITE;
+	dev->out = out;
+	dev->in = in;
+	dev->io_opaque = opaque;
+	return dev;
+}
+
+static void console_notify(RV32_virtio* dev, virtq* q) {
+	virtio_buf bufs[VIRTQ_MAX];
+	uint16_t head;
+	int n;
+
+	if (q == &dev->queues[0]) {
+		console_input(dev); // New buffers to fill.
+		return;
+	}
+	while ((n = virtq_pop(dev, q, &head, bufs))) {
+		if (n < 0) {
+			dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+			break;
+		}
+		for (int i = 0; i < n; i++)
+			if (!bufs[i].writable && bufs[i].len)
+				dev->out(dev->io_opaque, bufs[i].p, bufs[i].len);
+		virtq_push(dev, q, head, 0);
+	}
+	virtq_interrupt(dev, q);
+}
+
+// emerg_wr: one character, written before the queues are up.
+static void console_config_store(RV32_virtio* dev, uint32_t addr, uint32_t val, int size) {
+	uint8_t c = val;
+
+	if (addr == 8)
+		dev->out(dev->io_opaque, &c, 1);
+}
+
+// Reads input straight into the guest's receive buffers, as much as in
+// has and they hold.
+static void console_input(RV32_virtio* dev) {
+	virtq* q = &dev->queues[0];
+	virtio_buf bufs[VIRTQ_MAX];
+	uint16_t head;
+	int n;
+
+	if (!(dev->status & VIRTIO_STATUS_DRIVER_OK) || !q->ready)
+		return;
+	while ((n = virtq_pop(dev, q, &head, bufs))) {
+		uint32_t got = 0, room = 0;
+
+		if (n < 0) {
+			dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			size_t len;
+			if (!bufs[i].writable)
+				continue;
+			room += bufs[i].len;
+			if (!(len = dev->in(dev->io_opaque, bufs[i].p, bufs[i].len)))
+				break;
+			dev->host.written(dev->host.opaque, bufs[i].ofs, len);
+			got += len;
+			if (len < bufs[i].len)
+				break;
+		}
+		if (!got) {
+			q->last_avail--; // Nothing to read, keep it for later.
+			break;
+		}
+		virtq_push(dev, q, head, got);
+		if (got < room)
+			break;
+	}
+	virtq_interrupt(dev, q);
+}
+
+void RV32_virtio_console_poll(RV32_virtio* dev) {
+	pthread_mutex_lock(&dev->lock);
+	console_input(dev);
+	pthread_mutex_unlock(&dev->lock);
+}
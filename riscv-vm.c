@@ -0,0 +1,946 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "riscv-emu.h"
+#include "librv32emu.h"
+
+/*
+ * Whole machines for librv32emu.
+ *
+ * Everything a machine needs lives in its RV32_vm: the harts, their RAM,
+ * the console queue, and the devices, which get the machine as their
+ * opaque pointer. Nothing here is global, so machines on different threads
+ * never touch each other. The only process-wide state left underneath is
+ * the SIGSEGV handler from RV32_map_ram, which finds the faulting machine
+ * through thread-local pointers.
+ *
+ * virtio devices get an interrupt line on a PLIC with one context per hart
+ * (machine mode). The built-in DTB only gains nodes for them, and the PLIC,
+ * once one is attached.
+ */
+
+extern const unsigned char _binary_sixtyfourmb_dtb_start[], _binary_sixtyfourmb_dtb_end[];
+
+#define VM_RAM_BASE 0x80000000
+#define VM_QUANTUM 100000 // Instructions per hart between clock samples.
+#define VM_RX_SIZE 4096   // Console input queue, a power of two.
+#define VM_PLIC_BASE 0x0c000000
+#define VM_PLIC_SIZE 0x4000000
+#define VM_PLIC_SOURCES 32 // Source 0 means none.
+#define VM_PLIC_PHANDLE 0x10 // Not taken in the built-in DTB.
+#define VM_VIRTIO_BASE 0x10001000 // One page per device from here, on PLIC source 1 up.
+#define VM_VIRTIO_MAX 8
+#define VM_STEP_MIN 512 // Fewest instructions a step is cut down to for the timer.
+#define VM_PACE_US 16 // Shortest interval the retire rate is measured over.
+#define VM_ISA "rv32imafdc_zba_zbb_zbs" // riscv,isa in the built-in DTB.
+
+typedef struct vm_plic {
+	pthread_mutex_t lock;
+	uint32_t priority[VM_PLIC_SOURCES];
+	uint32_t level, pending, claimed; // One bit per source.
+	uint32_t enable[RV32_MAX_HARTS], threshold[RV32_MAX_HARTS]; // Per context.
+} vm_plic;
+
+// How fast a hart retires instructions, for ending its steps when its timer
+// fires instead of a whole quantum later.
+typedef struct vm_pace {
+	uint64_t now, cycle; // Start of the interval being measured, now 0 for none.
+	uint64_t rate; // Instructions per 1024us, smoothed; 0 until measured.
+} vm_pace;
+
+typedef struct vm_virtio {
+	RV32_vm* vm;
+	uint32_t irq; // PLIC source.
+	RV32_virtio* dev;
+} vm_virtio;
+
+// Device state for snapshots: the PLIC, and the transport of each virtio
+// device in the order they were attached.
+typedef struct vm_devices {
+	uint32_t nvirtio;
+	uint32_t priority[VM_PLIC_SOURCES];
+	uint32_t level, pending, claimed;
+	uint32_t enable[RV32_MAX_HARTS], threshold[RV32_MAX_HARTS];
+	RV32_virtio_state virtio[VM_VIRTIO_MAX];
+} vm_devices;
+
+struct RV32_vm {
+	RV32_vm_config cfg;
+	RV32_CPU* harts[RV32_MAX_HARTS];
+	uint8_t* mem;
+	int32_t (*step)(RV32_CPU* state, int count);
+	vm_pace pace[RV32_MAX_HARTS];
+	uint32_t dtb_ofs; // RAM offset of the DTB, 0 for none.
+	uint64_t clock_start; // Host nanoseconds at guest time 0.
+	// Console input, RV32_vm_input to the UART. Head and tail run free.
+	uint8_t rx[VM_RX_SIZE];
+	uint32_t rx_head, rx_tail;
+	int rx_held; // A byte console_in gave for the next data read, -1 for none.
+	vm_plic plic;
+	vm_virtio virtio[VM_VIRTIO_MAX];
+	uint32_t nvirtio;
+	RV32_virtio* console; // Polled for input by hart 0, NULL for none.
+	uint32_t fork_index; // Read back by the guest from SYSCON + 4.
+	// The built-in DTB with nodes for the devices above, NULL if none.
+	uint8_t* dtb;
+	size_t dtb_len;
+};
+
+static uint64_t clock_ns(void);
+static long file_size(FILE* f);
+static int loaded(RV32_vm* vm, uint32_t dtb_ofs, int builtin);
+static int rx_ready(RV32_vm* vm);
+static void console_write(void* opaque, const uint8_t* buf, size_t len);
+static size_t console_read(void* opaque, uint8_t* buf, size_t len);
+static uint32_t uart_load(void* opaque, uint32_t addr, int size);
+static uint32_t uart_store(void* opaque, uint32_t addr, uint32_t val, int size);
+static uint32_t syscon_load(void* opaque, uint32_t addr, int size);
+static uint32_t syscon_store(void* opaque, uint32_t addr, uint32_t val, int size);
+static uint32_t plic_load(void* opaque, uint32_t addr, int size);
+static uint32_t plic_store(void* opaque, uint32_t addr, uint32_t val, int size);
+static void plic_update(RV32_vm* vm);
+static void plic_reset(RV32_vm* vm);
+static void virtio_irq(void* opaque, int level);
+static void virtio_written(void* opaque, uint32_t ofs, uint32_t len);
+static vm_virtio* virtio_slot(RV32_vm* vm, RV32_virtio_host* host);
+static int attach_virtio(RV32_vm* vm, vm_virtio* slot);
+static int step_budget(RV32_vm* vm, RV32_CPU* core, uint64_t now, int count);
+static const uint8_t* builtin_dtb(RV32_vm* vm, size_t* len);
+static int build_dtb(RV32_vm* vm);
+
+RV32_vm* RV32_vm_create(const RV32_vm_config* cfg) {
+	static int32_t (*const engines[])(RV32_CPU*, int) = {RV32_step, RV32_step_blocks,
+	                                                     RV32_step_jit, RV32_step_jit};
+	RV32_vm* vm = calloc(1, sizeof(RV32_vm));
+
+	if (!vm)
+		return NULL;
+	vm->cfg = *cfg;
+	if (!vm->cfg.ram_size)
+		vm->cfg.ram_size = 64 * 1024 * 1024;
+	if (!vm->cfg.nharts)
+		vm->cfg.nharts = 1;
+	vm->rx_held = -1;
+	pthread_mutex_init(&vm->plic.lock, NULL);
+	// Replaying a block is only meaningful when no one else writes RAM.
+	if (vm->cfg.nharts > RV32_MAX_HARTS || vm->cfg.engine < RV32_ENGINE_STEP ||
+	    vm->cfg.engine > RV32_ENGINE_JIT_LOCKSTEP ||
+	    (vm->cfg.engine == RV32_ENGINE_JIT_LOCKSTEP && vm->cfg.nharts > 1))
+		goto fail;
+	vm->step = engines[vm->cfg.engine];
+	if (!(vm->mem = RV32_map_ram(vm->cfg.ram_size, vm->cfg.hugepages)))
+		goto fail;
+
+	// Every hart sees the same RAM and devices, with its own caches.
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++) {
+		RV32_device uart = {0x10000000, 0x100, uart_load, uart_store, vm};
+		RV32_device syscon = {0x11100000, 0x1000, syscon_load, syscon_store, vm};
+		RV32_device plic = {VM_PLIC_BASE, VM_PLIC_SIZE, plic_load, plic_store, vm};
+		RV32_CPU* core = vm->harts[i] = calloc(1, sizeof(RV32_CPU));
+
+		if (!core)
+			goto fail;
+		core->total_mem = vm->cfg.ram_size;
+		core->mem = vm->mem;
+		core->base_ofs = VM_RAM_BASE;
+		core->hartid = i;
+		core->nharts = vm->cfg.nharts;
+		if (vm->cfg.nharts > 1)
+			core->harts = vm->harts;
+		if (RV32_init_bus(core) || RV32_attach_device(core, &uart) ||
+		    RV32_attach_device(core, &syscon) || RV32_attach_device(core, &plic))
+			goto fail;
+		if (vm->step == RV32_step_jit &&
+		    RV32_jit_init(core, vm->cfg.engine == RV32_ENGINE_JIT_LOCKSTEP))
+			goto fail;
+	}
+	if (build_dtb(vm))
+		goto fail;
+	RV32_vm_reset(vm);
+	return vm;
+fail:
+	RV32_vm_destroy(vm);
+	return NULL;
+}
+
+void RV32_vm_destroy(RV32_vm* vm) {
+	if (!vm)
+		return;
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++) {
+		if (!vm->harts[i])
+			continue;
+		RV32_jit_free(vm->harts[i]);
+		RV32_free_bus(vm->harts[i]);
+		free(vm->harts[i]);
+	}
+	for (uint32_t i = 0; i < vm->nvirtio; i++)
+		RV32_virtio_free(vm->virtio[i].dev);
+	pthread_mutex_destroy(&vm->plic.lock);
+	RV32_unmap_ram(vm->mem);
+	free(vm->dtb);
+	free(vm);
+}
+
+int RV32_vm_load(RV32_vm* vm, const void* image, size_t image_len, const void* dtb,
+                 size_t dtb_len) {
+	int builtin = !dtb;
+
+	if (builtin)
+		dtb = builtin_dtb(vm, &dtb_len);
+	if (image_len + dtb_len > vm->cfg.ram_size)
+		return -4;
+	memcpy(vm->mem, image, image_len);
+	memcpy(vm->mem + vm->cfg.ram_size - dtb_len, dtb, dtb_len);
+	return loaded(vm, vm->cfg.ram_size - dtb_len, builtin);
+}
+
+int RV32_vm_load_files(RV32_vm* vm, const char* image_path, const char* dtb_path) {
+	size_t dtb_len;
+	const uint8_t* builtin = builtin_dtb(vm, &dtb_len);
+	FILE* dtb = NULL;
+	FILE* image = NULL;
+	long image_len, len;
+	int ret = 0;
+
+	if (dtb_path) {
+		if (!(dtb = fopen(dtb_path, "rb")) || (len = file_size(dtb)) < 0) {
+			ret = -2;
+			goto out;
+		}
+		dtb_len = len;
+	}
+	if (!(image = fopen(image_path, "rb")) || (image_len = file_size(image)) < 0) {
+		ret = -3;
+		goto out;
+	}
+	if (image_len + dtb_len > vm->cfg.ram_size) {
+		ret = -4;
+		goto out;
+	}
+	// Straight into guest RAM, no copy on the way.
+	if (image_len && fread(vm->mem, image_len, 1, image) != 1) {
+		ret = -5;
+		goto out;
+	}
+	if (!dtb)
+		memcpy(vm->mem + vm->cfg.ram_size - dtb_len, builtin, dtb_len);
+	else if (fread(vm->mem + vm->cfg.ram_size - dtb_len, dtb_len, 1, dtb) != 1) {
+		ret = -6;
+		goto out;
+	}
+	ret = loaded(vm, vm->cfg.ram_size - dtb_len, !dtb);
+out:
+	if (image)
+		fclose(image);
+	if (dtb)
+		fclose(dtb);
+	return ret;
+}
+
+static int loaded(RV32_vm* vm, uint32_t dtb_ofs, int builtin) {
+	if (builtin) {
+		// Update system ram size in DTB (but if and only if we're using the
+		// default DTB) Warning - this will need to be updated if the skeleton
+		// DTB is ever modified.
+		uint32_t* dtb = (uint32_t*)(vm->mem + dtb_ofs);
+		if (dtb[0x13c / 4] == 0x00c0ff03)
+			dtb[0x13c / 4] = __builtin_bswap32(dtb_ofs);
+	}
+	vm->dtb_ofs = dtb_ofs;
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++)
+		RV32_flush_code(vm->harts[i]);
+	RV32_vm_reset(vm);
+	return 0;
+}
+
+void RV32_vm_reset(RV32_vm* vm) {
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++) {
+		RV32_CPU* core = vm->harts[i];
+
+		memset(core->regs, 0, sizeof(core->regs));
+		memset(core->csr, 0, sizeof(core->csr));
+		memset(core->fregs, 0, sizeof(core->fregs));
+		core->lr_addr = core->lr_val = 0;
+		core->msip = 0;
+		core->meip = 0;
+		core->csr[csr_pc] = VM_RAM_BASE;
+		core->regs[10] = i; // hart ID
+		/* dtb_pa (Must be valid pointer) (Should be pointer to dtb) */
+		core->regs[11] = vm->dtb_ofs ? vm->dtb_ofs + VM_RAM_BASE : 0;
+		/* Read only CSRs */
+		core->csr[csr_mvendorid] = 0xff0ff0ff; // mvendorid
+		core->csr[csr_misa] = 0x4054112d; // RV32 IMAFDC (and X), S-mode and U-mode
+		core->csr[csr_mhartid] = i;
+		core->csr[csr_extraflags] = 3; // Machine-mode.
+		// Other harts wait in WFI until hart 0 sends them an IPI.
+		if (i)
+			core->csr[csr_extraflags] |= 4;
+		RV32_flush_tlb(core);
+	}
+	for (uint32_t i = 0; i < vm->nvirtio; i++)
+		RV32_virtio_store(vm->virtio[i].dev, 0x70, 0, 4); // Status 0 resets.
+	plic_reset(vm);
+	vm->clock_start = clock_ns();
+}
+
+void RV32_vm_set_fork_index(RV32_vm* vm, uint32_t index) {
+	vm->fork_index = index;
+}
+
+void* RV32_vm_save_devices(RV32_vm* vm, uint32_t* len) {
+	vm_devices* d = calloc(1, sizeof(vm_devices));
+	vm_plic* plic = &vm->plic;
+
+	if (!d)
+		return NULL;
+	d->nvirtio = vm->nvirtio;
+	pthread_mutex_lock(&plic->lock);
+	memcpy(d->priority, plic->priority, sizeof(d->priority));
+	d->level = plic->level;
+	d->pending = plic->pending;
+	d->claimed = plic->claimed;
+	memcpy(d->enable, plic->enable, sizeof(d->enable));
+	memcpy(d->threshold, plic->threshold, sizeof(d->threshold));
+	pthread_mutex_unlock(&plic->lock);
+	for (uint32_t i = 0; i < vm->nvirtio; i++)
+		RV32_virtio_save(vm->virtio[i].dev, &d->virtio[i]);
+	*len = sizeof(vm_devices);
+	return d;
+}
+
+int RV32_vm_restore_devices(RV32_vm* vm, const void* buf, uint32_t len) {
+	const vm_devices* d = buf;
+	vm_plic* plic = &vm->plic;
+
+	if (len != sizeof(vm_devices) || d->nvirtio != vm->nvirtio)
+		return -1;
+	for (uint32_t i = 0; i < vm->nvirtio; i++)
+		if (RV32_virtio_restore(vm->virtio[i].dev, &d->virtio[i]))
+			return -1;
+	pthread_mutex_lock(&plic->lock);
+	memcpy(plic->priority, d->priority, sizeof(plic->priority));
+	plic->level = d->level;
+	plic->pending = d->pending;
+	plic->claimed = d->claimed;
+	memcpy(plic->enable, d->enable, sizeof(plic->enable));
+	memcpy(plic->threshold, d->threshold, sizeof(plic->threshold));
+	plic_update(vm);
+	pthread_mutex_unlock(&plic->lock);
+	return 0;
+}
+
+int RV32_vm_private_disks(RV32_vm* vm) {
+	for (uint32_t i = 0; i < vm->nvirtio; i++)
+		if (RV32_virtio_blk_private(vm->virtio[i].dev))
+			return -1;
+	return 0;
+}
+
+int32_t RV32_vm_step(RV32_vm* vm, uint32_t hart, uint64_t now, int count) {
+	RV32_CPU* core = vm->harts[hart];
+	int32_t ret;
+
+	core->csr[csr_timerl] = now & UINT32_MAX;
+	core->csr[csr_timerh] = now >> 32;
+	if (hart == 0 && vm->console)
+		RV32_virtio_console_poll(vm->console);
+	// Queued input wakes the console's hart, as a keypress would.
+	if (hart == 0 && (vm->rx_held >= 0 ||
+	                  vm->rx_tail != __atomic_load_n(&vm->rx_head, __ATOMIC_ACQUIRE)))
+		core->csr[csr_extraflags] &= ~4;
+	ret = vm->step(core, step_budget(vm, core, now, count));
+	if (ret == RV32_VM_IDLE)
+		vm->pace[hart].now = 0; // Time asleep says nothing about speed.
+	return ret;
+}
+
+int32_t RV32_vm_run(RV32_vm* vm, uint64_t insns) {
+	for (uint64_t done = 0; done < insns;) {
+		int count = insns - done < VM_QUANTUM ? insns - done : VM_QUANTUM;
+		uint64_t now = RV32_vm_time(vm);
+		int idle = 1;
+
+		for (uint32_t i = 0; i < vm->cfg.nharts; i++) {
+			int32_t ret = RV32_vm_step(vm, i, now, count);
+			if (ret == RV32_VM_IDLE)
+				continue;
+			if (ret)
+				return ret;
+			idle = 0;
+		}
+		if (idle)
+			return RV32_VM_IDLE;
+		done += count;
+	}
+	return RV32_VM_RUNNING;
+}
+
+size_t RV32_vm_input(RV32_vm* vm, const void* buf, size_t len) {
+	uint32_t head = vm->rx_head;
+	uint32_t tail = __atomic_load_n(&vm->rx_tail, __ATOMIC_ACQUIRE);
+	size_t n;
+
+	for (n = 0; n < len && head - tail < VM_RX_SIZE; n++)
+		vm->rx[head++ & (VM_RX_SIZE - 1)] = ((const uint8_t*)buf)[n];
+	__atomic_store_n(&vm->rx_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+int RV32_vm_attach(RV32_vm* vm, uint32_t base, uint32_t size,
+                   uint32_t (*load)(void* opaque, uint32_t addr, int size),
+                   uint32_t (*store)(void* opaque, uint32_t addr, uint32_t val, int size),
+                   void* opaque) {
+	RV32_device dev = {base, size, load, store, opaque};
+
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++)
+		if (RV32_attach_device(vm->harts[i], &dev))
+			return -1;
+	return 0;
+}
+
+int RV32_vm_attach_disk(RV32_vm* vm, const char* path, int readonly) {
+	RV32_virtio_host host;
+	vm_virtio* slot = virtio_slot(vm, &host);
+
+	if (!slot)
+		return -1;
+	if (!(slot->dev = RV32_virtio_blk(&host, path, readonly)))
+		return -2;
+	return attach_virtio(vm, slot);
+}
+
+int RV32_vm_attach_console(RV32_vm* vm) {
+	RV32_virtio_host host;
+	vm_virtio* slot = virtio_slot(vm, &host);
+
+	if (!slot || !(slot->dev = RV32_virtio_console(&host, console_write, console_read, vm)))
+		return -1;
+	if (attach_virtio(vm, slot))
+		return -1;
+	vm->console = slot->dev;
+	return 0;
+}
+
+uint64_t RV32_vm_time(RV32_vm* vm) {
+	return (clock_ns() - vm->clock_start) / 1000;
+}
+
+uint64_t RV32_vm_next_timer(RV32_vm* vm) {
+	uint64_t next = 0;
+
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++) {
+		const RV32_CPU* core = vm->harts[i];
+		uint64_t match = ((uint64_t)core->csr[csr_timermatchh] << 32) |
+		                 core->csr[csr_timermatchl];
+		if (match && (!next || match < next))
+			next = match;
+	}
+	return next;
+}
+
+uint64_t RV32_vm_insns(RV32_vm* vm) {
+	uint64_t insns = 0;
+
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++)
+		insns += vm->harts[i]->csr[csr_cyclel] | ((uint64_t)vm->harts[i]->csr[csr_cycleh] << 32);
+	return insns;
+}
+
+uint32_t RV32_vm_nharts(RV32_vm* vm) {
+	return vm->cfg.nharts;
+}
+
+RV32_CPU* const* RV32_vm_harts(RV32_vm* vm) {
+	return vm->harts;
+}
+
+// count, or fewer so the step ends about when the timer fires: the engines
+// only sample the clock between steps.
+static int step_budget(RV32_vm* vm, RV32_CPU* core, uint64_t now, int count) {
+	vm_pace* p = &vm->pace[core->hartid];
+	uint64_t cycle = core->csr[csr_cyclel] | ((uint64_t)core->csr[csr_cycleh] << 32);
+	uint64_t match = core->csr[csr_timermatchl] | ((uint64_t)core->csr[csr_timermatchh] << 32);
+	uint64_t until;
+
+	if (!p->now || now < p->now) {
+		p->now = now;
+		p->cycle = cycle;
+	} else if (now - p->now >= VM_PACE_US) {
+		uint64_t rate = (cycle - p->cycle) * 1024 / (now - p->now);
+		p->rate = p->rate ? (p->rate * 7 + rate) / 8 : rate;
+		p->now = now;
+		p->cycle = cycle;
+	}
+	if (!p->rate || match < now || !(core->csr[csr_mie] & (1 << 7)))
+		return count;
+	if (match - now > UINT32_MAX)
+		return count;
+	until = (match - now + 1) * p->rate / 1024; // It fires once past match.
+	if (until >= (uint64_t)count)
+		return count;
+	return until < VM_STEP_MIN ? VM_STEP_MIN : until;
+}
+
+static uint64_t clock_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long file_size(FILE* f) {
+	long size;
+
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+		return -1;
+	return size;
+}
+
+static int rx_ready(RV32_vm* vm) {
+	uint8_t c;
+
+	if (vm->rx_held >= 0 || vm->rx_tail != __atomic_load_n(&vm->rx_head, __ATOMIC_ACQUIRE))
+		return 1;
+	if (vm->cfg.console_in && vm->cfg.console_in(vm->cfg.opaque, &c, 1) == 1) {
+		vm->rx_held = c;
+		return 1;
+	}
+	return 0;
+}
+
+// Emulating a 8250 / 16550 UART
+static uint32_t uart_load(void* opaque, uint32_t addr, int size) {
+	RV32_vm* vm = opaque;
+	uint32_t c;
+
+	if (addr == 5)
+		return 0x60 | rx_ready(vm);
+	if (addr != 0 || !rx_ready(vm))
+		return 0;
+	if (vm->rx_held >= 0) {
+		c = vm->rx_held;
+		vm->rx_held = -1;
+		return c;
+	}
+	c = vm->rx[vm->rx_tail & (VM_RX_SIZE - 1)];
+	__atomic_store_n(&vm->rx_tail, vm->rx_tail + 1, __ATOMIC_RELEASE);
+	return c;
+}
+
+static uint32_t uart_store(void* opaque, uint32_t addr, uint32_t val, int size) {
+	RV32_vm* vm = opaque;
+	uint8_t c = val;
+
+	if (addr == 0 && vm->cfg.console_out) // Data Buffer
+		vm->cfg.console_out(vm->cfg.opaque, &c, 1);
+	return 0;
+}
+
+static void console_write(void* opaque, const uint8_t* buf, size_t len) {
+	RV32_vm* vm = opaque;
+
+	if (vm->cfg.console_out)
+		vm->cfg.console_out(vm->cfg.opaque, buf, len);
+}
+
+// Input for the virtio console, from wherever the UART would take it.
+static size_t console_read(void* opaque, uint8_t* buf, size_t len) {
+	RV32_vm* vm = opaque;
+	uint32_t tail = vm->rx_tail;
+	uint32_t head = __atomic_load_n(&vm->rx_head, __ATOMIC_ACQUIRE);
+	size_t n = 0;
+
+	if (vm->rx_held >= 0 && len) {
+		buf[n++] = vm->rx_held;
+		vm->rx_held = -1;
+	}
+	while (n < len && tail != head)
+		buf[n++] = vm->rx[tail++ & (VM_RX_SIZE - 1)];
+	__atomic_store_n(&vm->rx_tail, tail, __ATOMIC_RELEASE);
+	if (n < len && vm->cfg.console_in)
+		n += vm->cfg.console_in(vm->cfg.opaque, buf + n, len - n);
+	return n;
+}
+
+static uint32_t syscon_load(void* opaque, uint32_t addr, int size) {
+	RV32_vm* vm = opaque;
+
+	return addr == 4 ? vm->fork_index : 0;
+}
+
+// SYSCON (reboot, poweroff, etc.), handed back to the host through RV32_step.
+static uint32_t syscon_store(void* opaque, uint32_t addr, uint32_t val, int size) {
+	if (val == 0x5555)
+		return RV32_VM_POWEROFF;
+	if (val == 0x7777)
+		return RV32_VM_RESTART;
+	if (val == 0x6666)
+		return RV32_VM_SNAPSHOT; // Snapshot, then carry on
+	if (val == 0x8888)
+		return RV32_VM_FORK; // Clone the machine, then carry on
+	if ((val & 0xffff) == 0x3333)
+		return val; // Poweroff with an exit code in the top half
+	return 0;
+}
+
+// https://github.com/riscv/riscv-plic-spec: priorities at 0x0, pending
+// bits at 0x1000, enable bits per context at 0x2000, then threshold and
+// claim/complete per context at 0x200000. Context n is hart n's M-mode.
+static void plic_update(RV32_vm* vm) {
+	vm_plic* plic = &vm->plic;
+
+	for (uint32_t ctx = 0; ctx < vm->cfg.nharts; ctx++) {
+		RV32_CPU* hart = vm->harts[ctx];
+		uint32_t ready = plic->pending & plic->enable[ctx], meip = 0;
+
+		for (uint32_t irq = 1; irq < VM_PLIC_SOURCES && !meip; irq++)
+			meip = (ready & (1u << irq)) && plic->priority[irq] > plic->threshold[ctx];
+		if (__atomic_exchange_n(&hart->meip, meip, __ATOMIC_ACQ_REL) == meip)
+			continue;
+		// Like the CLINT: a hart on this thread sees the change at once,
+		// one on a thread of its own at its next block.
+		if (hart == RV32_current())
+			RV32_update_timer(hart);
+		else
+			RV32_post(hart, RV32_POST_IRQ);
+	}
+}
+
+static void plic_reset(RV32_vm* vm) {
+	vm_plic* plic = &vm->plic;
+
+	pthread_mutex_lock(&plic->lock);
+	memset(plic->priority, 0, sizeof(plic->priority));
+	memset(plic->enable, 0, sizeof(plic->enable));
+	memset(plic->threshold, 0, sizeof(plic->threshold));
+	plic->claimed = 0;
+	plic->pending = plic->level;
+	pthread_mutex_unlock(&plic->lock);
+}
+
+// Highest priority source ready for a context, ties to the lowest number.
+static uint32_t plic_claim(vm_plic* plic, uint32_t ctx) {
+	uint32_t ready = plic->pending & plic->enable[ctx], best = 0;
+
+	for (uint32_t irq = 1; irq < VM_PLIC_SOURCES; irq++)
+		if ((ready & (1u << irq)) && plic->priority[irq] > plic->threshold[ctx] &&
+		    (!best || plic->priority[irq] > plic->priority[best]))
+			best = irq;
+	plic->pending &= ~(1u << best);
+	plic->claimed |= (1u << best) & ~1u;
+	return best;
+}
+
+static uint32_t plic_load(void* opaque, uint32_t addr, int size) {
+	RV32_vm* vm = opaque;
+	vm_plic* plic = &vm->plic;
+	uint32_t ctx, val = 0;
+
+	pthread_mutex_lock(&plic->lock);
+	if (addr < 4 * VM_PLIC_SOURCES) {
+		val = plic->priority[addr >> 2];
+	} else if (addr == 0x1000) {
+		val = plic->pending;
+	} else if (addr >= 0x2000 && addr < 0x200000) {
+		ctx = (addr - 0x2000) >> 7;
+		if (ctx < vm->cfg.nharts && !(addr & 0x7f))
+			val = plic->enable[ctx];
+	} else if (addr >= 0x200000 && (ctx = (addr - 0x200000) >> 12) < vm->cfg.nharts) {
+		if ((addr & 0xfff) == 0) {
+			val = plic->threshold[ctx];
+		} else if ((addr & 0xfff) == 4) {
+			val = plic_claim(plic, ctx);
+			plic_update(vm);
+		}
+	}
+	pthread_mutex_unlock(&plic->lock);
+	return val;
+}
+
+static uint32_t plic_store(void* opaque, uint32_t addr, uint32_t val, int size) {
+	RV32_vm* vm = opaque;
+	vm_plic* plic = &vm->plic;
+	uint32_t ctx;
+
+	pthread_mutex_lock(&plic->lock);
+	if (addr < 4 * VM_PLIC_SOURCES) {
+		if (addr)
+			plic->priority[addr >> 2] = val & 7;
+	} else if (addr >= 0x2000 && addr < 0x200000) {
+		ctx = (addr - 0x2000) >> 7;
+		if (ctx < vm->cfg.nharts && !(addr & 0x7f))
+			plic->enable[ctx] = val & ~1u;
+	} else if (addr >= 0x200000 && (ctx = (addr - 0x200000) >> 12) < vm->cfg.nharts) {
+		if ((addr & 0xfff) == 0) {
+			plic->threshold[ctx] = val & 7;
+		} else if ((addr & 0xfff) == 4 && val && val < VM_PLIC_SOURCES) {
+			// Complete: a line still high is pending again.
+			plic->claimed &= ~(1u << val);
+			plic->pending |= plic->level & (1u << val);
+		}
+	}
+	plic_update(vm);
+	pthread_mutex_unlock(&plic->lock);
+	return 0;
+}
+
+// Level triggered: a source stays pending while the line is high, except
+// between its claim and completion.
+static void virtio_irq(void* opaque, int level) {
+	vm_virtio* slot = opaque;
+	vm_plic* plic = &slot->vm->plic;
+	uint32_t bit = 1u << slot->irq;
+
+	pthread_mutex_lock(&plic->lock);
+	if (level) {
+		plic->level |= bit;
+		if (!(plic->claimed & bit))
+			plic->pending |= bit;
+	} else {
+		plic->level &= ~bit;
+		plic->pending &= ~bit;
+	}
+	plic_update(slot->vm);
+	pthread_mutex_unlock(&plic->lock);
+}
+
+// The next free slot, with the host side of its device filled in.
+static vm_virtio* virtio_slot(RV32_vm* vm, RV32_virtio_host* host) {
+	vm_virtio* slot = &vm->virtio[vm->nvirtio];
+
+	if (vm->nvirtio == VM_VIRTIO_MAX)
+		return NULL;
+	slot->vm = vm;
+	slot->irq = vm->nvirtio + 1;
+	*host = (RV32_virtio_host){vm->mem, VM_RAM_BASE, vm->cfg.ram_size, virtio_irq,
+	                           virtio_written, slot};
+	return slot;
+}
+
+// Puts the slot's device on the bus and in the DTB.
+static int attach_virtio(RV32_vm* vm, vm_virtio* slot) {
+	uint32_t base = VM_VIRTIO_BASE + vm->nvirtio * RV32_VIRTIO_SIZE;
+
+	if (RV32_vm_attach(vm, base, RV32_VIRTIO_SIZE, RV32_virtio_load, RV32_virtio_store,
+	                   slot->dev)) {
+		RV32_virtio_free(slot->dev);
+		return -1;
+	}
+	vm->nvirtio++;
+	return build_dtb(vm);
+}
+
+// Device DMA into RAM that may hold code. Harts on threads of their own
+// are left alone: the guest runs FENCE.I on every hart before it executes
+// what it loaded, and on those that flushes everything.
+static void virtio_written(void* opaque, uint32_t ofs, uint32_t len) {
+	RV32_vm* vm = ((vm_virtio*)opaque)->vm;
+
+	for (uint32_t i = 0; i < vm->cfg.nharts; i++)
+		if (!vm->harts[i]->kick || vm->harts[i] == RV32_current())
+			RV32_invalidate_code(vm->harts[i], ofs, len);
+}
+
+static const uint8_t* builtin_dtb(RV32_vm* vm, size_t* len) {
+	if (vm->dtb) {
+		*len = vm->dtb_len;
+		return vm->dtb;
+	}
+	*len = _binary_sixtyfourmb_dtb_end - _binary_sixtyfourmb_dtb_start;
+	return _binary_sixtyfourmb_dtb_start;
+}
+
+/* Just enough of a flattened device tree writer to add nodes to /soc.
+ * https://devicetree-specification.readthedocs.io/en/stable/flattened-format.html */
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE 2
+#define FDT_PROP 3
+#define FDT_NOP 4
+#define FDT_END 9
+
+typedef struct fdt_out {
+	const char* strings; // Existing strings block.
+	uint32_t strings_len;
+	uint8_t st[2048]; // New structure bytes.
+	uint32_t nst;
+	char str[256]; // Names to add to the strings block.
+	uint32_t nstr;
+	int full;
+} fdt_out;
+
+static uint32_t be32(const uint8_t* p) {
+	return __builtin_bswap32(*(const uint32_t*)p);
+}
+
+static void fdt_bytes(fdt_out* f, const void* p, uint32_t len) {
+	uint32_t pad = (4 - (len & 3)) & 3;
+
+	if (f->nst + len + pad > sizeof(f->st)) {
+		f->full = 1;
+		return;
+	}
+	if (len)
+		memcpy(f->st + f->nst, p, len);
+	memset(f->st + f->nst + len, 0, pad);
+	f->nst += len + pad;
+}
+
+static void fdt_u32(fdt_out* f, uint32_t v) {
+	v = __builtin_bswap32(v);
+	fdt_bytes(f, &v, 4);
+}
+
+// Offset of a property name in the strings block, added if it is new.
+static uint32_t fdt_string(fdt_out* f, const char* name) {
+	uint32_t len = strlen(name) + 1;
+
+	for (uint32_t i = 0; i + len <= f->strings_len; i++)
+		if (!memcmp(f->strings + i, name, len) && (!i || !f->strings[i - 1]))
+			return i;
+	for (uint32_t i = 0; i + len <= f->nstr; i += strlen(f->str + i) + 1)
+		if (!memcmp(f->str + i, name, len))
+			return f->strings_len + i;
+	if (f->nstr + len > sizeof(f->str)) {
+		f->full = 1;
+		return 0;
+	}
+	memcpy(f->str + f->nstr, name, len);
+	f->nstr += len;
+	return f->strings_len + f->nstr - len;
+}
+
+static void fdt_prop(fdt_out* f, const char* name, const void* val, uint32_t len) {
+	fdt_u32(f, FDT_PROP);
+	fdt_u32(f, len);
+	fdt_u32(f, fdt_string(f, name));
+	fdt_bytes(f, val, len);
+}
+
+static void fdt_cells(fdt_out* f, const char* name, const uint32_t* cells, uint32_t n) {
+	uint32_t be[8];
+
+	for (uint32_t i = 0; i < n; i++)
+		be[i] = __builtin_bswap32(cells[i]);
+	fdt_prop(f, name, be, 4 * n);
+}
+
+static void fdt_begin(fdt_out* f, const char* name) {
+	fdt_u32(f, FDT_BEGIN_NODE);
+	fdt_bytes(f, name, strlen(name) + 1);
+}
+
+// Rebuilds vm->dtb: the built-in DTB with riscv,isa saying what the harts
+// implement, and the PLIC and a virtio-mmio node per device at the end of
+// /soc once there are any.
+static int build_dtb(RV32_vm* vm) {
+	const uint8_t* base = _binary_sixtyfourmb_dtb_start;
+	uint32_t off_struct = be32(base + 8), off_strings = be32(base + 12);
+	uint32_t size_strings = be32(base + 32), size_struct = be32(base + 36);
+	uint32_t p = off_struct, depth = 0, soc = 0, insert = 0, isa = 0, isa_len = 0;
+	uint32_t new_len = (sizeof(VM_ISA) + 3) & ~3, shift, grow;
+	fdt_out* f = calloc(1, sizeof(fdt_out));
+	char name[32];
+	uint8_t* dtb;
+	size_t len;
+
+	if (!f)
+		return -1;
+	// Find where /soc ends.
+	while (!insert && p < off_struct + size_struct) {
+		uint32_t token = be32(base + p);
+		p += 4;
+		switch (token) {
+		case FDT_BEGIN_NODE:
+			if (++depth == 2 && !strcmp((const char*)base + p, "soc"))
+				soc = 1;
+			p += (strlen((const char*)base + p) + 4) & ~3;
+			break;
+		case FDT_END_NODE:
+			if (depth-- == 2 && soc)
+				insert = p - 4;
+			break;
+		case FDT_PROP:
+			if (!isa && !strcmp((const char*)base + off_strings + be32(base + p + 4),
+			                    "riscv,isa")) {
+				isa = p - 4;
+				isa_len = (be32(base + p) + 3) & ~3;
+			}
+			p += 8 + ((be32(base + p) + 3) & ~3);
+			break;
+		case FDT_NOP:
+			break;
+		default:
+			p = off_struct + size_struct;
+			break;
+		}
+	}
+	if (!insert || !isa || isa > insert || off_strings < off_struct + size_struct) {
+		free(f);
+		return -1;
+	}
+
+	f->strings = (const char*)base + off_strings;
+	f->strings_len = size_strings;
+	if (!vm->nvirtio)
+		goto nodes_done;
+	snprintf(name, sizeof(name), "plic@%x", VM_PLIC_BASE);
+	fdt_begin(f, name);
+	fdt_prop(f, "compatible", "sifive,plic-1.0.0\0riscv,plic0", 31);
+	fdt_cells(f, "reg", (uint32_t[]){0, VM_PLIC_BASE, 0, VM_PLIC_SIZE}, 4);
+	fdt_cells(f, "#interrupt-cells", (uint32_t[]){1}, 1);
+	fdt_prop(f, "interrupt-controller", NULL, 0);
+	fdt_cells(f, "riscv,ndev", (uint32_t[]){VM_PLIC_SOURCES - 1}, 1);
+	// Hart 0's interrupt controller, machine external interrupt.
+	fdt_cells(f, "interrupts-extended", (uint32_t[]){2, 11}, 2);
+	fdt_cells(f, "phandle", (uint32_t[]){VM_PLIC_PHANDLE}, 1);
+	fdt_u32(f, FDT_END_NODE);
+	for (uint32_t i = 0; i < vm->nvirtio; i++) {
+		uint32_t base_addr = VM_VIRTIO_BASE + i * RV32_VIRTIO_SIZE;
+
+		snprintf(name, sizeof(name), "virtio_mmio@%x", base_addr);
+		fdt_begin(f, name);
+		fdt_prop(f, "compatible", "virtio,mmio", 12);
+		fdt_cells(f, "reg", (uint32_t[]){0, base_addr, 0, RV32_VIRTIO_SIZE}, 4);
+		fdt_cells(f, "interrupt-parent", (uint32_t[]){VM_PLIC_PHANDLE}, 1);
+		fdt_cells(f, "interrupts", (uint32_t[]){vm->virtio[i].irq}, 1);
+		fdt_u32(f, FDT_END_NODE);
+	}
+nodes_done:
+	if (f->full) {
+		free(f);
+		return -1;
+	}
+
+	// Header and structure up to riscv,isa, the new string, on to the end
+	// of /soc, the new nodes, the rest, then the strings with the new names
+	// after them. shift is how much the string moves what follows it.
+	shift = new_len - isa_len;
+	grow = shift + f->nst;
+	len = off_strings + grow + size_strings + f->nstr;
+	if (!(dtb = calloc(1, (len + 7) & ~7))) {
+		free(f);
+		return -1;
+	}
+	memcpy(dtb, base, isa + 12);
+	*(uint32_t*)(dtb + isa + 4) = __builtin_bswap32(sizeof(VM_ISA));
+	memcpy(dtb + isa + 12, VM_ISA, sizeof(VM_ISA));
+	memcpy(dtb + isa + 12 + new_len, base + isa + 12 + isa_len, insert - isa - 12 - isa_len);
+	memcpy(dtb + insert + shift, f->st, f->nst);
+	memcpy(dtb + insert + grow, base + insert, off_strings - insert);
+	memcpy(dtb + off_strings + grow, base + off_strings, size_strings);
+	memcpy(dtb + off_strings + grow + size_strings, f->str, f->nstr);
+	len = (len + 7) & ~7;
+	*(uint32_t*)(dtb + 4) = __builtin_bswap32(len);
+	*(uint32_t*)(dtb + 12) = __builtin_bswap32(off_strings + grow);
+	*(uint32_t*)(dtb + 32) = __builtin_bswap32(size_strings + f->nstr);
+	*(uint32_t*)(dtb + 36) = __builtin_bswap32(size_struct + grow);
+	free(f);
+	free(vm->dtb);
+	vm->dtb = dtb;
+	vm->dtb_len = len;
+	return 0;
+}
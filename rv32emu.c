@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -8,37 +9,128 @@
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/ioctl.h>
-#include <sys/time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
 
 #include "riscv-emu.h"
+#include "librv32emu.h"
 
 extern char *optarg;
 
-extern const unsigned char _binary_sixtyfourmb_dtb_start[], _binary_sixtyfourmb_dtb_end[];
-/* Hack to get around gcc weirdness */
-#define _binary_sixtyfourmb_dtb_size (_binary_sixtyfourmb_dtb_end - _binary_sixtyfourmb_dtb_start)
-
 #define MINIRV32_RAM_IMAGE_OFFSET 0x80000000
+#define IO_RING_SIZE 262144 // Console output per hart, a power of two.
+#define IO_LINGER_MS 1 // How long the I/O thread stays awake for more output.
+
+// Console output from one hart thread to the I/O thread. Head and tail
+// run free.
+typedef struct io_ring {
+	uint8_t buf[IO_RING_SIZE];
+	uint32_t head, tail;
+} io_ring;
 
 static void DumpState(RV32_CPU* core);
 static uint64_t GetTimeMicroseconds();
 static void exit_now();
-static size_t get_Fsize(FILE* fno);
-static int populate_ram(RV32_CPU* core, const char* F_dtb, const char* F_kern, size_t *dtb_location);
+static void wait_for_interrupt(RV32_CPU* core, uint64_t now);
+static int run_hart(RV32_CPU* core);
+static void* hart_thread(void* arg);
+static void kick_hart(RV32_CPU* hart);
+static void request_snapshot(int sig);
+static void take_snapshot(void);
+static void pause_others(void);
+static void resume_others(void);
+static void park_hart(RV32_CPU* core);
+static void request_fork(void);
+static void fork_machine(void);
+static void start_clone(uint32_t index);
+static int guest_status(int ret);
+static void read_control(void);
+static void control_command(const char* cmd);
+#ifdef RV32_STATS
+static void request_stats(int sig);
+static void dump_stats(void);
+static uint64_t stats_clock(void);
+#endif
 static void help(int code);
+static int run_fleet(const char* manifest, uint32_t workers, int engine);
+static int cmp_u64(const void* a, const void* b);
+static void console_out(void* opaque, const uint8_t* buf, size_t len);
+static void* io_thread(void* arg);
+static void wake_io(void);
+static int io_queued(void);
+static int io_drain(void);
+static void io_flush(void);
 
-RV32_CPU global_cpu_state;
+static RV32_vm* vm;
+static RV32_CPU* const* harts; // RV32_vm_harts(vm)
+static int wake_fd[RV32_MAX_HARTS]; // eventfd per hart, written by kick_hart.
+static uint32_t nharts = 1;
+static uint64_t isr_per = 1000000; // -i: most instructions per step, the timer cuts it shorter.
+static uint64_t insn_budget; // -n: power off once a hart has run this many, 0 for no limit.
+static uint64_t time_start, time_idle; // Microseconds, idle summed over harts.
+static uint64_t time_run; // When the harts started, time_start is the guest's zero.
+static uint64_t sleeping_since[RV32_MAX_HARTS]; // Start of the WFI wait, 0 when awake.
+static int watch_stdin = 1; // Cleared by the I/O thread once stdin hits EOF.
+// The terminal is served by its own thread, so the harts never make a
+// syscall for the UART: output goes through a ring per hart, input through
+// the machine's own queue (RV32_vm_input).
+static io_ring tx[RV32_MAX_HARTS];
+static _Thread_local uint32_t this_hart; // Whose ring console_out fills.
+static int io_wake; // eventfd, written when output lands while the I/O thread sleeps.
+static int io_sleeping; // Set while the I/O thread waits without a timeout.
+// -p: sample every prof_period instructions, folded stacks to profile_file at exit.
+static RV32_profile* prof;
+static const char* profile_file;
+static uint64_t prof_period = 10007; // Prime, so as not to beat with guest loops.
+// Snapshots: SIGUSR2 or the SYSCON device ask hart 0 to write one between
+// steps, while every other hart waits in park_hart.
+static const char* snapshot_file = "rv32emu.snap";
+static volatile sig_atomic_t snapshot_requested;
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static int pause_harts; // Set while hart 0 takes a snapshot.
+static uint32_t paused; // Harts parked so far.
+// -F: at a fork request, from the guest's SYSCON or the control pipe, hart
+// 0 clones the whole process this many times. Clone n writes its console to
+// fork_output.n and reads fork_input.n, and the original waits for them all
+// and reports how they exited.
+static uint32_t fork_count;
+static const char* fork_output = "rv32emu.fork";
+static const char* fork_input; // NULL: clones read /dev/null.
+static int ctl_fd = -1; // -C: commands for the I/O thread, see control_command.
+static volatile sig_atomic_t fork_requested;
+static int exit_code; // exit_now's status, from a guest that powers off failing.
+#ifdef RV32_STATS
+static volatile sig_atomic_t stats_requested; // SIGUSR1: hart 0 prints the counters.
+#endif
 
 int main(int argc, char** argv) {
 	int opt, err;
-	size_t dtb_location = 0;
 	uint32_t ram_amt = 64 * 1024 * 1024;
-	uint64_t isr_per = 100000;
 	const char* image_file_name = NULL;
 	const char* dtb_file_name = NULL;
+	const char* restore_file = NULL;
+	const char* manifest = NULL;
+	uint32_t workers = 0;
+	const char* disks[8];
+	uint32_t ndisks = 0;
+	int virtio_console = 0;
+	const char* symbols = NULL;
+	RV32_snapshot snap;
+	int engine = RV32_ENGINE_STEP;
+	int hugepages = 0;
+	pthread_t thread, io;
 	signal(SIGINT, exit_now);
-	while ((opt = getopt(argc, argv, "hk:b:r:")) != -1)
+	signal(SIGUSR2, request_snapshot);
+#ifdef RV32_STATS
+	signal(SIGUSR1, request_stats);
+#endif
+	while ((opt = getopt(argc, argv, "hk:b:r:i:tjJHc:s:l:n:f:w:D:Vp:P:y:F:O:I:C:")) != -1)
 	{
 		switch (opt)
 		{
@@ -51,6 +143,104 @@ int main(int argc, char** argv) {
 			case 'b':
 				dtb_file_name = optarg;
 				break;
+			case 't':
+				engine = RV32_ENGINE_BLOCKS;
+				break;
+			case 'j':
+				engine = RV32_ENGINE_JIT;
+				break;
+			case 'J':
+				engine = RV32_ENGINE_JIT_LOCKSTEP;
+				break;
+			case 'H':
+				hugepages = 1;
+				break;
+			case 's':
+				snapshot_file = optarg;
+				break;
+			case 'l':
+				restore_file = optarg;
+				break;
+			case 'f':
+				manifest = optarg;
+				break;
+			case 'w':
+				workers = strtol(optarg, NULL, 0);
+				break;
+			case 'D':
+				if (ndisks == sizeof(disks) / sizeof(disks[0]))
+				{
+					printf("too many -%c", opt);
+					help(EXIT_FAILURE);
+				}
+				disks[ndisks++] = optarg;
+				break;
+			case 'V':
+				virtio_console = 1;
+				break;
+			case 'p':
+				profile_file = optarg;
+				break;
+			case 'y':
+				symbols = optarg;
+				break;
+			case 'O':
+				fork_output = optarg;
+				break;
+			case 'I':
+				fork_input = optarg;
+				break;
+			case 'C':
+				// Read and write, so the pipe stays open between writers.
+				if ((ctl_fd = open(optarg, O_RDWR | O_NONBLOCK)) < 0) {
+					fprintf(stderr, "Error: Could not open: \"%s\"\n", optarg);
+					return -2;
+				}
+				break;
+			case 'F':
+			{
+				char* end;
+				errno = 0;
+				fork_count = strtoul(optarg, &end, 0);
+				if (errno || end == optarg || *end || fork_count > 4096)
+				{
+					printf("invalid value for -%c", opt);
+					help(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'P':
+			{
+				char* end;
+				errno = 0;
+				prof_period = strtoull(optarg, &end, 0);
+				if (errno || end == optarg || *end || !prof_period)
+				{
+					printf("invalid value for -%c", opt);
+					help(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'n':
+			{
+				char* end;
+				errno = 0;
+				insn_budget = strtoull(optarg, &end, 0);
+				if (errno || end == optarg || *end)
+				{
+					printf("invalid value for -%c", opt);
+					help(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'c':
+				nharts = strtol(optarg, NULL, 0);
+				if (nharts < 1 || nharts > RV32_MAX_HARTS)
+				{
+					printf("invalid value for -%c", opt);
+					help(EXIT_FAILURE);
+				}
+				break;
 			case 'r':
 			{
 				errno = 0;
@@ -65,10 +255,10 @@ int main(int argc, char** argv) {
 			}
 			case 'i':
 			{
+				char* end;
 				errno = 0;
-				/* FIXME: doesn't check for invalid numbers correctly */
-				isr_per = strtol(optarg, NULL, 16);
-				if (errno)
+				isr_per = strtoull(optarg, &end, 0);
+				if (errno || end == optarg || *end || !isr_per || isr_per > INT32_MAX)
 				{
 					printf("invalid value for -%c", opt);
 					help(EXIT_FAILURE);
@@ -80,131 +270,496 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if(!image_file_name){
+	if (manifest)
+		return run_fleet(manifest, workers, engine);
+
+	if (profile_file && !(prof = RV32_profile_create(symbols))) {
+		fprintf(stderr, "Error: could not read symbols from \"%s\".\n", symbols);
+		return -2;
+	}
+
+	if (restore_file) {
+		if (RV32_snapshot_open(&snap, restore_file)) {
+			fprintf(stderr, "Error: \"%s\" is not a snapshot.\n", restore_file);
+			return -2;
+		}
+		// The snapshot decides the machine: -k, -b, -r and -c do not apply.
+		// -D and -V do, the same as when it was saved, for the device state.
+		nharts = snap.nharts;
+		ram_amt = snap.total_mem;
+	}
+
+	if (engine == RV32_ENGINE_JIT_LOCKSTEP && nharts > 1) {
+		// Replaying a block is only meaningful when no one else writes RAM.
+		puts("Error: -J needs a single hart\n");
+		help(EXIT_FAILURE);
+	}
+
+	if(!image_file_name && !restore_file){
 		puts("Error: The '-k' parameter is required\n");
 		help(EXIT_FAILURE);
 	}
 
-	global_cpu_state.total_mem = ram_amt;
-	global_cpu_state.mem = malloc(ram_amt);
-	if (!global_cpu_state.mem) {
-		fprintf(stderr, "Error: could not allocate system image.\n");
+	vm = RV32_vm_create(&(RV32_vm_config){ram_amt, nharts, engine, hugepages, console_out,
+	                                      NULL, NULL});
+	if (!vm) {
+		fprintf(stderr, "Error: could not set up the machine.\n");
 		return -4;
 	}
-	err = populate_ram(&global_cpu_state, dtb_file_name,image_file_name,&dtb_location);
-	if(err)
+	harts = RV32_vm_harts(vm);
+	for (uint32_t i = 0; i < ndisks; i++) {
+		if (RV32_vm_attach_disk(vm, disks[i], 0)) {
+			fprintf(stderr, "Error: Could not attach disk: \"%s\"\n", disks[i]);
+			return -2;
+		}
+	}
+	if (virtio_console && RV32_vm_attach_console(vm)) {
+		fprintf(stderr, "Error: Could not attach the virtio console.\n");
+		return -2;
+	}
+	// Harts sleep in WFI until kicked, by another hart or by the I/O thread
+	// with input for hart 0.
+	for (uint32_t i = 0; i < nharts; i++) {
+		if (nharts > 1)
+			harts[i]->kick = kick_hart;
+		if ((wake_fd[i] = eventfd(0, EFD_NONBLOCK)) < 0) {
+			fprintf(stderr, "Error: could not create eventfd.\n");
+			return -4;
+		}
+	}
+	if ((io_wake = eventfd(0, EFD_NONBLOCK)) < 0 ||
+	    pthread_create(&io, NULL, io_thread, NULL)) {
+		fprintf(stderr, "Error: could not start the I/O thread.\n");
+		return -4;
+	}
+	if (restore_file) {
+		if (RV32_snapshot_restore(&snap, harts)) {
+			fprintf(stderr, "Error: could not restore \"%s\".\n", restore_file);
+			return -4;
+		}
+		if (RV32_vm_restore_devices(vm, snap.devices, snap.devices_len)) {
+			fprintf(stderr, "Error: \"%s\" was saved with other devices: pass the same -D and -V.\n",
+			        restore_file);
+			return -4;
+		}
+		free(snap.devices);
+		// Carry on the guest clock from where the snapshot stopped it.
+		time_start = GetTimeMicroseconds() -
+		             (((uint64_t)harts[0]->csr[csr_timerh] << 32) | harts[0]->csr[csr_timerl]);
+		goto resume;
+	}
+	err = RV32_vm_load_files(vm, image_file_name, dtb_file_name);
+	if (err) {
+		if (err == -4)
+			fprintf(stderr, "Error: Could not fit the kernel and dtb into ram: %d.\n", ram_amt);
+		else
+			fprintf(stderr, "Error: Could not load: \"%s\"\n",
+			        err == -2 || err == -6 ? dtb_file_name : image_file_name);
 		return err;
+	}
 
 restart :
-	global_cpu_state.base_ofs = MINIRV32_RAM_IMAGE_OFFSET;
-	global_cpu_state.csr[csr_pc] = MINIRV32_RAM_IMAGE_OFFSET;
-	global_cpu_state.regs[10] = 0x00; // hart ID
-	/* dtb_pa (Must be valid pointer) (Should be pointer to dtb) */
-	global_cpu_state.regs[11] = dtb_location ? (dtb_location + MINIRV32_RAM_IMAGE_OFFSET) : 0;
-	/* Read only CSRs */
-	global_cpu_state.csr[csr_mvendorid] = 0xff0ff0ff; // mvendorid
-	global_cpu_state.csr[csr_misa] = 0x40401101; // marchid
-	global_cpu_state.csr[csr_extraflags] = 3; // Machine-mode.
-
-	if (dtb_file_name == 0) {
-		// Update system ram size in DTB (but if and only if we're using the default
-		// DTB) Warning - this will need to be updated if the skeleton DTB is ever
-		// modified.
-		uint32_t* dtb = (uint32_t*)(global_cpu_state.mem + dtb_location);
-		if (dtb[0x13c / 4] == 0x00c0ff03) {
-			uint32_t validram = dtb_location;
-			dtb[0x13c / 4] = (validram >> 24) | (((validram >> 16) & 0xff) << 8) |
-			                 (((validram >> 8) & 0xff) << 16) |
-			                 ((validram & 0xff) << 24);
+	// Image is loaded.
+	time_start = GetTimeMicroseconds();
+resume:
+	time_run = GetTimeMicroseconds();
+	time_idle = 0;
+	for (uint32_t i = 1; i < nharts; i++) {
+		if (pthread_create(&thread, NULL, hart_thread, harts[i])) {
+			fprintf(stderr, "Error: could not start hart %u.\n", i);
+			return -4;
 		}
 	}
+	// A restored machine has no image to boot again.
+	err = run_hart(harts[0]);
+	if (err == RV32_VM_RESTART && nharts == 1 && !restore_file) {
+		RV32_vm_reset(vm);
+		goto restart; // syscon code for restart
+	}
+	exit_code = guest_status(err);
+	exit_now();
+}
 
-	// Image is loaded.
-	uint64_t time_start = GetTimeMicroseconds();
+// Step one hart until it powers off or restarts the machine.
+static int run_hart(RV32_CPU* core) {
+#ifdef RV32_STATS
+	uint64_t stepped = stats_clock(); // End of the last step.
+#endif
+	this_hart = core->hartid;
 	while(1) {
+		if (core->hartid == 0 && snapshot_requested)
+			take_snapshot();
+		else if (core->hartid == 0 && fork_requested)
+			fork_machine();
+		else if (core->hartid && __atomic_load_n(&pause_harts, __ATOMIC_ACQUIRE))
+			park_hart(core);
+#ifdef RV32_STATS
+		if (core->hartid == 0 && stats_requested)
+			dump_stats();
+#endif
 		uint64_t time_n = (GetTimeMicroseconds() - time_start);
-		global_cpu_state.csr[csr_timerl] = time_n & UINT32_MAX;
-		global_cpu_state.csr[csr_timerh] = time_n >> 32;
-		int ret = RV32_step(&global_cpu_state, isr_per);
+		uint64_t count = isr_per;
+		if (prof && count > prof_period)
+			count = prof_period;
+		if (insn_budget) {
+			uint64_t done = core->csr[csr_cyclel] | ((uint64_t)core->csr[csr_cycleh] << 32);
+			if (done >= insn_budget)
+				return 3; // Poweroff
+			if (insn_budget - done < count)
+				count = insn_budget - done;
+		}
+#ifdef RV32_STATS
+		uint64_t stepping = stats_clock();
+		core->stats.loop_ns += stepping - stepped;
+#endif
+		int ret = RV32_vm_step(vm, core->hartid, time_n, count);
+#ifdef RV32_STATS
+		stepped = stats_clock();
+		core->stats.step_ns += stepped - stepping;
+#endif
 		switch (ret) {
-		case 0:
+		case RV32_VM_RUNNING:
+			if (prof)
+				RV32_profile_sample(prof, core);
 			break;
-		case 1:
+		case RV32_VM_IDLE:
+			wait_for_interrupt(core, time_n);
 			/* This isn't necessary */
-			uint64_t this_ccount = global_cpu_state.csr[csr_cyclel] | ((uint64_t)global_cpu_state.csr[csr_cycleh] << 32);
+			uint64_t this_ccount = core->csr[csr_cyclel] | ((uint64_t)core->csr[csr_cycleh] << 32);
 			this_ccount++;
-			global_cpu_state.csr[csr_cyclel] = this_ccount & UINT32_MAX;
-			global_cpu_state.csr[csr_cycleh] = this_ccount >> 32;
+			core->csr[csr_cyclel] = this_ccount & UINT32_MAX;
+			core->csr[csr_cycleh] = this_ccount >> 32;
+			break;
+		case RV32_VM_POWEROFF:
+		case RV32_VM_RESTART:
+			return ret;
+		case RV32_VM_SNAPSHOT:
+			request_snapshot(0);
 			break;
-		case 3:
-			exit_now();
+		case RV32_VM_FORK:
+			request_fork();
 			break;
-		case 0x7777:
-			goto restart; // syscon code for restart
 		default:
+			if ((ret & 0xffff) == RV32_VM_FAIL)
+				return ret;
 			printf("Unknown failure\n");
 			break;
 		}
 	}
+}
+
+// Harts other than 0. They cannot restart the machine on their own, so
+// a restart from any of them powers off.
+static void* hart_thread(void* arg) {
+	exit_code = guest_status(run_hart(arg));
 	exit_now();
+	return NULL;
 }
 
-static int populate_ram(RV32_CPU* core, const char* F_dtb, const char* F_kern, size_t *dtb_location) {
-	FILE* dtb_fno = NULL;
-	FILE* kern_fno = NULL;
-	size_t dtb_size = (size_t)_binary_sixtyfourmb_dtb_size;
-	size_t kern_size = 0;
+static void kick_hart(RV32_CPU* hart) {
+	uint64_t one = 1;
 
-	if (F_dtb) {
-		dtb_fno = fopen(F_dtb, "rb");
-		if (!dtb_fno || ferror(dtb_fno)) {
-			fprintf(stderr, "Error: Could not open: \"%s\"\n", F_dtb);
-			return -2;
+	if (write(wake_fd[hart->hartid], &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd");
+}
+
+// SIGUSR2 handler, and the SYSCON snapshot request from any hart.
+static void request_snapshot(int sig) {
+	snapshot_requested = 1;
+	if (nharts > 1)
+		kick_hart(harts[0]); // Out of WFI; only async-signal-safe calls here.
+}
+
+// Runs on hart 0 between steps: stop the others, then save the machine.
+static void take_snapshot(void) {
+	uint32_t devices_len;
+	void* devices;
+
+	snapshot_requested = 0;
+	pause_others();
+	if (!(devices = RV32_vm_save_devices(vm, &devices_len)) ||
+	    RV32_snapshot_save(harts, nharts, devices, devices_len, snapshot_file))
+		fprintf(stderr, "Error: could not save snapshot to \"%s\": %s\n", snapshot_file,
+		        strerror(errno));
+	free(devices);
+	resume_others();
+}
+
+// Hart 0 only: returns once every other hart sits in park_hart.
+static void pause_others(void) {
+	pthread_mutex_lock(&pause_lock);
+	__atomic_store_n(&pause_harts, 1, __ATOMIC_RELEASE);
+	for (uint32_t i = 1; i < nharts; i++)
+		kick_hart(harts[i]);
+	while (paused < nharts - 1)
+		pthread_cond_wait(&pause_cond, &pause_lock);
+	pthread_mutex_unlock(&pause_lock);
+}
+
+static void resume_others(void) {
+	pthread_mutex_lock(&pause_lock);
+	__atomic_store_n(&pause_harts, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pause_cond);
+	pthread_mutex_unlock(&pause_lock);
+}
+
+static void park_hart(RV32_CPU* core) {
+	pthread_mutex_lock(&pause_lock);
+	paused++;
+	pthread_cond_broadcast(&pause_cond);
+	while (pause_harts)
+		pthread_cond_wait(&pause_cond, &pause_lock);
+	paused--;
+	pthread_mutex_unlock(&pause_lock);
+}
+
+// The SYSCON fork request from any hart, and the control pipe's.
+static void request_fork(void) {
+	fork_requested = 1;
+	if (nharts > 1)
+		kick_hart(harts[0]);
+}
+
+// Runs on hart 0 between steps, like take_snapshot: with the other harts
+// parked and the console drained, fork a clone at a time. Guest RAM is a
+// private anonymous mapping, so the clones share every page until one of
+// them writes it. This process only waits for them, reporting one JSON
+// line per clone and a summary, and exits with 1 if any clone failed.
+static void fork_machine(void) {
+	uint64_t start = GetTimeMicroseconds(), forked;
+	uint32_t count = __atomic_load_n(&fork_count, __ATOMIC_RELAXED), failed = 0;
+	pid_t* pids;
+
+	fork_requested = 0;
+	if (!count)
+		return; // No -F: carry on as the original, index 0.
+	if (!(pids = calloc(count, sizeof(pid_t)))) {
+		fprintf(stderr, "Error: no memory to fork the machine.\n");
+		return;
+	}
+	pause_others();
+	io_flush();
+	fflush(stdout);
+	for (uint32_t i = 0; i < count; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			free(pids);
+			start_clone(i + 1);
+			return;
 		}
-		dtb_size = get_Fsize(dtb_fno);
+		if (pids[i] < 0)
+			perror("fork");
 	}
+	forked = GetTimeMicroseconds() - start;
+	for (uint32_t i = 0; i < count; i++) {
+		int status = -1;
 
-	if (F_kern) {
-		kern_fno = fopen(F_kern, "rb");
-		if (!kern_fno || ferror(kern_fno)) {
-			fprintf(stderr, "Error: Could not open: \"%s\"\n", F_kern);
-			return -3;
-		}
-		kern_size = get_Fsize(kern_fno);
-		if((kern_size+dtb_size) > core->total_mem){
-			fprintf(stderr, "Error: Could not fit dtb: %ld, kernel: %ld into ram: %d.\n", dtb_size, kern_size, core->total_mem);
-			return -4;
-		}
-		if (fread(core->mem, kern_size, 1, kern_fno) != 1) {
-			fprintf(stderr, "Error: Could not load image.\n");
-			return -5;
+		if (pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i])
+			status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		printf("{\"clone\": %u, \"pid\": %d, \"output\": \"%s.%u\", \"status\": %d}\n", i + 1,
+		       (int)pids[i], fork_output, i + 1, status);
+		failed += status != 0;
+	}
+	printf("{\"clones\": %u, \"failed\": %u, \"fork_us\": %llu, \"wall_us\": %llu}\n",
+	       count, failed, (unsigned long long)forked,
+	       (unsigned long long)(GetTimeMicroseconds() - start));
+	exit(failed ? 1 : 0);
+}
+
+// Only the forking thread lives on in a clone: give it its own console
+// file and /dev/null for input, disks of its own and a snapshot file
+// with its index appended, then start the I/O thread and the other
+// harts again, with eventfds of their own so as not to wake the original.
+static void start_clone(uint32_t index) {
+	static char clone_snapshot[4096];
+	char name[4096];
+	pthread_t thread;
+	int fd;
+
+	fork_count = 0; // Clones do not fork again.
+	prof = NULL; // Nor write over the original's profile.
+	if (ctl_fd >= 0)
+		close(ctl_fd); // The control pipe is the original's.
+	ctl_fd = -1;
+	RV32_vm_set_fork_index(vm, index);
+	if (RV32_vm_private_disks(vm)) {
+		fprintf(stderr, "Error: could not make the disks copy-on-write.\n");
+		_exit(-2);
+	}
+	snprintf(clone_snapshot, sizeof(clone_snapshot), "%s.%u", snapshot_file, index);
+	snapshot_file = clone_snapshot;
+	snprintf(name, sizeof(name), "%s.%u", fork_output, index);
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 || dup2(fd, 1) < 0) {
+		fprintf(stderr, "Error: Could not open: \"%s\"\n", name);
+		_exit(-2);
+	}
+	close(fd);
+	if (fork_input)
+		snprintf(name, sizeof(name), "%s.%u", fork_input, index);
+	if ((fd = open(fork_input ? name : "/dev/null", O_RDONLY)) < 0 || dup2(fd, 0) < 0) {
+		fprintf(stderr, "Error: Could not open: \"%s\"\n", name);
+		_exit(-2);
+	}
+	close(fd);
+	watch_stdin = 1;
+	for (uint32_t i = 0; i < nharts; i++) {
+		close(wake_fd[i]);
+		wake_fd[i] = eventfd(0, EFD_NONBLOCK);
+	}
+	close(io_wake);
+	io_wake = eventfd(0, EFD_NONBLOCK);
+	io_sleeping = 0;
+	pthread_mutex_init(&pause_lock, NULL);
+	pthread_cond_init(&pause_cond, NULL);
+	pause_harts = paused = 0;
+	if (io_wake < 0 || pthread_create(&thread, NULL, io_thread, NULL)) {
+		fprintf(stderr, "Error: could not start the I/O thread.\n");
+		_exit(-4);
+	}
+	for (uint32_t i = 1; i < nharts; i++) {
+		if (wake_fd[i] < 0 || pthread_create(&thread, NULL, hart_thread, harts[i])) {
+			fprintf(stderr, "Error: could not start hart %u.\n", i);
+			_exit(-4);
 		}
-		fclose(kern_fno);
 	}
+}
+
+// Exit status for how a hart stopped: SYSCON 0x3333 fails with the code in
+// its top half, 1 if that is 0.
+static int guest_status(int ret) {
+	if ((ret & 0xffff) != RV32_VM_FAIL)
+		return 0;
+	return ret >> 16 & 0xffff ? ret >> 16 & 0xffff : 1;
+}
+
+// The I/O thread's end of the control pipe, a command per line.
+static void read_control(void) {
+	static char line[256];
+	static size_t len;
+	ssize_t n;
+	char* nl;
 
-	*dtb_location = core->total_mem - dtb_size;
-	if (F_dtb) {
-		if (fread(core->mem + *dtb_location, dtb_size, 1, dtb_fno) != 1) {
-			fprintf(stderr, "Error: Could not fit dtb: %ld, kernel: %ld into ram: %d.\n", kern_size, dtb_size, core->total_mem);
-			return -6;
+	while ((n = read(ctl_fd, line + len, sizeof(line) - len)) > 0) {
+		len += n;
+		while ((nl = memchr(line, '\n', len))) {
+			*nl = 0;
+			control_command(line);
+			len -= nl + 1 - line;
+			memmove(line, nl + 1, len);
 		}
-	} else
-		memcpy(core->mem + *dtb_location, _binary_sixtyfourmb_dtb_start, dtb_size);
-	return 0;
+		if (len == sizeof(line))
+			len = 0; // Too long for any command.
+	}
+}
+
+// "fork" clones the machine -F times, "fork N" N times; "snapshot" saves
+// it like SIGUSR2.
+static void control_command(const char* cmd) {
+	unsigned int n;
+	char end;
+
+	if (!strcmp(cmd, "fork")) {
+		request_fork();
+	} else if (sscanf(cmd, "fork %u%c", &n, &end) == 1 && n <= 4096) {
+		__atomic_store_n(&fork_count, n, __ATOMIC_RELAXED);
+		request_fork();
+	} else if (!strcmp(cmd, "snapshot")) {
+		request_snapshot(0);
+	} else {
+		fprintf(stderr, "Error: unknown control command \"%s\".\n", cmd);
+		return;
+	}
+	kick_hart(harts[0]); // Out of WFI, if it is the only hart.
 }
 
-static size_t get_Fsize(FILE* fno) {
-	size_t size = 0;
-	size_t pos = 0;
-	if(!fno || ferror(fno))
-		return -0;
-	pos = ftell(fno);
-	fseek(fno, 0, SEEK_END);
-	size = ftell(fno);
-	fseek(fno, pos, SEEK_SET);
-	return size;
+#ifdef RV32_STATS
+static void request_stats(int sig) {
+	stats_requested = 1;
+	if (nharts > 1)
+		kick_hart(harts[0]);
 }
 
+static uint64_t stats_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// All harts' counters summed, as one line of JSON on stderr. Other harts
+// keep running, so their counts may be a step stale.
+static void dump_stats(void) {
+	static const char* const opcodes[32] = {
+		"LOAD", "LOAD-FP", "custom-0", "MISC-MEM", "OP-IMM", "AUIPC", [8] = "STORE",
+		"STORE-FP", "custom-1", "AMO", "OP", "LUI", [16] = "MADD", "MSUB", "NMSUB",
+		"NMADD", "OP-FP", [22] = "custom-2", [24] = "BRANCH", "JALR", [27] = "JAL",
+		"SYSTEM", [30] = "custom-3",
+	};
+	static const char* const fused[RV32_FUSE_COUNT] = {
+		"lui+addi", "auipc+jalr", "auipc+load", "slt+branch", "addi+bne",
+	};
+	const RV32_bus* bus = &harts[0]->bus;
+	RV32_stats sum = {0};
+	const char* sep = "";
+	uint32_t i, h;
+
+	stats_requested = 0;
+	for (h = 0; h < nharts; h++) {
+		const RV32_stats* st = &harts[h]->stats;
+		for (i = 0; i < 32; i++)
+			sum.opcodes[i] += st->opcodes[i];
+		for (i = 0; i < 16; i++) {
+			sum.traps[i] += st->traps[i];
+			sum.irqs[i] += st->irqs[i];
+		}
+		for (i = 0; i < RV32_BUS_DEVICES; i++) {
+			sum.mmio_loads[i] += st->mmio_loads[i];
+			sum.mmio_stores[i] += st->mmio_stores[i];
+		}
+		for (i = 0; i < RV32_FUSE_COUNT; i++)
+			sum.fused[i] += st->fused[i];
+		sum.wfi += st->wfi;
+		sum.step_ns += st->step_ns;
+		sum.loop_ns += st->loop_ns;
+	}
+
+	fprintf(stderr, "{\"harts\": %u, \"retired\": {", nharts);
+	for (i = 0; i < 32; i++) {
+		if (!sum.opcodes[i])
+			continue;
+		fprintf(stderr, "%s\"%s\": %llu", sep, opcodes[i] ? opcodes[i] : "?",
+		        (unsigned long long)sum.opcodes[i]);
+		sep = ", ";
+	}
+	fprintf(stderr, "}, \"traps\": {");
+	for (i = 0, sep = ""; i < 16; i++) {
+		if (!sum.traps[i])
+			continue;
+		fprintf(stderr, "%s\"%u\": %llu", sep, i, (unsigned long long)sum.traps[i]);
+		sep = ", ";
+	}
+	fprintf(stderr, "}, \"interrupts\": {");
+	for (i = 0, sep = ""; i < 16; i++) {
+		if (!sum.irqs[i])
+			continue;
+		fprintf(stderr, "%s\"%u\": %llu", sep, i, (unsigned long long)sum.irqs[i]);
+		sep = ", ";
+	}
+	fprintf(stderr, "}, \"timer_interrupts\": %llu, \"mmio\": {",
+	        (unsigned long long)sum.irqs[7]);
+	for (i = 0, sep = ""; i < bus->ndevices; i++, sep = ", ")
+		fprintf(stderr, "%s\"0x%08x\": {\"loads\": %llu, \"stores\": %llu}", sep,
+		        bus->devices[i].base, (unsigned long long)sum.mmio_loads[i],
+		        (unsigned long long)sum.mmio_stores[i]);
+	fprintf(stderr, "}, \"fused\": {");
+	for (i = 0, sep = ""; i < RV32_FUSE_COUNT; i++, sep = ", ")
+		fprintf(stderr, "%s\"%s\": %llu", sep, fused[i], (unsigned long long)sum.fused[i]);
+	fprintf(stderr, "}, \"wfi\": %llu, \"step_us\": %llu, \"loop_us\": %llu}\n",
+	        (unsigned long long)sum.wfi, (unsigned long long)sum.step_ns / 1000,
+	        (unsigned long long)sum.loop_ns / 1000);
+}
+#endif
+
 static void help(int code)
 {
  	puts("+----------------------------------------+");
@@ -212,44 +767,333 @@ static void help(int code)
 	puts("| -k - Boot Image @0x80000000 (required).|");
 	puts("| -d - DTB Image.                        |");
 	puts("| -r - Total RAM to use in read in HEX.  |");
-	puts("| -i - Instructions before timer update. |");
+	puts("| -i - Most insns between clock samples. |");
+	puts("| -n - Power off after this many insns.  |");
+	puts("| -t - Use the threaded block engine.    |");
+	puts("| -j - Use the x86-64 JIT.               |");
+	puts("| -J - JIT checked against interpreter.  |");
+	puts("| -H - Back RAM with huge pages.         |");
+	puts("| -c - Number of harts (default 1).      |");
+	puts("| -s - Snapshot file for SIGUSR2/SYSCON. |");
+	puts("| -l - Resume a snapshot, same -D and -V.|");
+	puts("| -f - Run the jobs in a fleet manifest. |");
+	puts("| -w - Fleet worker threads (1 per CPU). |");
+	puts("| -D - virtio disk image (repeatable).   |");
+	puts("| -V - Add a virtio console (hvc0).      |");
+	puts("| -p - Profile guest to folded stacks.   |");
+	puts("| -P - Insns per profile sample.         |");
+	puts("| -y - Symbols: ELF or System.map.       |");
+	puts("| -F - Clones made at a SYSCON fork.     |");
+	puts("| -O - Clone output, .1, .2... appended. |");
+	puts("| -I - Clone input, .1, .2... appended.  |");
+	puts("| -C - Control pipe: fork [n], snapshot. |");
  	puts("+----------------------------------------+");
  	exit(code);
 }
 
-uint32_t HandleControlStore(uint32_t addy, uint32_t val) {
-	if (addy == 0x10000000) // UART 8250 / 16550 Data Buffer
-	{
-		printf("%c", val);
-		fflush(stdout);
+// Fleet mode: every line of the manifest is a job, as key=value words
+//   image=Image dtb=board.dtb ram=0x4000000 input=in.txt output=out.txt disk=data.img insns=N
+// where only image is required. Blank lines and lines from # on are
+// skipped. Prints a JSON line per job, then one for the whole fleet.
+static int run_fleet(const char* manifest, uint32_t workers, int engine) {
+	FILE* f = fopen(manifest, "r");
+	RV32_job* jobs = NULL;
+	uint32_t njobs = 0, failed = 0;
+	uint64_t *latency, insns = 0, sum = 0, start, wall;
+	char* line = NULL;
+	size_t len = 0;
+
+	if (!f) {
+		fprintf(stderr, "Error: Could not open: \"%s\"\n", manifest);
+		return -2;
 	}
-	return 0;
+	while (getline(&line, &len, f) > 0) {
+		RV32_job job = {0};
+		char *word, *save, *val;
+
+		if ((word = strchr(line, '#')))
+			*word = 0;
+		for (word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+			if (!(val = strchr(word, '='))) {
+				fprintf(stderr, "Error: \"%s\" in %s is not key=value.\n", word, manifest);
+				return -2;
+			}
+			*val++ = 0;
+			if (!strcmp(word, "image"))
+				job.image = strdup(val);
+			else if (!strcmp(word, "dtb"))
+				job.dtb = strdup(val);
+			else if (!strcmp(word, "input"))
+				job.input = strdup(val);
+			else if (!strcmp(word, "output"))
+				job.output = strdup(val);
+			else if (!strcmp(word, "disk"))
+				job.disk = strdup(val);
+			else if (!strcmp(word, "ram"))
+				job.ram_size = strtoul(val, NULL, 0);
+			else if (!strcmp(word, "insns"))
+				job.max_insns = strtoull(val, NULL, 0);
+			else {
+				fprintf(stderr, "Error: unknown key \"%s\" in %s.\n", word, manifest);
+				return -2;
+			}
+		}
+		if (!job.image && !job.dtb && !job.input && !job.output && !job.disk &&
+		    !job.ram_size && !job.max_insns)
+			continue;
+		if (!job.image) {
+			fprintf(stderr, "Error: job %u in %s has no image.\n", njobs, manifest);
+			return -2;
+		}
+		if (!(jobs = realloc(jobs, (njobs + 1) * sizeof(RV32_job))))
+			return -4;
+		jobs[njobs++] = job;
+	}
+	free(line);
+	fclose(f);
+
+	if (!workers) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? cpus : 1;
+	}
+	start = GetTimeMicroseconds();
+	if (RV32_fleet_run(jobs, njobs, workers, engine)) {
+		fprintf(stderr, "Error: could not start the fleet.\n");
+		return -4;
+	}
+	wall = GetTimeMicroseconds() - start;
+
+	if (!(latency = malloc((njobs ? njobs : 1) * sizeof(uint64_t))))
+		return -4;
+	for (uint32_t i = 0; i < njobs; i++) {
+		printf("{\"job\": %u, \"image\": \"%s\", \"status\": %d, \"insns\": %llu, "
+		       "\"run_us\": %llu, \"latency_us\": %llu}\n",
+		       i, jobs[i].image, jobs[i].status, (unsigned long long)jobs[i].insns,
+		       (unsigned long long)jobs[i].run_us, (unsigned long long)jobs[i].latency_us);
+		failed += jobs[i].status < 0;
+		insns += jobs[i].insns;
+		sum += latency[i] = jobs[i].latency_us;
+	}
+	qsort(latency, njobs, sizeof(uint64_t), cmp_u64);
+#define PCT(p) (unsigned long long)(njobs ? latency[(njobs - 1) * (p) / 100] : 0)
+	printf("{\"jobs\": %u, \"failed\": %u, \"threads\": %u, \"insns\": %llu, \"wall_us\": %llu, "
+	       "\"mips\": %.2f, \"latency_us\": {\"mean\": %llu, \"p50\": %llu, \"p90\": %llu, "
+	       "\"p99\": %llu, \"max\": %llu}}\n",
+	       njobs, failed, workers, (unsigned long long)insns, (unsigned long long)wall,
+	       wall ? (double)insns / wall : 0.0, (unsigned long long)(njobs ? sum / njobs : 0),
+	       PCT(50), PCT(90), PCT(99), PCT(100));
+#undef PCT
+	return failed ? -1 : 0;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
 }
 
-uint32_t HandleControlLoad(uint32_t addy) {
-	// Emulating a 8250 / 16550 UART
-	int byteswaiting, rread;
-	char rxchar = 0;
-	/* Are there pending bytes */
-	ioctl(0, FIONREAD, &byteswaiting);
-	if (addy == 0x10000005)
-		return 0x60 | !!byteswaiting;
-	else if (addy == 0x10000000 && byteswaiting) {
-		rread = read(0, &rxchar, 1);
-		return (rread > 0)?rxchar:-1;
+// The guest UART is the terminal. Blocks only while the ring is full.
+static void console_out(void* opaque, const uint8_t* buf, size_t len) {
+	io_ring* r = &tx[this_hart];
+	uint32_t head = r->head;
+
+	while (len) {
+		if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == IO_RING_SIZE) {
+			__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+			wake_io();
+			sched_yield();
+			continue;
+		}
+		r->buf[head++ & (IO_RING_SIZE - 1)] = *buf++;
+		len--;
 	}
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	wake_io();
+}
+
+// Only costs a syscall when the I/O thread went to sleep for good; while
+// output keeps coming it lingers and picks it up on its own.
+static void wake_io(void) {
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // Order the ring head before io_sleeping.
+	if (__atomic_load_n(&io_sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&io_sleeping, 0, __ATOMIC_SEQ_CST))
+		if (write(io_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("eventfd");
+}
+
+static int io_queued(void) {
+	for (uint32_t i = 0; i < nharts; i++)
+		if (__atomic_load_n(&tx[i].head, __ATOMIC_ACQUIRE) != tx[i].tail)
+			return 1;
 	return 0;
 }
 
+// Writes out every ring, returning whether there was anything. Output
+// from different harts interleaves at whatever point it was picked up.
+static int io_drain(void) {
+	int busy = 0;
+
+	for (uint32_t i = 0; i < nharts; i++) {
+		io_ring* r = &tx[i];
+		uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = r->tail;
+
+		while (tail != head) {
+			uint32_t ofs = tail & (IO_RING_SIZE - 1);
+			uint32_t len = head - tail < IO_RING_SIZE - ofs ? head - tail : IO_RING_SIZE - ofs;
+			ssize_t n = write(1, r->buf + ofs, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			tail += n > 0 ? n : len; // Output that cannot be written is dropped.
+		}
+		// Only now, so an empty ring means it reached stdout (io_flush).
+		if (tail != r->tail) {
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+			busy = 1;
+		}
+	}
+	return busy;
+}
+
+static void io_flush(void) {
+	while (io_queued()) {
+		wake_io();
+		sched_yield();
+	}
+}
+
+// Drains console output in batches and feeds stdin to the machine's input
+// queue, kicking hart 0 out of WFI when it adds some.
+static void* io_thread(void* arg) {
+	struct epoll_event ev = {EPOLLIN}, events[3];
+	uint8_t in[4096];
+	size_t in_len = 0, in_ofs = 0;
+	int ep = epoll_create1(0);
+	int poll_stdin; // 0 for files and the like, which are always ready.
+	uint64_t kicks;
+
+	ev.data.fd = io_wake;
+	epoll_ctl(ep, EPOLL_CTL_ADD, io_wake, &ev);
+	if (ctl_fd >= 0) {
+		ev.data.fd = ctl_fd;
+		epoll_ctl(ep, EPOLL_CTL_ADD, ctl_fd, &ev);
+	}
+	ev.data.fd = 0;
+	poll_stdin = !epoll_ctl(ep, EPOLL_CTL_ADD, 0, &ev);
+	while (1) {
+		int timeout = -1, n;
+
+		if (in_ofs < in_len) {
+			size_t queued = RV32_vm_input(vm, in + in_ofs, in_len - in_ofs);
+			if (queued)
+				kick_hart(harts[0]);
+			in_ofs += queued;
+		}
+		if (watch_stdin && in_ofs == in_len && !poll_stdin) {
+			ssize_t got = read(0, in, sizeof(in));
+			if (got > 0)
+				in_ofs = 0, in_len = got;
+			else
+				__atomic_store_n(&watch_stdin, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		// Retry input the queue had no room for; stdin waits until then.
+		if (in_ofs < in_len)
+			timeout = IO_LINGER_MS;
+		if (io_drain())
+			timeout = IO_LINGER_MS;
+		if (timeout < 0) {
+			__atomic_store_n(&io_sleeping, 1, __ATOMIC_SEQ_CST);
+			if (io_queued()) {
+				__atomic_store_n(&io_sleeping, 0, __ATOMIC_RELAXED);
+				continue;
+			}
+		}
+		n = epoll_wait(ep, events, 3, timeout);
+		__atomic_store_n(&io_sleeping, 0, __ATOMIC_RELAXED);
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == io_wake) {
+				while (read(io_wake, &kicks, sizeof(kicks)) > 0)
+					;
+			} else if (events[i].data.fd == ctl_fd) {
+				read_control();
+			} else if (in_ofs == in_len) {
+				ssize_t got = read(0, in, sizeof(in));
+				if (got > 0) {
+					in_ofs = 0, in_len = got;
+				} else if (got == 0 || errno != EAGAIN) {
+					epoll_ctl(ep, EPOLL_CTL_DEL, 0, NULL);
+					__atomic_store_n(&watch_stdin, 0, __ATOMIC_RELAXED);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
 static void exit_now() {
-	DumpState(&global_cpu_state);
-	exit(0);
+	uint64_t total = GetTimeMicroseconds() - time_run;
+	uint64_t idle = __atomic_load_n(&time_idle, __ATOMIC_RELAXED);
+	uint64_t insns = 0;
+
+	io_flush();
+	if (prof) {
+		if (RV32_profile_write(prof, profile_file))
+			fprintf(stderr, "Error: could not write profile to \"%s\".\n", profile_file);
+		else
+			fprintf(stderr, "Profile: %llu samples in %s\n",
+			        (unsigned long long)RV32_profile_samples(prof), profile_file);
+	}
+	// Harts still waiting (say, never released from WFI) are idle too.
+	for (uint32_t i = 0; i < nharts; i++) {
+		uint64_t since = __atomic_load_n(&sleeping_since[i], __ATOMIC_RELAXED);
+		if (since)
+			idle += GetTimeMicroseconds() - since;
+		insns += harts[i]->csr[csr_cyclel] | ((uint64_t)harts[i]->csr[csr_cycleh] << 32);
+	}
+	DumpState(harts[0]);
+	printf("Idle: %llu us, busy: %llu us\n", (unsigned long long)idle,
+	       (unsigned long long)(total * nharts - idle));
+	// Read by bench/run.sh.
+	printf("Insns: %llu, wall: %llu us, %.2f MIPS, %.2f ns/insn\n", (unsigned long long)insns,
+	       (unsigned long long)total, total ? (double)insns / total : 0.0,
+	       insns ? total * 1000.0 / insns : 0.0);
+#ifdef RV32_STATS
+	fflush(stdout);
+	dump_stats();
+#endif
+	exit(exit_code);
+}
+
+// WFI: block until the timer would fire or this hart gets kicked, by
+// another hart or by the I/O thread with input for hart 0, rather than
+// spinning through RV32_step. now is the guest timer in microseconds.
+static void wait_for_interrupt(RV32_CPU* core, uint64_t now) {
+	uint64_t match = ((uint64_t)core->csr[csr_timermatchh] << 32) |
+	                 core->csr[csr_timermatchl];
+	uint64_t wait = match > now ? match - now + 1 : 0; // The timer fires once past match.
+	struct timespec ts = {wait / 1000000, (wait % 1000000) * 1000};
+	struct pollfd pfd = {wake_fd[core->hartid], POLLIN, 0};
+	uint64_t slept = GetTimeMicroseconds();
+	uint64_t kicks;
+
+	if (!match && nharts == 1 && !__atomic_load_n(&watch_stdin, __ATOMIC_RELAXED))
+		return; // Nothing could ever wake us.
+	__atomic_store_n(&sleeping_since[core->hartid], slept, __ATOMIC_RELAXED);
+	if (ppoll(&pfd, 1, match ? &ts : NULL, NULL) > 0)
+		while (read(wake_fd[core->hartid], &kicks, sizeof(kicks)) > 0)
+			;
+	__atomic_store_n(&sleeping_since[core->hartid], 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&time_idle, GetTimeMicroseconds() - slept, __ATOMIC_RELAXED);
 }
 
 static uint64_t GetTimeMicroseconds() {
-	struct timeval tv;
-	gettimeofday(&tv, 0);
-	return tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts); // vDSO, no syscall.
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
 }
 
 static void DumpState(RV32_CPU* core) {